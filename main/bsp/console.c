@@ -0,0 +1,74 @@
+#include <string.h>
+#include <driver/uart.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "sdkconfig.h"
+#include "config/app_config.h"
+#include "services/trace.h"
+#include "services/capture.h"
+#include "console.h"
+#include "esp_log.h"
+
+
+/*
+ * The dumps are long runs of log lines through the UART; the task runs below everything else so that they only
+ * take the time the controller and the Modbus task leave free
+ */
+
+
+#define CONSOLE_PORTNUM  CONFIG_ESP_CONSOLE_UART_NUM
+#define CONSOLE_PRIORITY 1
+#define MAX_LINE         32
+
+
+static void console_task(void *args);
+static void execute(const char *line);
+
+
+static const char *TAG = "Console";
+
+
+void console_init(void) {
+    // Only the receiving side is needed, the log keeps writing to the UART directly
+    ESP_ERROR_CHECK(uart_driver_install(CONSOLE_PORTNUM, 256, 0, 0, NULL, 0));
+
+    static uint8_t      task_stack[APP_CONFIG_BASE_TASK_STACK_SIZE * 6] = {0};
+    static StaticTask_t static_task;
+    xTaskCreateStatic(console_task, TAG, sizeof(task_stack), NULL, CONSOLE_PRIORITY, task_stack, &static_task);
+}
+
+
+static void console_task(void *args) {
+    (void)args;
+    char   line[MAX_LINE] = {0};
+    size_t len            = 0;
+
+    for (;;) {
+        uint8_t c = 0;
+        if (uart_read_bytes(CONSOLE_PORTNUM, &c, 1, portMAX_DELAY) <= 0) {
+            continue;
+        }
+
+        if (c == '\r' || c == '\n') {
+            line[len] = '\0';
+            if (len > 0) {
+                execute(line);
+            }
+            len = 0;
+        } else if (len < sizeof(line) - 1) {
+            line[len++] = c;
+        }
+    }
+
+    vTaskDelete(NULL);
+}
+
+
+static void execute(const char *line) {
+    if (strcmp(line, "dump") == 0) {
+        trace_dump();
+        capture_dump();
+    } else {
+        ESP_LOGW(TAG, "Unknown command: %s", line);
+    }
+}
@@ -0,0 +1,12 @@
+#ifndef CONSOLE_H_INCLUDED
+#define CONSOLE_H_INCLUDED
+
+
+/*
+ * Diagnostic commands typed on the console UART, served by a low priority task:
+ *   dump    writes the event trace and the frame capture to the log
+ */
+void console_init(void);
+
+
+#endif
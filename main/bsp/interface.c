@@ -1,30 +1,59 @@
 #include <inttypes.h>
 #include "freertos/FreeRTOS.h"
-#include "freertos/timers.h"
 #include "hardwareprofile.h"
 #include "interface.h"
 #include "keypad.h"
 #include <esp_err.h>
 #include "services/system_time.h"
+#include "services/wakeup.h"
 #include "esp_log.h"
 
 
 #define NUM_KEYS 1
 
+// The keypad routine still needs a few samples after the release to debounce it
+#define BUTTON_RELEASE_POLLING_MS 100
+
+#define LED_LIFETIME_LAMP (NUM_LED_BALLAST)
+#define LED_SAFETY        (NUM_LED_BALLAST + 1)
+#define NUM_LEDS          (NUM_LED_BALLAST + 2)
+
+#define LED_LEVEL_UNKNOWN 0xFF
+
+
+/*
+ * Every LED follows a cached pattern, evaluated against the system time: blinking LEDs with the same period and
+ * phase toggle together, and the GPIO is written only when the computed level changes.
+ */
+typedef enum {
+    LED_MODE_OFF = 0,
+    LED_MODE_ON,
+    LED_MODE_BLINK,
+} led_mode_t;
+
+
+typedef struct {
+    led_mode_t    mode;
+    unsigned long period;     // Time spent in each level while blinking
+    unsigned long phase;
+} led_pattern_t;
+
 
 typedef struct {
-    gpio_num_t gpio;
-    uint8_t    state;
-} led_ballast_t;
+    gpio_num_t    gpio;
+    led_pattern_t pattern;
+    uint8_t       level;
+} led_t;
 
 
-static void ballast_timer_cb(TimerHandle_t timer);
-static void warning_timer_cb(TimerHandle_t timer);
+static void    set_pattern(size_t led, led_mode_t mode, unsigned long period, unsigned long phase);
+static uint8_t pattern_level(const led_pattern_t *pattern, unsigned long now);
+static void    button_isr_handler(void *arg);
 
 
-static const char   *TAG = "Interface";
-static TimerHandle_t timers[NUM_LED_BALLAST];
-static TimerHandle_t warning_timer;
+static const char   *TAG                = "Interface";
+static led_t         leds[NUM_LEDS]     = {0};
+static unsigned long button_ts          = 0;
 static keypad_key_t  keys[NUM_KEYS + 1] = {
     {.bitvalue = 1, .code = 1},
     KEYPAD_NULL_KEY,
@@ -47,92 +76,146 @@ void interface_init(void) {
     gpio_config_t config_in = {
         .intr_type    = GPIO_INTR_DISABLE,
         .mode         = GPIO_MODE_INPUT,
-        .pin_bit_mask = BIT64(HAP_PULS_RESET_LIFETIME_LAMP) | BIT64(HAP_LEG_G),
+        .pin_bit_mask = BIT64(HAP_LEG_G),
         .pull_down_en = GPIO_PULLDOWN_DISABLE,
         .pull_up_en   = GPIO_PULLUP_ENABLE,
     };
     ESP_ERROR_CHECK(gpio_config(&config_in));
 
-    static led_ballast_t led_ballast[NUM_LED_BALLAST];
-    static StaticTimer_t timer_buffers[NUM_LED_BALLAST];
-    const gpio_num_t     gpios[NUM_LED_BALLAST] = {HAP_BAL1, HAP_BAL2, HAP_BAL3, HAP_BAL4};
-
-    for (size_t i = 0; i < NUM_LED_BALLAST; i++) {
-        led_ballast[i].gpio  = gpios[i];
-        led_ballast[i].state = 0;
-        timers[i] =
-            xTimerCreateStatic(TAG, pdMS_TO_TICKS(500), 1, &led_ballast[i], ballast_timer_cb, &timer_buffers[i]);
+    // Button edges wake up the main loop
+    gpio_config_t config_button = {
+        .intr_type    = GPIO_INTR_ANYEDGE,
+        .mode         = GPIO_MODE_INPUT,
+        .pin_bit_mask = BIT64(HAP_PULS_RESET_LIFETIME_LAMP),
+        .pull_down_en = GPIO_PULLDOWN_DISABLE,
+        .pull_up_en   = GPIO_PULLUP_ENABLE,
+    };
+    ESP_ERROR_CHECK(gpio_config(&config_button));
+    // Shared with the safety input, it might already be installed
+    gpio_install_isr_service(0);
+    ESP_ERROR_CHECK(gpio_isr_handler_add(HAP_PULS_RESET_LIFETIME_LAMP, button_isr_handler, NULL));
+
+    const gpio_num_t gpios[NUM_LEDS] = {HAP_BAL1, HAP_BAL2, HAP_BAL3, HAP_BAL4, HAP_EXP_LIFE_LAMP, HAP_SAFETY_ALARM};
+    for (size_t i = 0; i < NUM_LEDS; i++) {
+        leds[i].gpio    = gpios[i];
+        leds[i].pattern = (led_pattern_t){.mode = LED_MODE_OFF};
+        leds[i].level   = LED_LEVEL_UNKNOWN;
     }
 
-    static StaticTimer_t timer_buffer;
-    warning_timer = xTimerCreateStatic(TAG, pdMS_TO_TICKS(1000), 1, NULL, warning_timer_cb, &timer_buffer);
-
     interface_set_warning_alarm_off();
     interface_set_led_state_off(INTERFACE_LED_1);
     interface_set_led_state_off(INTERFACE_LED_2);
     interface_set_led_state_off(INTERFACE_LED_3);
     interface_set_led_state_off(INTERFACE_LED_4);
+    interface_set_safety(0);
+    interface_refresh_leds();
+
+    ESP_LOGI(TAG, "Initialized");
 }
 
 
 uint8_t interface_manage(void) {
     uint32_t       level = !gpio_get_level(HAP_PULS_RESET_LIFETIME_LAMP);
     keypad_event_t event = keypad_routine(keys, 40, 5000, 500, get_millis(), level);
+    if (level) {
+        button_ts = get_millis();
+    }
     return event.tag == KEYPAD_EVENT_TAG_LONGCLICK || event.tag == KEYPAD_EVENT_TAG_LONGPRESSING;
 }
 
 
+/*
+ * The button must be sampled periodically while held and shortly after the release
+ */
+uint8_t interface_needs_polling(void) {
+    return !gpio_get_level(HAP_PULS_RESET_LIFETIME_LAMP) ||
+           !is_expired(button_ts, get_millis(), BUTTON_RELEASE_POLLING_MS);
+}
+
+
+/*
+ * Brings every LED to the level of its pattern; returns how long until the next blinking LED toggles
+ */
+unsigned long interface_refresh_leds(void) {
+    unsigned long now  = get_millis();
+    unsigned long next = DEADLINE_NONE;
+
+    for (size_t i = 0; i < NUM_LEDS; i++) {
+        uint8_t level = pattern_level(&leds[i].pattern, now);
+        if (level != leds[i].level) {
+            gpio_set_level(leds[i].gpio, level);
+            leds[i].level = level;
+        }
+
+        if (leds[i].pattern.mode == LED_MODE_BLINK) {
+            unsigned long period = leds[i].pattern.period;
+            next                 = MIN(next, period - ((now + leds[i].pattern.phase) % period));
+        }
+    }
+
+    return next;
+}
+
+
 void interface_set_safety(uint8_t led) {
-    gpio_set_level(HAP_SAFETY_ALARM, led);
+    set_pattern(LED_SAFETY, led ? LED_MODE_ON : LED_MODE_OFF, 0, 0);
 }
 
 
 void interface_set_led_state_off(interface_led_t led) {
-    const gpio_num_t gpios[NUM_LED_BALLAST] = {HAP_BAL1, HAP_BAL2, HAP_BAL3, HAP_BAL4};
-    xTimerStop(timers[led], portMAX_DELAY);
-    gpio_set_level(gpios[led], 0);
+    set_pattern(led, LED_MODE_OFF, 0, 0);
 }
 
 
 void interface_set_led_state_on(interface_led_t led) {
-    const gpio_num_t gpios[NUM_LED_BALLAST] = {HAP_BAL1, HAP_BAL2, HAP_BAL3, HAP_BAL4};
-    xTimerStop(timers[led], portMAX_DELAY);
-    gpio_set_level(gpios[led], 1);
+    set_pattern(led, LED_MODE_ON, 0, 0);
 }
 
 
 void interface_set_led_state_blink(interface_led_t led, unsigned long millis) {
-    xTimerChangePeriod(timers[led], pdMS_TO_TICKS(millis), portMAX_DELAY);
-    xTimerStart(timers[led], portMAX_DELAY);
+    set_pattern(led, LED_MODE_BLINK, millis, 0);
 }
 
 
 void interface_set_warning_alarm_off(void) {
-    xTimerStop(warning_timer, portMAX_DELAY);
-    gpio_set_level(HAP_EXP_LIFE_LAMP, 0);
+    set_pattern(LED_LIFETIME_LAMP, LED_MODE_OFF, 0, 0);
 }
 
 
 void interface_set_warning(void) {
-    xTimerStart(warning_timer, portMAX_DELAY);
+    set_pattern(LED_LIFETIME_LAMP, LED_MODE_BLINK, 1000, 0);
 }
 
 
 void interface_set_alarm(void) {
-    xTimerStop(warning_timer, portMAX_DELAY);
-    gpio_set_level(HAP_EXP_LIFE_LAMP, 1);
+    set_pattern(LED_LIFETIME_LAMP, LED_MODE_ON, 0, 0);
 }
 
 
-static void ballast_timer_cb(TimerHandle_t timer) {
-    led_ballast_t *led_ballast = pvTimerGetTimerID(timer);
-    gpio_set_level(led_ballast->gpio, led_ballast->state);
-    led_ballast->state = !led_ballast->state;
+static void set_pattern(size_t led, led_mode_t mode, unsigned long period, unsigned long phase) {
+    led_pattern_t pattern = {.mode = mode};
+    if (mode == LED_MODE_BLINK) {
+        pattern.period = period > 0 ? period : 1;
+        pattern.phase  = phase % pattern.period;
+    }
+    // Levels derive from the time rather than from when the pattern was set, so setting it again changes nothing
+    leds[led].pattern = pattern;
+}
+
+
+static uint8_t pattern_level(const led_pattern_t *pattern, unsigned long now) {
+    switch (pattern->mode) {
+        case LED_MODE_ON:
+            return 1;
+        case LED_MODE_BLINK:
+            return ((now + pattern->phase) / pattern->period) % 2;
+        default:
+            return 0;
+    }
 }
 
 
-static void warning_timer_cb(TimerHandle_t timer) {
-    static uint8_t blink = 0;
-    gpio_set_level(HAP_EXP_LIFE_LAMP, blink);
-    blink = !blink;
+static void IRAM_ATTR button_isr_handler(void *arg) {
+    (void)arg;
+    wakeup_signal_from_isr(WAKEUP_EVENT_BUTTON);
 }
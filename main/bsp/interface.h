@@ -16,15 +16,17 @@ typedef enum {
 } interface_led_t;
 
 
-void    interface_init(void);
-void    interface_set_led_state_off(interface_led_t led);
-void    interface_set_led_state_on(interface_led_t led);
-void    interface_set_led_state_blink(interface_led_t led, unsigned long millis);
-void    interface_set_warning_alarm_off(void);
-void    interface_set_warning(void);
-void    interface_set_alarm(void);
-uint8_t interface_manage(void);
-void    interface_set_safety(uint8_t led);
+void          interface_init(void);
+void          interface_set_led_state_off(interface_led_t led);
+void          interface_set_led_state_on(interface_led_t led);
+void          interface_set_led_state_blink(interface_led_t led, unsigned long millis);
+void          interface_set_warning_alarm_off(void);
+void          interface_set_warning(void);
+void          interface_set_alarm(void);
+uint8_t       interface_manage(void);
+uint8_t       interface_needs_polling(void);
+unsigned long interface_refresh_leds(void);
+void          interface_set_safety(uint8_t led);
 
 
 #endif
@@ -2,6 +2,7 @@
 #include <driver/gpio.h>
 #include "hardwareprofile.h"
 #include "easyconnect_interface.h"
+#include "services/capture.h"
 
 
 #define MB_PORTNUM 1
@@ -30,12 +31,17 @@ void rs485_init(void) {
 
 
 void rs485_write(const uint8_t *data, size_t len) {
+    capture_frame(CAPTURE_DIRECTION_TX, data, len);
     uart_write_bytes(MB_PORTNUM, data, len);
 }
 
 
 int rs485_read(uint8_t *buffer, size_t len, unsigned long ms) {
-    return uart_read_bytes(MB_PORTNUM, buffer, len, pdMS_TO_TICKS(ms));
+    int res = uart_read_bytes(MB_PORTNUM, buffer, len, pdMS_TO_TICKS(ms));
+    if (res > 0) {
+        capture_frame(CAPTURE_DIRECTION_RX, buffer, res);
+    }
+    return res;
 }
 
 
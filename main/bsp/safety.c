@@ -1,25 +1,40 @@
+#include <stdatomic.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/timers.h"
-#include "freertos/semphr.h"
 #include "hardwareprofile.h"
 #include "debounce.h"
+#include "safety.h"
+#include "services/wakeup.h"
+#include "services/trace.h"
 #include <esp_log.h>
 
 
-#define EVENT_NEW_INPUT 0x01
+/*
+ * A trip is taken on the first edge, straight from the interrupt; going back to safe requires the input
+ * to stay good for SAFETY_RESTORE_SAMPLES periodic readings.
+ */
+
+
+#define SAFETY_READ_PERIOD_MS  10
+#define SAFETY_RESTORE_SAMPLES 5
 
 
 static void periodic_read(TimerHandle_t timer);
+static void safety_isr_handler(void *arg);
+static void trip(uint8_t from_isr);
 
 
-static debounce_filter_t filter = {0};
-static SemaphoreHandle_t sem    = NULL;
-static const char       *TAG    = "Safety";
+static debounce_filter_t    filter  = {0};
+static atomic_uint_fast8_t  safe    = 0;
+static atomic_uint_fast8_t  tripped = 0;
+static atomic_uint_fast32_t trips   = 0;
+static safety_trip_cb_t     trip_cb = NULL;
+static const char          *TAG     = "Safety";
 
 
 void safety_init(void) {
     gpio_config_t config_in = {
-        .intr_type    = GPIO_INTR_DISABLE,
+        .intr_type    = GPIO_INTR_ANYEDGE,
         .mode         = GPIO_MODE_INPUT,
         .pin_bit_mask = BIT64(HAP_SAFETY_INPUT),
         .pull_down_en = GPIO_PULLDOWN_DISABLE,
@@ -28,22 +43,36 @@ void safety_init(void) {
     ESP_ERROR_CHECK(gpio_config(&config_in));
 
     debounce_filter_init(&filter);
-    static StaticSemaphore_t semaphore_buffer;
-    sem = xSemaphoreCreateMutexStatic(&semaphore_buffer);
+
+    // Shared with the button, it might already be installed
+    gpio_install_isr_service(0);
+    ESP_ERROR_CHECK(gpio_isr_handler_add(HAP_SAFETY_INPUT, safety_isr_handler, NULL));
 
     static StaticTimer_t timer_buffer;
-    TimerHandle_t        timer =
-        xTimerCreateStatic("timerSafety", pdMS_TO_TICKS(10), pdTRUE, NULL, periodic_read, &timer_buffer);
+    TimerHandle_t        timer = xTimerCreateStatic("timerSafety", pdMS_TO_TICKS(SAFETY_READ_PERIOD_MS), pdTRUE, NULL,
+                                                    periodic_read, &timer_buffer);
     xTimerStart(timer, portMAX_DELAY);
 }
 
 
+/*
+ * Lock free, can be called from any context
+ */
 uint8_t safety_ok(void) {
-    uint8_t res = 0;
-    xSemaphoreTake(sem, portMAX_DELAY);
-    res = debounce_read(&filter, 0);
-    xSemaphoreGive(sem);
-    return res != 0;
+    return atomic_load(&safe) != 0;
+}
+
+
+void safety_set_trip_callback(safety_trip_cb_t cb) {
+    trip_cb = cb;
+}
+
+
+/*
+ * Trips since boot
+ */
+uint32_t safety_get_trip_count(void) {
+    return atomic_load(&trips);
 }
 
 
@@ -51,15 +80,57 @@ static uint8_t take_reading(void) {
     unsigned int input = 0;
     input |= !gpio_get_level(HAP_SAFETY_INPUT);
     ESP_LOGD(TAG, "%i", input);
-    return debounce_filter(&filter, input, 5);
+    return debounce_filter(&filter, input, SAFETY_RESTORE_SAMPLES);
 }
 
 
 static void periodic_read(TimerHandle_t timer) {
+    static size_t good_samples = 0;
     (void)timer;
-    xSemaphoreTake(sem, portMAX_DELAY);
-    if (take_reading()) {
-        // New value
+
+    take_reading();
+    uint8_t input_ok = debounce_read(&filter, 0) != 0;
+
+    // A trip seen by the interrupt restarts the count even if the filter did not notice it
+    if (atomic_exchange(&tripped, 0) || !input_ok) {
+        good_samples = 0;
+    } else if (good_samples < SAFETY_RESTORE_SAMPLES) {
+        good_samples++;
+    }
+
+    uint8_t new_safe = input_ok && good_samples >= SAFETY_RESTORE_SAMPLES;
+    if (new_safe != safety_ok()) {
+        if (new_safe) {
+            atomic_store(&safe, 1);
+            trace_record(TRACE_EVENT_SAFETY_RESTORE, 0);
+        } else {
+            // Only reached if the interrupt missed the edge
+            trip(0);
+        }
+        wakeup_signal(WAKEUP_EVENT_SAFETY);
+    }
+}
+
+
+static void trip(uint8_t from_isr) {
+    uint8_t was_safe = atomic_exchange(&safe, 0);
+    atomic_store(&tripped, 1);
+    trace_record(TRACE_EVENT_SAFETY_TRIP, from_isr);
+
+    if (was_safe) {
+        atomic_fetch_add(&trips, 1);
+        if (trip_cb != NULL) {
+            trip_cb(from_isr);
+        }
+    }
+}
+
+
+static void IRAM_ATTR safety_isr_handler(void *arg) {
+    (void)arg;
+
+    if (gpio_get_level(HAP_SAFETY_INPUT)) {
+        trip(1);
+        wakeup_signal_from_isr(WAKEUP_EVENT_SAFETY);
     }
-    xSemaphoreGive(sem);
 }
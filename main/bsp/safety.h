@@ -5,8 +5,14 @@
 #include <stdint.h>
 
 
-void safety_init(void);
-uint8_t safety_ok(void);
+// Called on a safety trip, possibly from interrupt context
+typedef void (*safety_trip_cb_t)(uint8_t from_isr);
+
+
+void     safety_init(void);
+uint8_t  safety_ok(void);
+void     safety_set_trip_callback(safety_trip_cb_t cb);
+uint32_t safety_get_trip_count(void);
 
 
 #endif
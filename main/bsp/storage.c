@@ -2,15 +2,78 @@
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_system.h"
 #include "nvs_flash.h"
 #include "esp_log.h"
-
-#define COMPATIBILITY_KEY     "COMPATIBILITY"
-#define COMPATIBILITY_VERSION 1
-
-
-static const char *TAG = "Storage";
+#include "config/app_config.h"
+#include "services/system_time.h"
+#include "storage.h"
+
+#define STORAGE_NAMESPACE        "storage"
+#define STORAGE_SHADOW_SIZE      24
+#define STORAGE_MAX_BLOB_SIZE    96
+#define STORAGE_COMMIT_DELAY_MS  2000
+#define STORAGE_COMMIT_THRESHOLD 8
+#define STORAGE_RESERVE_SIZE     4     // Entries only saves can take, while the others wait for the flash
+#define STORAGE_ENTRIES          (STORAGE_SHADOW_SIZE + STORAGE_RESERVE_SIZE)
+
+
+/*
+ * Every key goes through a RAM shadow: loads are served from it after the first access, saves only update it.
+ * A worker task writes the dirty entries with a single commit once STORAGE_COMMIT_DELAY_MS passed since the
+ * oldest change, or as soon as STORAGE_COMMIT_THRESHOLD entries are pending. Repeated saves of the same key
+ * before a commit cost a single flash write.
+ *
+ * Saves never touch the flash themselves: when every entry is waiting to be written they go to a few reserved
+ * ones, and past those they are dropped and counted.
+ */
+
+
+typedef enum {
+    STORAGE_TYPE_U8 = 0,
+    STORAGE_TYPE_U16,
+    STORAGE_TYPE_U32,
+    STORAGE_TYPE_U64,
+    STORAGE_TYPE_BLOB,
+} storage_type_t;
+
+
+typedef struct {
+    char           key[16];
+    storage_type_t type;
+    uint8_t        used;
+    uint8_t        found;       // The key exists, either in flash or staged
+    uint8_t        dirty;
+    uint8_t        writing;     // Being written by a commit, cannot be evicted yet
+    unsigned long  dirty_ts;
+    size_t         len;
+    union {
+        uint64_t number;
+        uint8_t  blob[STORAGE_MAX_BLOB_SIZE];
+    };
+} shadow_entry_t;
+
+
+static void            storage_task(void *args);
+static int             load(storage_type_t type, void *value, size_t len, const char *key);
+static void            save(storage_type_t type, const void *value, size_t len, const char *key);
+static void            copy_value(const shadow_entry_t *entry, void *value, size_t len);
+static int             read_entry(shadow_entry_t *entry);
+static esp_err_t       write_entry(const shadow_entry_t *entry);
+static void            commit(void);
+static shadow_entry_t *find_entry(const char *key);
+static shadow_entry_t *allocate_entry(size_t limit);
+static size_t          count_dirty(unsigned long *oldest_ts);
+
+
+static const char       *TAG                     = "Storage";
+static nvs_handle_t      handle                  = 0;
+static shadow_entry_t    shadow[STORAGE_ENTRIES] = {0};
+static SemaphoreHandle_t shadow_sem              = NULL;
+static SemaphoreHandle_t commit_sem              = NULL;
+static TaskHandle_t      task                    = NULL;
+static unsigned long     dropped                 = 0;
 
 
 void storage_init(void) {
@@ -25,214 +88,345 @@ void storage_init(void) {
         ESP_ERROR_CHECK(err);
     }
 
-    nvs_handle_t handle;
-    ESP_ERROR_CHECK(nvs_open("storage", NVS_READWRITE, &handle));
-    uint8_t buf;
-    err = nvs_get_u8(handle, COMPATIBILITY_KEY, &buf);
+    // Kept open for the whole run
+    ESP_ERROR_CHECK(nvs_open(STORAGE_NAMESPACE, NVS_READWRITE, &handle));
 
-    if (err == ESP_OK) {
-        if (buf != COMPATIBILITY_VERSION) {
-            ESP_LOGI(TAG,
-                     "The previously saved configuration is not compatibile with the new firmware version; erasing...");
-            nvs_close(handle);
-            ESP_ERROR_CHECK(nvs_erase_all(handle));
-            ESP_ERROR_CHECK(nvs_set_u8(handle, COMPATIBILITY_KEY, COMPATIBILITY_VERSION));
-            ESP_ERROR_CHECK(nvs_commit(handle));
-        }
-    } else if (err == ESP_ERR_NVS_NOT_FOUND) {
-        ESP_ERROR_CHECK(nvs_set_u8(handle, COMPATIBILITY_KEY, COMPATIBILITY_VERSION));
-        ESP_ERROR_CHECK(nvs_commit(handle));
-    }
+    static StaticSemaphore_t shadow_sem_buffer;
+    shadow_sem = xSemaphoreCreateMutexStatic(&shadow_sem_buffer);
+    static StaticSemaphore_t commit_sem_buffer;
+    commit_sem = xSemaphoreCreateMutexStatic(&commit_sem_buffer);
+
+    static uint8_t      task_stack[APP_CONFIG_BASE_TASK_STACK_SIZE * 6] = {0};
+    static StaticTask_t static_task;
+    task = xTaskCreateStatic(storage_task, TAG, sizeof(task_stack), NULL, 1, task_stack, &static_task);
+
+    // Staged writes survive a restart; a brownout reset gives no chance to run anything
+    ESP_ERROR_CHECK(esp_register_shutdown_handler(storage_flush));
 
-    nvs_close(handle);
     ESP_LOGI(TAG, "Storage initialized!");
 }
 
 
-int storage_load_uint8(uint8_t *value, char *key) {
-    nvs_handle_t handle;
-    esp_err_t    err;
-    assert(strlen(key) <= 15);
+/*
+ * Writes every staged change before returning; runs as a shutdown handler on esp_restart
+ */
+void storage_flush(void) {
+    commit();
+}
 
-    ESP_ERROR_CHECK(nvs_open("storage", NVS_READONLY, &handle));
-    err = nvs_get_u8(handle, key, value);
-    nvs_close(handle);
-    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
-        ESP_LOGE(TAG, "NVS error (%s) while reading %s", esp_err_to_name(err), key);
-        return -1;
-    }
 
-    return 0;
+int storage_load_uint8(uint8_t *value, char *key) {
+    return load(STORAGE_TYPE_U8, value, sizeof(*value), key);
 }
 
 
 void storage_save_uint8(uint8_t *value, char *key) {
-    nvs_handle_t handle;
-    assert(strlen(key) <= 15);
+    save(STORAGE_TYPE_U8, value, sizeof(*value), key);
+}
 
-    esp_err_t err = nvs_open("storage", NVS_READWRITE, &handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error (%i) opening NVS handle!\n", err);
-        return;
-    }
 
-    err = nvs_set_u8(handle, key, *value);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "NVS error (%i) while writing %s", err, key);
-    } else {
-        ESP_ERROR_CHECK(nvs_commit(handle));
-        nvs_close(handle);
-    }
+int storage_load_uint16(uint16_t *value, char *key) {
+    return load(STORAGE_TYPE_U16, value, sizeof(*value), key);
 }
 
 
-int storage_load_uint16(uint16_t *value, char *key) {
-    nvs_handle_t handle;
-    esp_err_t    err;
-    assert(strlen(key) <= 15);
+void storage_save_uint16(uint16_t *value, char *key) {
+    save(STORAGE_TYPE_U16, value, sizeof(*value), key);
+}
 
-    ESP_ERROR_CHECK(nvs_open("storage", NVS_READONLY, &handle));
-    err = nvs_get_u16(handle, key, value);
-    nvs_close(handle);
-    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
-        ESP_LOGE(TAG, "NVS error (%s) while reading %s", esp_err_to_name(err), key);
-        return -1;
-    }
 
-    return 0;
+int storage_load_uint32(uint32_t *value, char *key) {
+    return load(STORAGE_TYPE_U32, value, sizeof(*value), key);
 }
 
 
-void storage_save_uint16(uint16_t *value, char *key) {
-    nvs_handle_t handle;
-    ESP_LOGI(TAG, "Trying to save key %s", key);
-    assert(strlen(key) <= 15);
+void storage_save_uint32(uint32_t *value, char *key) {
+    save(STORAGE_TYPE_U32, value, sizeof(*value), key);
+}
 
-    esp_err_t err = nvs_open("storage", NVS_READWRITE, &handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error (%i) opening NVS handle!\n", err);
-        return;
-    }
 
-    err = nvs_set_u16(handle, key, *value);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "NVS error (%i) while writing %s", err, key);
-    } else {
-        ESP_ERROR_CHECK(nvs_commit(handle));
-        nvs_close(handle);
+int storage_load_uint64(uint64_t *value, char *key) {
+    return load(STORAGE_TYPE_U64, value, sizeof(*value), key);
+}
+
+
+void storage_save_uint64(uint64_t *value, char *key) {
+    save(STORAGE_TYPE_U64, value, sizeof(*value), key);
+}
+
+
+int storage_load_blob(void *value, size_t len, char *key) {
+    return load(STORAGE_TYPE_BLOB, value, len, key);
+}
+
+
+void storage_save_blob(void *value, size_t len, char *key) {
+    save(STORAGE_TYPE_BLOB, value, len, key);
+}
+
+
+static void storage_task(void *args) {
+    (void)args;
+    unsigned long wait = STORAGE_COMMIT_DELAY_MS;
+
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(wait));
+
+        xSemaphoreTake(shadow_sem, portMAX_DELAY);
+        unsigned long oldest_ts = 0;
+        size_t        dirty     = count_dirty(&oldest_ts);
+        xSemaphoreGive(shadow_sem);
+
+        if (dirty >= STORAGE_COMMIT_THRESHOLD ||
+            (dirty > 0 && is_expired(oldest_ts, get_millis(), STORAGE_COMMIT_DELAY_MS))) {
+            commit();
+            wait = STORAGE_COMMIT_DELAY_MS;
+        } else if (dirty > 0) {
+            wait = time_remaining(oldest_ts, get_millis(), STORAGE_COMMIT_DELAY_MS);
+        } else {
+            wait = STORAGE_COMMIT_DELAY_MS;
+        }
     }
+
+    vTaskDelete(NULL);
 }
 
 
-int storage_load_uint32(uint32_t *value, char *key) {
-    nvs_handle_t handle;
-    esp_err_t    err;
+/*
+ * A missing key is not an error, the value is left untouched
+ */
+static int load(storage_type_t type, void *value, size_t len, const char *key) {
     assert(strlen(key) <= 15);
+    assert(type != STORAGE_TYPE_BLOB || len <= STORAGE_MAX_BLOB_SIZE);
+
+    xSemaphoreTake(shadow_sem, portMAX_DELAY);
+    shadow_entry_t *entry = find_entry(key);
+    if (entry != NULL) {
+        copy_value(entry, value, len);
+        xSemaphoreGive(shadow_sem);
+        return 0;
+    }
+    xSemaphoreGive(shadow_sem);
 
-    ESP_ERROR_CHECK(nvs_open("storage", NVS_READONLY, &handle));
-    err = nvs_get_u32(handle, key, value);
-    nvs_close(handle);
-    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
-        ESP_LOGE(TAG, "NVS error (%s) while reading %s", esp_err_to_name(err), key);
+    // Read outside of the lock, flash access can be slow
+    shadow_entry_t loaded = {.type = type, .len = len};
+    strcpy(loaded.key, key);
+    if (read_entry(&loaded)) {
         return -1;
     }
 
+    xSemaphoreTake(shadow_sem, portMAX_DELAY);
+    // A save might have staged the key in the meantime, that one is newer
+    entry = find_entry(key);
+    if (entry == NULL) {
+        entry = allocate_entry(STORAGE_SHADOW_SIZE);
+        if (entry != NULL) {
+            *entry = loaded;
+        } else {
+            entry = &loaded;
+        }
+    }
+    copy_value(entry, value, len);
+    xSemaphoreGive(shadow_sem);
+
     return 0;
 }
 
 
-void storage_save_uint32(uint32_t *value, char *key) {
-    nvs_handle_t handle;
-    ESP_LOGI(TAG, "Trying to save key %s", key);
-    assert(strlen(key) <= 15);
+static void copy_value(const shadow_entry_t *entry, void *value, size_t len) {
+    if (entry->found) {
+        memcpy(value, entry->type == STORAGE_TYPE_BLOB ? (void *)entry->blob : (void *)&entry->number,
+               MIN(len, entry->len));
+    }
+}
+
 
-    esp_err_t err = nvs_open("storage", NVS_READWRITE, &handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error (%i) opening NVS handle!\n", err);
-        return;
+static void save(storage_type_t type, const void *value, size_t len, const char *key) {
+    assert(strlen(key) <= 15);
+    assert(type != STORAGE_TYPE_BLOB || len <= STORAGE_MAX_BLOB_SIZE);
+
+    xSemaphoreTake(shadow_sem, portMAX_DELAY);
+    shadow_entry_t *entry = find_entry(key);
+    if (entry == NULL) {
+        entry = allocate_entry(STORAGE_ENTRIES);
+        if (entry == NULL) {
+            // Committing here would stall the caller on the flash; the worker is already due to make room
+            dropped++;
+            xSemaphoreGive(shadow_sem);
+            ESP_LOGW(TAG, "No room to stage %s, %lu saves dropped so far", key, dropped);
+            xTaskNotifyGive(task);
+            return;
+        }
+        *entry = (shadow_entry_t){.used = 1};
+        strcpy(entry->key, key);
     }
 
-    err = nvs_set_u32(handle, key, *value);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "NVS error (%i) while writing %s", err, key);
-    } else {
-        ESP_ERROR_CHECK(nvs_commit(handle));
-        nvs_close(handle);
+    entry->type  = type;
+    entry->found = 1;
+    entry->len   = len;
+    memcpy(type == STORAGE_TYPE_BLOB ? (void *)entry->blob : (void *)&entry->number, value, len);
+
+    if (!entry->dirty) {
+        entry->dirty    = 1;
+        entry->dirty_ts = get_millis();
     }
+    xSemaphoreGive(shadow_sem);
+
+    xTaskNotifyGive(task);
 }
 
 
-int storage_load_uint64(uint64_t *value, char *key) {
-    nvs_handle_t handle;
-    esp_err_t    err;
-    assert(strlen(key) <= 15);
+static int read_entry(shadow_entry_t *entry) {
+    esp_err_t err = ESP_OK;
+
+    switch (entry->type) {
+        case STORAGE_TYPE_U8: {
+            uint8_t number = 0;
+            err            = nvs_get_u8(handle, entry->key, &number);
+            entry->number  = number;
+            break;
+        }
+        case STORAGE_TYPE_U16: {
+            uint16_t number = 0;
+            err             = nvs_get_u16(handle, entry->key, &number);
+            entry->number   = number;
+            break;
+        }
+        case STORAGE_TYPE_U32: {
+            uint32_t number = 0;
+            err             = nvs_get_u32(handle, entry->key, &number);
+            entry->number   = number;
+            break;
+        }
+        case STORAGE_TYPE_U64:
+            err = nvs_get_u64(handle, entry->key, &entry->number);
+            break;
+        case STORAGE_TYPE_BLOB:
+            entry->len = sizeof(entry->blob);
+            err        = nvs_get_blob(handle, entry->key, entry->blob, &entry->len);
+            break;
+    }
 
-    ESP_ERROR_CHECK(nvs_open("storage", NVS_READONLY, &handle));
-    err = nvs_get_u64(handle, key, value);
-    nvs_close(handle);
     if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
-        ESP_LOGE(TAG, "NVS error (%s) while reading %s", esp_err_to_name(err), key);
+        ESP_LOGE(TAG, "NVS error (%s) while reading %s", esp_err_to_name(err), entry->key);
         return -1;
     }
 
+    entry->used  = 1;
+    entry->found = err == ESP_OK;
+    entry->dirty = 0;
     return 0;
 }
 
 
-void storage_save_uint64(uint64_t *value, char *key) {
-    nvs_handle_t handle;
-    ESP_LOGI(TAG, "Trying to save key %s", key);
-    assert(strlen(key) <= 15);
+static esp_err_t write_entry(const shadow_entry_t *entry) {
+    switch (entry->type) {
+        case STORAGE_TYPE_U8:
+            return nvs_set_u8(handle, entry->key, (uint8_t)entry->number);
+        case STORAGE_TYPE_U16:
+            return nvs_set_u16(handle, entry->key, (uint16_t)entry->number);
+        case STORAGE_TYPE_U32:
+            return nvs_set_u32(handle, entry->key, (uint32_t)entry->number);
+        case STORAGE_TYPE_U64:
+            return nvs_set_u64(handle, entry->key, entry->number);
+        case STORAGE_TYPE_BLOB:
+            return nvs_set_blob(handle, entry->key, entry->blob, entry->len);
+    }
+    return ESP_ERR_INVALID_ARG;
+}
 
-    esp_err_t err = nvs_open("storage", NVS_READWRITE, &handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error (%i) opening NVS handle!\n", err);
-        return;
+
+/*
+ * Each dirty entry is copied out under the lock and written without it, one key at a time, so loads and saves
+ * never wait for the flash. The entries written stay pinned in the shadow until the NVS commit.
+ */
+static void commit(void) {
+    // Only used under commit_sem
+    static shadow_entry_t entry;
+
+    xSemaphoreTake(commit_sem, portMAX_DELAY);
+
+    size_t count = 0;
+    for (size_t i = 0; i < STORAGE_ENTRIES; i++) {
+        xSemaphoreTake(shadow_sem, portMAX_DELAY);
+        uint8_t pending = shadow[i].used && shadow[i].dirty;
+        if (pending) {
+            entry             = shadow[i];
+            shadow[i].dirty   = 0;
+            shadow[i].writing = 1;
+        }
+        xSemaphoreGive(shadow_sem);
+
+        if (pending) {
+            esp_err_t err = write_entry(&entry);
+            if (err != ESP_OK) {
+                ESP_LOGE(TAG, "NVS error (%s) while writing %s", esp_err_to_name(err), entry.key);
+            }
+            count++;
+        }
     }
 
-    err = nvs_set_u64(handle, key, *value);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "NVS error (%i) while writing %s", err, key);
-    } else {
-        ESP_ERROR_CHECK(nvs_commit(handle));
-        nvs_close(handle);
+    if (count > 0) {
+        ESP_LOGI(TAG, "Committing %zu keys", count);
+        esp_err_t err = nvs_commit(handle);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "NVS error (%s) while committing", esp_err_to_name(err));
+        }
+
+        xSemaphoreTake(shadow_sem, portMAX_DELAY);
+        for (size_t i = 0; i < STORAGE_ENTRIES; i++) {
+            shadow[i].writing = 0;
+        }
+        xSemaphoreGive(shadow_sem);
     }
+
+    xSemaphoreGive(commit_sem);
 }
 
 
-int storage_load_blob(void *value, size_t len, char *key) {
-    nvs_handle_t handle;
-    esp_err_t    err;
-    assert(strlen(key) <= 15);
+static shadow_entry_t *find_entry(const char *key) {
+    for (size_t i = 0; i < STORAGE_ENTRIES; i++) {
+        if (shadow[i].used && strcmp(shadow[i].key, key) == 0) {
+            return &shadow[i];
+        }
+    }
+    return NULL;
+}
 
-    ESP_ERROR_CHECK(nvs_open("storage", NVS_READONLY, &handle));
-    err = nvs_get_blob(handle, key, value, &len);
-    nvs_close(handle);
-    if (err != ESP_OK && err != ESP_ERR_NVS_NOT_FOUND) {
-        ESP_LOGE(TAG, "NVS error (%s) while reading %s", esp_err_to_name(err), key);
-        return -1;
+
+/*
+ * Returns a free entry among the first `limit`, evicting a clean one if needed; NULL if every entry still has to be
+ * written
+ */
+static shadow_entry_t *allocate_entry(size_t limit) {
+    shadow_entry_t *clean = NULL;
+
+    for (size_t i = 0; i < limit; i++) {
+        if (!shadow[i].used) {
+            return &shadow[i];
+        } else if (!shadow[i].dirty && !shadow[i].writing && clean == NULL) {
+            clean = &shadow[i];
+        }
     }
 
-    return 0;
+    if (clean != NULL) {
+        clean->used = 0;
+    }
+    return clean;
 }
 
 
-void storage_save_blob(void *value, size_t len, char *key) {
-    nvs_handle_t handle;
-    ESP_LOGI(TAG, "Trying to save key %s", key);
-    assert(strlen(key) <= 15);
+static size_t count_dirty(unsigned long *oldest_ts) {
+    size_t count = 0;
 
-    esp_err_t err = nvs_open("storage", NVS_READWRITE, &handle);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "Error (%i) opening NVS handle!\n", err);
-        return;
+    for (size_t i = 0; i < STORAGE_ENTRIES; i++) {
+        if (shadow[i].used && shadow[i].dirty) {
+            if (count == 0 || time_after_or_equal(*oldest_ts, shadow[i].dirty_ts)) {
+                *oldest_ts = shadow[i].dirty_ts;
+            }
+            count++;
+        }
     }
 
-    err = nvs_set_blob(handle, key, value, len);
-    if (err != ESP_OK) {
-        ESP_LOGE(TAG, "NVS error (%i) while writing %s", err, key);
-    } else {
-        ESP_ERROR_CHECK(nvs_commit(handle));
-        nvs_close(handle);
-    }
+    return count;
 }
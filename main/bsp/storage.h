@@ -5,6 +5,7 @@
 #include <stdlib.h>
 
 void storage_init(void);
+void storage_flush(void);
 
 int  storage_load_uint8(uint8_t *value, char *key);
 void storage_save_uint8(uint8_t *value, char *key);
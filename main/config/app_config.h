@@ -13,4 +13,57 @@
 #define APP_CONFIG_HOURS_WARNING 8000
 #define APP_CONFIG_HOURS_ALARM   10000
 
+/*
+ *  Work hours are estimated locally and read from the devices once per period; differences above the
+ *  drift threshold (in hours) are reported
+ */
+#define APP_CONFIG_WORK_HOURS_SYNC_MS (60UL * 60UL * 1000UL)
+#define APP_CONFIG_WORK_HOURS_DRIFT   1
+
+/*
+ *  Soft start: ballasts switched on together by each stage and longest wait for them to light up
+ */
+#define APP_CONFIG_SEQUENCE_STAGE_SIZE 1
+#define APP_CONFIG_SEQUENCE_STAGE_MS   1000
+
+/*
+ *  Counters journal: number of rotating records and minimum distance between two of them
+ */
+#define APP_CONFIG_JOURNAL_SLOTS     8
+#define APP_CONFIG_JOURNAL_PERIOD_MS (10UL * 60UL * 1000UL)
+
+/*
+ *  Heartbeat broadcast carrying sequence step, safety state and desired output bitmap; unicast output writes
+ *  are only sent to devices that did not follow it. Off by default: the devices in the field only understand
+ *  the empty heartbeat, enable it only where every device is known to follow the payload
+ */
+#ifndef APP_CONFIG_HEARTBEAT_OUTPUTS
+#define APP_CONFIG_HEARTBEAT_OUTPUTS 0
+#endif
+#define APP_CONFIG_HEARTBEAT_PERIOD_MS 100
+#define APP_CONFIG_OUTPUT_FALLBACK_MS  1000
+
+/*
+ *  Output reconciliation: retry period for unconfirmed writes and minimum distance between writes to a device
+ */
+#define APP_CONFIG_OUTPUT_RETRY_MS        1000
+#define APP_CONFIG_OUTPUT_MIN_INTERVAL_MS 100
+
+/*
+ *  Event trace ring, 8 bytes per record; must be a power of two
+ */
+#define APP_CONFIG_TRACE_RECORDS 512
+
+/*
+ *  Capture of the raw RS485 frames, left out of the build unless enabled: RAM ring in bytes (must be a power of
+ *  two) and number of 72 byte chunks spilled to flash, 0 to keep the capture in RAM only
+ */
+#ifndef APP_CONFIG_CAPTURE
+#define APP_CONFIG_CAPTURE 0
+#endif
+#ifndef APP_CONFIG_CAPTURE_SPILL_SLOTS
+#define APP_CONFIG_CAPTURE_SPILL_SLOTS 0
+#endif
+#define APP_CONFIG_CAPTURE_BUFFER 4096
+
 #endif
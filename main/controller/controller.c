@@ -2,38 +2,68 @@
 #include "model/model.h"
 #include "modbus.h"
 #include "observer.h"
+#include "reconciler.h"
+#include "link_quality.h"
+#include "snapshot.h"
+#include "work_hours.h"
+#include "journal.h"
 #include "model/updater.h"
 #include "services/system_time.h"
 #include "bsp/interface.h"
 #include "esp_log.h"
 #include "bsp/safety.h"
+#include "services/trace.h"
+#include "services/capture.h"
+
+
+static void report_transaction(mut_model_t *pmodel, uint8_t address, uint8_t success);
+
+
+#define POLLING_PERIOD_MS        200
+#define BUTTON_POLLING_PERIOD_MS 20
 
 
 static const char *TAG = "Controller";
 
 
 void controller_init(mut_model_t *pmodel) {
-    (void)pmodel;
+    snapshot_restore(pmodel);
+    journal_restore(pmodel);
+    capture_init();
 
     modbus_init();
+    safety_set_trip_callback(modbus_safety_trip);
+    link_quality_init();
+    reconciler_init();
+    work_hours_init();
     observer_init(pmodel);
+
+    // Single quick pass to confirm (or correct) the restored device map
+    for (uint8_t address = 1; address <= MODBUS_MAX_DEVICES; address++) {
+        modbus_read_device_info(address);
+        modbus_read_device_state(address);
+    }
 }
 
 
-void controller_manage(mut_model_t *pmodel) {
+/*
+ * Handles everything that is pending; returns how many milliseconds can pass before it needs to run again
+ */
+unsigned long controller_manage(mut_model_t *pmodel) {
     static unsigned long modbus_ts      = 0;
     static size_t        info_counter   = 0;
     static uint8_t       modbus_address = 1;
 
-    if (is_expired(modbus_ts, get_millis(), 200)) {
+    trace_record(TRACE_EVENT_CONTROLLER_BEGIN, 0);
+
+    if (is_expired(modbus_ts, get_millis(), POLLING_PERIOD_MS)) {
         if ((info_counter % 35) == 0) {
-            modbus_read_device_work_hours(modbus_address);
             modbus_read_device_info(modbus_address);
         }
 
         modbus_read_device_state(modbus_address);
 
-        if (modbus_address == 4) {
+        if (modbus_address == MODBUS_MAX_DEVICES) {
             modbus_address = 1;
             info_counter++;
         } else {
@@ -45,40 +75,61 @@ void controller_manage(mut_model_t *pmodel) {
 
     if (interface_manage()) {
         ESP_LOGI(TAG, "Reset work hours");
-        model_set_ballast_work_hours(pmodel, 1, 0);
-        model_set_ballast_work_hours(pmodel, 2, 0);
-        model_set_ballast_work_hours(pmodel, 3, 0);
-        model_set_ballast_work_hours(pmodel, 4, 0);
-        modbus_reset_device_work_hours(1);
-        modbus_reset_device_work_hours(2);
-        modbus_reset_device_work_hours(3);
-        modbus_reset_device_work_hours(4);
+        for (uint8_t address = 1; address <= MODBUS_MAX_DEVICES; address++) {
+            model_set_ballast_work_hours(pmodel, address, 0);
+            work_hours_reset(address);
+            modbus_reset_device_work_hours(address);
+        }
     }
 
-    pmodel->safety_ok = safety_ok();
-    interface_set_safety(!model_is_safety_ok(pmodel));
+    // The Modbus task already switched everything off on the trip; lift its latch once the chain is closed again.
+    // The generation is taken first so that a trip racing with the check stays latched
+    uint32_t generation = modbus_safety_generation();
+    uint8_t  safe       = safety_ok();
+    if (safe) {
+        modbus_safety_clear(generation);
+    }
+    model_set_safety_ok(pmodel, safe);
 
     modbus_response_t response;
-    if (modbus_get_response(&response)) {
+    while (modbus_get_response(&response)) {
+        trace_record(TRACE_EVENT_CONTROLLER_RESPONSE, TRACE_ARG(response.code, response.address));
         switch (response.code) {
             case MODBUS_RESPONSE_CODE_ERROR:
-                model_set_ballast_communication_ok(pmodel, response.address, 0);
+                report_transaction(pmodel, response.address, 0);
                 break;
 
             case MODBUS_RESPONSE_CODE_INFO:
+                // A cache hit says nothing about the link
+                if (!response.from_cache) {
+                    report_transaction(pmodel, response.address, 1);
+                }
                 ESP_LOGD(TAG, "Device %i has class 0x%02X", response.address, response.class);
-                model_set_ballast_class(pmodel, response.address, response.class);
+                REGISTERS_INFO_APPLY(pmodel, response.address, response);
                 break;
 
             case MODBUS_RESPONSE_CODE_STATE:
+                if (!response.from_cache) {
+                    report_transaction(pmodel, response.address, 1);
+                }
                 ESP_LOGD(TAG, "Device %i state: 0x%02X; alarms: 0x%02X", response.address, response.state,
                          response.alarms);
-                model_set_ballast_state(pmodel, response.address, response.state, response.alarms);
+                REGISTERS_STATE_APPLY(pmodel, response.address, response);
+                reconciler_state_observed(response.address, response.state);
+                break;
+
+            case MODBUS_RESPONSE_CODE_DEVICE_OK:
+                report_transaction(pmodel, response.address, 1);
+                reconciler_output_confirmed(response.address, response.output);
                 break;
 
             case MODBUS_RESPONSE_CODE_WORK_HOURS:
+                if (!response.from_cache) {
+                    report_transaction(pmodel, response.address, 1);
+                }
                 ESP_LOGD(TAG, "Device %i has worked for %0ih", response.address, response.work_hours);
-                model_set_ballast_work_hours(pmodel, response.address, response.work_hours);
+                work_hours_device_reading(pmodel, response.address, response.work_hours);
+                REGISTERS_WORK_HOURS_APPLY(pmodel, response.address, response);
                 break;
 
             default:
@@ -87,6 +138,31 @@ void controller_manage(mut_model_t *pmodel) {
     }
 
 
-    observer_manage();
-    model_updater_manage(pmodel);
+    unsigned long next = time_remaining(modbus_ts, get_millis(), POLLING_PERIOD_MS);
+    next               = MIN(next, model_updater_manage(pmodel));
+    next               = MIN(next, reconciler_manage(pmodel));
+    next               = MIN(next, work_hours_manage(pmodel));
+    next               = MIN(next, snapshot_manage(pmodel));
+    next               = MIN(next, journal_manage(pmodel));
+    next               = MIN(next, capture_manage());
+    if (interface_needs_polling()) {
+        next = MIN(next, BUTTON_POLLING_PERIOD_MS);
+    }
+
+    // Last, so that it sees every change made in this pass
+    observer_manage(pmodel);
+    next = MIN(next, interface_refresh_leds());
+
+    trace_record(TRACE_EVENT_CONTROLLER_END, MIN(next, UINT16_MAX));
+    return next;
+}
+
+
+/*
+ * Single transactions only feed the link estimator; the model sees the debounced link state
+ */
+static void report_transaction(mut_model_t *pmodel, uint8_t address, uint8_t success) {
+    if (address >= 1 && address <= MODBUS_MAX_DEVICES) {
+        model_set_ballast_communication_ok(pmodel, address, link_quality_report(address, success));
+    }
 }
@@ -5,7 +5,7 @@
 
 
 void controller_init(mut_model_t *pmodel);
-void controller_manage(mut_model_t *pmodel);
+unsigned long controller_manage(mut_model_t *pmodel);
 
 
 #endif
@@ -0,0 +1,129 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include "journal.h"
+#include "link_quality.h"
+#include "model/model.h"
+#include "bsp/safety.h"
+#include "services/record_store.h"
+#include "config/app_config.h"
+#include "services/system_time.h"
+#include "esp_log.h"
+
+
+/*
+ * Counters that must survive a reboot (work hours, communication errors and safety trips) are appended as
+ * whole records to a ring of APP_CONFIG_JOURNAL_SLOTS keys, one key per record, so that consecutive writes
+ * land on different entries. Every record carries a sequence number and is CRC checked by the record store:
+ * at boot the newest valid one wins, and a record torn by a power loss simply falls back to the one before it.
+ */
+
+
+#define JOURNAL_KEY_FORMAT "JRNL%u"
+
+
+static void key_for_slot(char *key, size_t len, size_t slot);
+static void take_record(model_t *pmodel, journal_record_t *record);
+
+
+// Add a migration here whenever the layout changes
+static const record_type_t journal_record = {
+    .version    = 1,
+    .size       = sizeof(journal_record_t),
+    .migrations = NULL,
+};
+
+static const char      *TAG         = "Journal";
+static journal_record_t last_record = {0};
+// Totals carried over from the previous runs
+static journal_record_t base = {0};
+
+
+/*
+ * Recovers the newest record; called after the snapshot is restored, the journaled work hours fill in
+ * whatever the snapshot missed. The device counter still replaces them at the first synchronization.
+ */
+void journal_restore(mut_model_t *pmodel) {
+    uint8_t found = 0;
+    assert(pmodel != NULL);
+
+    for (size_t i = 0; i < APP_CONFIG_JOURNAL_SLOTS; i++) {
+        char key[16];
+        key_for_slot(key, sizeof(key), i);
+
+        journal_record_t record = {0};
+        if (record_store_load(&journal_record, key, &record)) {
+            continue;
+        }
+
+        if (!found || (int32_t)(record.sequence - last_record.sequence) > 0) {
+            last_record = record;
+            found       = 1;
+        }
+    }
+
+    if (found) {
+        ESP_LOGI(TAG, "Recovered record %u, %u safety trips", (unsigned int)last_record.sequence,
+                 (unsigned int)last_record.safety_trips);
+        base = last_record;
+
+        for (size_t i = 0; i < MODBUS_MAX_DEVICES; i++) {
+            if (last_record.work_hours[i] > model_get_ballast_work_hours(pmodel, i)) {
+                model_restore_ballast_work_hours(pmodel, i, last_record.work_hours[i]);
+            }
+        }
+    } else {
+        ESP_LOGI(TAG, "Empty journal");
+    }
+}
+
+
+/*
+ * Appends a record when the counters changed, at most once every APP_CONFIG_JOURNAL_PERIOD_MS;
+ * returns the time left before the next record can be written.
+ */
+unsigned long journal_manage(model_t *pmodel) {
+    static unsigned long timestamp = 0;
+    assert(pmodel != NULL);
+
+    if (!is_expired(timestamp, get_millis(), APP_CONFIG_JOURNAL_PERIOD_MS)) {
+        return time_remaining(timestamp, get_millis(), APP_CONFIG_JOURNAL_PERIOD_MS);
+    }
+    timestamp = get_millis();
+
+    journal_record_t record = {0};
+    take_record(pmodel, &record);
+
+    // Only the counters are compared, the sequence is left at zero by take_record
+    journal_record_t previous = last_record;
+    previous.sequence         = 0;
+    if (memcmp(&record, &previous, sizeof(record)) == 0) {
+        return APP_CONFIG_JOURNAL_PERIOD_MS;
+    }
+
+    record.sequence = last_record.sequence + 1;
+
+    char key[16];
+    key_for_slot(key, sizeof(key), record.sequence % APP_CONFIG_JOURNAL_SLOTS);
+    record_store_save(&journal_record, key, &record);
+
+    last_record = record;
+    return APP_CONFIG_JOURNAL_PERIOD_MS;
+}
+
+
+static void take_record(model_t *pmodel, journal_record_t *record) {
+    for (size_t i = 0; i < MODBUS_MAX_DEVICES; i++) {
+        link_statistics_t statistics = {0};
+        link_quality_get_statistics(i + 1, &statistics);
+
+        record->work_hours[i]  = model_get_ballast_work_hours(pmodel, i);
+        record->comm_errors[i] = base.comm_errors[i] + statistics.failures;
+    }
+    record->safety_trips = base.safety_trips + safety_get_trip_count();
+}
+
+
+static void key_for_slot(char *key, size_t len, size_t slot) {
+    snprintf(key, len, JOURNAL_KEY_FORMAT, (unsigned int)slot);
+}
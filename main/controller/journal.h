@@ -0,0 +1,21 @@
+#ifndef JOURNAL_H_INCLUDED
+#define JOURNAL_H_INCLUDED
+
+
+#include <stdint.h>
+#include "model/model.h"
+
+
+typedef struct __attribute__((packed)) {
+    uint32_t sequence;
+    uint16_t work_hours[MODBUS_MAX_DEVICES];
+    uint32_t comm_errors[MODBUS_MAX_DEVICES];
+    uint32_t safety_trips;
+} journal_record_t;
+
+
+void          journal_restore(mut_model_t *pmodel);
+unsigned long journal_manage(model_t *pmodel);
+
+
+#endif
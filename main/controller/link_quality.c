@@ -0,0 +1,109 @@
+#include <assert.h>
+#include <inttypes.h>
+#include "link_quality.h"
+#include "model/model.h"
+#include "esp_log.h"
+
+
+/*
+ * Per-device link state debounced with an exponentially weighted success rate (0-255).
+ * The link goes up above QUALITY_UP and down below QUALITY_DOWN, so isolated errors on a noisy line
+ * do not make the model flip back and forth.
+ */
+
+
+#define QUALITY_MAX   255
+#define QUALITY_SHIFT 2     // Weight of the newest sample: 1/4
+#define QUALITY_UP    192
+#define QUALITY_DOWN  64
+
+
+typedef struct {
+    uint8_t  seeded;
+    uint16_t quality;
+    uint8_t  up;
+    uint32_t transactions;
+    uint32_t failures;
+} link_t;
+
+
+static link_t *get_link(uint8_t address);
+
+
+static const char *TAG                       = "Link";
+static link_t      links[MODBUS_MAX_DEVICES] = {0};
+
+
+void link_quality_init(void) {
+    for (size_t i = 0; i < MODBUS_MAX_DEVICES; i++) {
+        links[i] = (link_t){0};
+    }
+}
+
+
+/*
+ * Accounts for a single transaction and returns the debounced link state
+ */
+uint8_t link_quality_report(uint8_t address, uint8_t success) {
+    link_t *link = get_link(address);
+    if (link == NULL) {
+        return success;
+    }
+
+    link->transactions++;
+    if (!success) {
+        link->failures++;
+    }
+
+    uint16_t sample = success ? QUALITY_MAX : 0;
+    if (!link->seeded) {
+        // The first transaction decides the initial state, there is no history to weigh it against
+        link->seeded  = 1;
+        link->quality = sample;
+        link->up      = success;
+        return link->up;
+    }
+
+    link->quality = link->quality - (link->quality >> QUALITY_SHIFT) + (sample >> QUALITY_SHIFT);
+
+    if (!link->up && link->quality >= QUALITY_UP) {
+        ESP_LOGI(TAG, "Device %i link up (%" PRIu32 "/%" PRIu32 " failed)", address, link->failures,
+                 link->transactions);
+        link->up = 1;
+    } else if (link->up && link->quality <= QUALITY_DOWN) {
+        ESP_LOGW(TAG, "Device %i link down (%" PRIu32 "/%" PRIu32 " failed)", address, link->failures,
+                 link->transactions);
+        link->up = 0;
+    }
+
+    return link->up;
+}
+
+
+uint8_t link_quality_is_up(uint8_t address) {
+    link_t *link = get_link(address);
+    return link != NULL && link->up;
+}
+
+
+void link_quality_get_statistics(uint8_t address, link_statistics_t *statistics) {
+    assert(statistics != NULL);
+
+    link_t *link = get_link(address);
+    if (link == NULL) {
+        *statistics = (link_statistics_t){0};
+    } else {
+        statistics->transactions = link->transactions;
+        statistics->failures     = link->failures;
+        statistics->quality      = link->quality;
+        statistics->up           = link->up;
+    }
+}
+
+
+static link_t *get_link(uint8_t address) {
+    if (address < 1 || address > MODBUS_MAX_DEVICES) {
+        return NULL;
+    }
+    return &links[address - 1];
+}
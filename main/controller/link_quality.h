@@ -0,0 +1,22 @@
+#ifndef LINK_QUALITY_H_INCLUDED
+#define LINK_QUALITY_H_INCLUDED
+
+
+#include <stdint.h>
+
+
+typedef struct {
+    uint32_t transactions;
+    uint32_t failures;
+    uint8_t  quality;
+    uint8_t  up;
+} link_statistics_t;
+
+
+void    link_quality_init(void);
+uint8_t link_quality_report(uint8_t address, uint8_t success);
+uint8_t link_quality_is_up(uint8_t address);
+void    link_quality_get_statistics(uint8_t address, link_statistics_t *statistics);
+
+
+#endif
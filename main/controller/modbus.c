@@ -1,4 +1,5 @@
 #include <inttypes.h>
+#include <stdatomic.h>
 #include <sys/time.h>
 #include <string.h>
 #include <assert.h>
@@ -17,7 +18,10 @@
 #include "model/model.h"
 #include "easyconnect_interface.h"
 #include "modbus.h"
+#include "register_cache.h"
 #include "bsp/rs485.h"
+#include "services/wakeup.h"
+#include "services/trace.h"
 #include "config/app_config.h"
 
 
@@ -30,9 +34,7 @@
 #define MODBUS_BROADCAST_ADDRESS      0
 #define MODBUS_COMMUNICATION_ATTEMPTS 1
 
-#define HOLDING_REGISTER_MOTOR_SPEED 256
-#define HOLDING_REGISTER_PRESSURE    256
-#define HOLDING_REGISTER_WORK_HOURS  256
+#define HEARTBEAT_OUTPUTS_LEN ((MODBUS_MAX_DEVICES + 7) / 8)
 
 #define MODBUS_AUTO_COMMISSIONING_DONE_BIT 0x01
 
@@ -47,6 +49,8 @@ typedef enum {
     TASK_MESSAGE_CODE_SET_FAN_PERCENTAGE,
     TASK_MESSAGE_CODE_UPDATE_TIME,
     TASK_MESSAGE_CODE_UPDATE_EVENTS,
+    TASK_MESSAGE_CODE_UPDATE_HEARTBEAT,
+    TASK_MESSAGE_CODE_SAFETY_TRIP,
     TASK_MESSAGE_CODE_SCAN,
 } task_message_code_t;
 
@@ -60,12 +64,24 @@ struct __attribute__((packed)) task_message {
             uint8_t value;
             uint8_t bypass;
         };
+        struct {
+            uint8_t  sequence;
+            uint8_t  safety;
+            uint32_t outputs;
+        };
         uint16_t expected_devices;
         uint16_t num_messages;
         uint16_t event_count;
     };
 };
 
+typedef struct {
+    uint8_t  enabled;
+    uint8_t  sequence;
+    uint8_t  safety;
+    uint32_t outputs;
+} heartbeat_t;
+
 typedef struct {
     uint32_t device_map[MODBUS_MAX_DEVICES];
 } device_map_context_t;
@@ -94,18 +110,33 @@ static LIGHTMODBUS_RET_ERROR random_serial_number_response(ModbusMaster *status,
                                                            const uint8_t *responsePDU, uint8_t responseLength);
 
 static void modbus_task(void *args);
+static void enqueue(const struct task_message *message);
+static void send_response(const modbus_response_t *response);
+static void trace_request(ModbusMaster *master);
+static void trace_outcome(ModbusMaster *master, ModbusErrorInfo err, int len);
 static int  write_holding_register(ModbusMaster *master, uint8_t address, uint16_t index, uint16_t data);
 static int  write_holding_registers(ModbusMaster *master, uint8_t address, uint16_t starting_address, uint16_t *data,
                                     size_t num);
 static int  write_coils(ModbusMaster *master, uint8_t address, uint16_t index, size_t num_values, uint8_t *values);
 static int  read_holding_registers(ModbusMaster *master, uint16_t *registers, uint8_t address, uint16_t start,
                                    uint16_t count);
+static int  read_holding_registers_cached(ModbusMaster *master, uint16_t *registers, uint8_t address, uint16_t start,
+                                          uint16_t count, register_class_t class, uint8_t *from_cache);
 static void send_custom_function(ModbusMaster *master, uint8_t address, uint8_t function, uint8_t *data, size_t len);
+static void send_heartbeat(ModbusMaster *master, const heartbeat_t *heartbeat);
+static void broadcast_all_off(ModbusMaster *master, const heartbeat_t *heartbeat);
+
+static uint8_t safety_latched(void);
 
 static const char   *TAG       = "Modbus";
 static QueueHandle_t messageq  = NULL;
 static QueueHandle_t responseq = NULL;
 static TaskHandle_t  task      = NULL;
+// Set whenever the current operation put something on the wire
+static uint8_t bus_accessed = 0;
+// Until the controller acknowledges the last trip every output is forced off, regardless of what it asks
+static atomic_uint_fast32_t safety_trips        = 0;
+static atomic_uint_fast32_t safety_acknowledged = 0;
 
 
 static ModbusMasterFunctionHandler custom_functions[] = {
@@ -179,13 +210,13 @@ int modbus_get_response(modbus_response_t *response) {
 void modbus_update_events(uint8_t address, uint16_t previous_event_count) {
     struct task_message message = {
         .code = TASK_MESSAGE_CODE_UPDATE_EVENTS, .address = address, .event_count = previous_event_count};
-    xQueueSend(messageq, &message, 0);
+    enqueue(&message);
 }
 
 
 void modbus_update_time(void) {
     struct task_message message = {.code = TASK_MESSAGE_CODE_UPDATE_TIME};
-    xQueueSend(messageq, &message, 0);
+    enqueue(&message);
 }
 
 
@@ -196,20 +227,20 @@ void modbus_set_class_output(uint16_t class, uint8_t value, uint8_t bypass) {
         .value  = value,
         .bypass = bypass,
     };
-    xQueueSend(messageq, &message, 0);
+    enqueue(&message);
 }
 
 
 void modbus_set_fan_percentage(uint8_t address, uint8_t percentage) {
     struct task_message message = {
         .code = TASK_MESSAGE_CODE_SET_FAN_PERCENTAGE, .address = address, .value = percentage};
-    xQueueSend(messageq, &message, 0);
+    enqueue(&message);
 }
 
 
 void modbus_scan(void) {
     struct task_message message = {.code = TASK_MESSAGE_CODE_SCAN};
-    xQueueSend(messageq, &message, 0);
+    enqueue(&message);
 }
 
 
@@ -220,39 +251,92 @@ void modbus_set_device_output(uint8_t address, uint8_t value, uint8_t bypass) {
         .value   = value,
         .bypass  = bypass,
     };
-    xQueueSend(messageq, &message, 0);
+    enqueue(&message);
 }
 
 
 void modbus_read_device_info(uint8_t address) {
     struct task_message message = {.code = TASK_MESSAGE_CODE_READ_DEVICE_INFO, .address = address};
-    xQueueSend(messageq, &message, 0);
+    enqueue(&message);
 }
 
 
 
 void modbus_read_device_state(uint8_t address) {
     struct task_message message = {.code = TASK_MESSAGE_CODE_READ_DEVICE_STATE, .address = address};
-    xQueueSend(messageq, &message, 0);
+    enqueue(&message);
 }
 
 
 void modbus_read_device_work_hours(uint8_t address) {
     struct task_message message = {.code = TASK_MESSAGE_CODE_READ_DEVICE_WORK_HOURS, .address = address};
-    xQueueSend(messageq, &message, 0);
+    enqueue(&message);
 }
 
 
 void modbus_reset_device_work_hours(uint8_t address) {
     struct task_message message = {.code = TASK_MESSAGE_CODE_RESET_DEVICE_WORK_HOURS, .address = address};
-    xQueueSend(messageq, &message, 0);
+    enqueue(&message);
     modbus_read_device_work_hours(address);
 }
 
 
+void modbus_set_heartbeat(uint8_t sequence, uint8_t safety, uint32_t outputs) {
+    struct task_message message = {
+        .code     = TASK_MESSAGE_CODE_UPDATE_HEARTBEAT,
+        .sequence = sequence,
+        .safety   = safety,
+        .outputs  = outputs,
+    };
+    enqueue(&message);
+}
+
+
+/*
+ * Safety fast path: the all-off broadcast jumps ahead of everything already queued and any running scan
+ * is interrupted. Outputs stay forced off until modbus_safety_clear() acknowledges this trip.
+ */
+void modbus_safety_trip(uint8_t from_isr) {
+    struct task_message message = {.code = TASK_MESSAGE_CODE_SAFETY_TRIP};
+    atomic_fetch_add(&safety_trips, 1);
+    trace_record(TRACE_EVENT_MODBUS_ENQUEUE, TRACE_ARG(message.code, 0));
+
+    if (from_isr) {
+        BaseType_t woken = pdFALSE;
+        xQueueSendToFrontFromISR(messageq, &message, &woken);
+        vTaskNotifyGiveFromISR(task, &woken);
+        portYIELD_FROM_ISR(woken);
+    } else {
+        xQueueSendToFront(messageq, &message, 0);
+        xTaskNotifyGive(task);
+    }
+}
+
+
+/*
+ * Trips taken so far, to be passed back to modbus_safety_clear()
+ */
+uint32_t modbus_safety_generation(void) {
+    return atomic_load(&safety_trips);
+}
+
+
+/*
+ * Lifts the latch for every trip up to `generation`; a later trip keeps it set
+ */
+void modbus_safety_clear(uint32_t generation) {
+    atomic_store(&safety_acknowledged, generation);
+}
+
+
+static uint8_t safety_latched(void) {
+    return atomic_load(&safety_trips) != atomic_load(&safety_acknowledged);
+}
+
+
 void modbus_read_device_inputs(uint8_t address) {
     struct task_message message = {.code = TASK_MESSAGE_CODE_READ_DEVICE_INPUTS, .address = address};
-    xQueueSend(messageq, &message, 0);
+    enqueue(&message);
 }
 
 
@@ -336,6 +420,10 @@ static void modbus_task(void *args) {
     uint8_t             buffer[MODBUS_MAX_PACKET_SIZE] = {0};
     modbus_response_t   error_resp                     = {.code = MODBUS_RESPONSE_CODE_ERROR};
     unsigned long       timestamp                      = 0;
+    heartbeat_t         heartbeat                      = {0};
+    uint8_t             heartbeat_pending              = 0;
+
+    register_cache_init();
 
     ESP_LOGI(TAG, "Task starting");
     send_custom_function(&master, MODBUS_BROADCAST_ADDRESS, EASYCONNECT_FUNCTION_CODE_NETWORK_INITIALIZATION, NULL, 0);
@@ -346,25 +434,25 @@ static void modbus_task(void *args) {
         ESP_LOGD(TAG, "Items: %i", uxQueueMessagesWaiting(messageq));
 
         if (xQueueReceive(messageq, &message, pdMS_TO_TICKS(100))) {
+            trace_record(TRACE_EVENT_MODBUS_DEQUEUE, TRACE_ARG(message.code, message.address));
             modbus_response_t response = {.address = message.address};
             error_resp.address         = message.address;
+            bus_accessed               = 0;
 
             switch (message.code) {
                 case TASK_MESSAGE_CODE_READ_DEVICE_INFO: {
                     response.code    = MODBUS_RESPONSE_CODE_INFO;
                     response.address = message.address;
 
-                    uint16_t registers[5];
-                    if (read_holding_registers(&master, registers, message.address,
-                                               EASYCONNECT_HOLDING_REGISTER_FIRMWARE_VERSION,
-                                               sizeof(registers) / sizeof(registers[0]))) {
+                    uint16_t registers[REGISTERS_INFO_COUNT];
+                    if (read_holding_registers_cached(&master, registers, message.address, REGISTERS_INFO_START,
+                                                      REGISTERS_INFO_COUNT, REGISTERS_INFO_CACHE,
+                                                      &response.from_cache)) {
                         error_resp.success_code = MODBUS_RESPONSE_CODE_INFO;
-                        xQueueSend(responseq, &error_resp, portMAX_DELAY);
+                        send_response(&error_resp);
                     } else {
-                        response.firmware_version = registers[0];
-                        response.class            = registers[1];
-                        response.serial_number    = (registers[2] << 16) | registers[3];
-                        xQueueSend(responseq, &response, portMAX_DELAY);
+                        REGISTERS_INFO_DECODE(response, registers);
+                        send_response(&response);
                     }
                     break;
                 }
@@ -373,14 +461,14 @@ static void modbus_task(void *args) {
                     response.code    = MODBUS_RESPONSE_CODE_STATE;
                     response.address = message.address;
 
-                    uint16_t registers[2];
-                    if (read_holding_registers(&master, registers, message.address, EASYCONNECT_HOLDING_REGISTER_ALARMS,
-                                               sizeof(registers) / sizeof(registers[0]))) {
-                        xQueueSend(responseq, &error_resp, portMAX_DELAY);
+                    uint16_t registers[REGISTERS_STATE_COUNT];
+                    if (read_holding_registers_cached(&master, registers, message.address, REGISTERS_STATE_START,
+                                                      REGISTERS_STATE_COUNT, REGISTERS_STATE_CACHE,
+                                                      &response.from_cache)) {
+                        send_response(&error_resp);
                     } else {
-                        response.alarms = registers[0];
-                        response.state  = registers[1];
-                        xQueueSend(responseq, &response, portMAX_DELAY);
+                        REGISTERS_STATE_DECODE(response, registers);
+                        send_response(&response);
                     }
                     break;
                 }
@@ -389,11 +477,14 @@ static void modbus_task(void *args) {
                     ESP_LOGI(TAG, "Reading inputs from %i", message.address);
                     err = modbusBuildRequest02RTU(&master, message.address, 0, 2);
                     assert(modbusIsOk(err));
+                    bus_accessed = 1;
+                    trace_request(&master);
                     rs485_write(modbusMasterGetRequest(&master), modbusMasterGetRequestLength(&master));
 
                     int len = rs485_read(buffer, sizeof(buffer), pdMS_TO_TICKS(MODBUS_TIMEOUT));
                     err     = modbusParseResponseRTU(&master, modbusMasterGetRequest(&master),
                                                      modbusMasterGetRequestLength(&master), buffer, len);
+                    trace_outcome(&master, err, len);
 
                     if (!modbusIsOk(err)) {
                         ESP_LOG_BUFFER_HEX(TAG, buffer, len);
@@ -405,11 +496,14 @@ static void modbus_task(void *args) {
                 case TASK_MESSAGE_CODE_SET_DEVICE_OUTPUT: {
                     response.code    = MODBUS_RESPONSE_CODE_DEVICE_OK;
                     response.address = message.address;
-                    uint8_t coils    = (message.value << 0) | (message.bypass << 1);
+                    uint8_t value    = safety_latched() ? 0 : message.value;
+                    response.output  = value;
+                    uint8_t coils    = (value << 0) | (message.bypass << 1);
+                    register_cache_invalidate_class(message.address, REGISTER_CLASS_STATE);
                     if (write_coils(&master, message.address, 0, 2, &coils)) {
-                        xQueueSend(responseq, &error_resp, portMAX_DELAY);
+                        send_response(&error_resp);
                     } else {
-                        xQueueSend(responseq, &response, portMAX_DELAY);
+                        send_response(&response);
                     }
                     break;
                 }
@@ -419,7 +513,7 @@ static void modbus_task(void *args) {
 
                     if (read_holding_registers(&master, &event_count, message.address,
                                                EASYCONNECT_HOLDING_REGISTER_LOGS_COUNTER, 1)) {
-                        xQueueSend(responseq, &error_resp, portMAX_DELAY);
+                        send_response(&error_resp);
                         break;
                     }
 
@@ -431,7 +525,7 @@ static void modbus_task(void *args) {
 
                         if (read_holding_registers(&master, registers, message.address,
                                                    EASYCONNECT_HOLDING_REGISTER_LOGS, count)) {
-                            xQueueSend(responseq, &error_resp, portMAX_DELAY);
+                            send_response(&error_resp);
                             break;
                         }
 
@@ -455,16 +549,15 @@ static void modbus_task(void *args) {
                         response.address  = i;
                         response.scanning = 1;
 
-                        uint16_t registers[5];
-                        if (read_holding_registers(&master, registers, response.address,
-                                                   EASYCONNECT_HOLDING_REGISTER_FIRMWARE_VERSION,
-                                                   sizeof(registers) / sizeof(registers[0]))) {
+                        uint16_t registers[REGISTERS_INFO_COUNT];
+                        if (read_holding_registers(&master, registers, response.address, REGISTERS_INFO_START,
+                                                   REGISTERS_INFO_COUNT)) {
                             // No response
                         } else {
-                            response.firmware_version = registers[0];
-                            response.class            = registers[1];
-                            response.serial_number    = (registers[2] << 16) | registers[3];
-                            xQueueSend(responseq, &response, portMAX_DELAY);
+                            REGISTERS_INFO_DECODE(response, registers);
+                            register_cache_store(response.address, REGISTERS_INFO_CACHE, REGISTERS_INFO_START,
+                                                 REGISTERS_INFO_COUNT, registers, get_millis());
+                            send_response(&response);
                         }
 
                         vTaskDelay(pdMS_TO_TICKS(MODBUS_TIMEOUT));
@@ -472,7 +565,7 @@ static void modbus_task(void *args) {
 
                     ESP_LOGI(TAG, "Scan done!");
                     response.code = MODBUS_RESPONSE_CODE_SCAN_DONE;
-                    xQueueSend(responseq, &response, portMAX_DELAY);
+                    send_response(&response);
                     break;
                 }
 
@@ -489,13 +582,36 @@ static void modbus_task(void *args) {
                     break;
                 }
 
+                case TASK_MESSAGE_CODE_UPDATE_HEARTBEAT:
+                    if (heartbeat.outputs != message.outputs || heartbeat.safety != message.safety) {
+                        for (size_t i = 1; i <= MODBUS_MAX_DEVICES; i++) {
+                            register_cache_invalidate_class(i, REGISTER_CLASS_STATE);
+                        }
+                    }
+                    heartbeat.enabled  = 1;
+                    heartbeat.sequence = message.sequence;
+                    heartbeat.safety   = message.safety;
+                    heartbeat.outputs  = message.outputs;
+                    // Propagate the new outputs right away instead of waiting for the next period
+                    heartbeat_pending = 1;
+                    break;
+
+                case TASK_MESSAGE_CODE_SAFETY_TRIP:
+                    ESP_LOGW(TAG, "Safety trip, broadcasting all off");
+                    broadcast_all_off(&master, &heartbeat);
+                    timestamp = get_millis();
+                    break;
+
                 case TASK_MESSAGE_CODE_SET_CLASS_OUTPUT: {
                     uint8_t data[] = {
                         (message.class >> 8) & 0xFF,
                         message.class & 0xFF,
-                        message.value,
+                        safety_latched() ? 0 : message.value,
                         message.bypass,
                     };
+                    for (size_t i = 1; i <= MODBUS_MAX_DEVICES; i++) {
+                        register_cache_invalidate_class(i, REGISTER_CLASS_STATE);
+                    }
                     send_custom_function(&master, MODBUS_BROADCAST_ADDRESS, EASYCONNECT_FUNCTION_CODE_SET_CLASS_OUTPUT,
                                          data, sizeof(data));
                     break;
@@ -503,9 +619,9 @@ static void modbus_task(void *args) {
 
                 case TASK_MESSAGE_CODE_SET_FAN_PERCENTAGE: {
                     ESP_LOGI(TAG, "Setting fan speed for device %i %i%%", message.address, message.value);
-                    if (write_holding_register(&master, message.address, HOLDING_REGISTER_MOTOR_SPEED,
+                    if (write_holding_register(&master, message.address, REGISTERS_MOTOR_SPEED_START,
                                                (uint16_t)message.value)) {
-                        xQueueSend(responseq, &error_resp, portMAX_DELAY);
+                        send_response(&error_resp);
                     }
                     break;
                 }
@@ -514,29 +630,37 @@ static void modbus_task(void *args) {
                     response.code    = MODBUS_RESPONSE_CODE_WORK_HOURS;
                     response.address = message.address;
 
-                    if (read_holding_registers(&master, &response.work_hours, message.address,
-                                               HOLDING_REGISTER_WORK_HOURS, 1)) {
-                        xQueueSend(responseq, &error_resp, portMAX_DELAY);
+                    uint16_t registers[REGISTERS_WORK_HOURS_COUNT];
+                    if (read_holding_registers_cached(&master, registers, message.address, REGISTERS_WORK_HOURS_START,
+                                                      REGISTERS_WORK_HOURS_COUNT, REGISTERS_WORK_HOURS_CACHE,
+                                                      &response.from_cache)) {
+                        send_response(&error_resp);
                     } else {
-                        xQueueSend(responseq, &response, portMAX_DELAY);
+                        REGISTERS_WORK_HOURS_DECODE(response, registers);
+                        send_response(&response);
                     }
                     break;
                 }
 
                 case TASK_MESSAGE_CODE_RESET_DEVICE_WORK_HOURS: {
-                    if (write_holding_register(&master, message.address, HOLDING_REGISTER_WORK_HOURS, 0)) {
-                        xQueueSend(responseq, &error_resp, portMAX_DELAY);
+                    if (write_holding_register(&master, message.address, REGISTERS_WORK_HOURS_START, 0)) {
+                        send_response(&error_resp);
                     }
                     break;
                 }
             }
-            vTaskDelay(pdMS_TO_TICKS(MODBUS_TIMEOUT / 2));
+
+            // Requests served by the cache did not touch the bus, no need for a pause
+            if (bus_accessed) {
+                vTaskDelay(pdMS_TO_TICKS(MODBUS_TIMEOUT / 2));
+            }
         }
 
-        if (is_expired(timestamp, get_millis(), 100)) {
-            send_custom_function(&master, MODBUS_BROADCAST_ADDRESS, EASYCONNECT_FUNCTION_CODE_HEARTBEAT, NULL, 0);
+        if (heartbeat_pending || is_expired(timestamp, get_millis(), APP_CONFIG_HEARTBEAT_PERIOD_MS)) {
+            send_heartbeat(&master, &heartbeat);
             vTaskDelay(pdMS_TO_TICKS(MODBUS_TIMEOUT / 2));
-            timestamp = get_millis();
+            timestamp         = get_millis();
+            heartbeat_pending = 0;
         }
     }
 
@@ -544,6 +668,41 @@ static void modbus_task(void *args) {
 }
 
 
+static void enqueue(const struct task_message *message) {
+    uint16_t arg = TRACE_ARG(message->code, message->address);
+    if (xQueueSend(messageq, message, 0) == pdTRUE) {
+        trace_record(TRACE_EVENT_MODBUS_ENQUEUE, arg);
+    } else {
+        trace_record(TRACE_EVENT_MODBUS_DROP, arg);
+    }
+}
+
+
+static void send_response(const modbus_response_t *response) {
+    trace_record(TRACE_EVENT_MODBUS_RESPONSE, TRACE_ARG(response->code, response->address));
+    xQueueSend(responseq, response, portMAX_DELAY);
+    wakeup_signal(WAKEUP_EVENT_MODBUS);
+}
+
+
+static void trace_request(ModbusMaster *master) {
+    const uint8_t *request = modbusMasterGetRequest(master);
+    trace_record(TRACE_EVENT_MODBUS_SEND, TRACE_ARG(request[1], request[0]));
+}
+
+
+static void trace_outcome(ModbusMaster *master, ModbusErrorInfo err, int len) {
+    const uint8_t *request = modbusMasterGetRequest(master);
+    trace_event_t  event   = TRACE_EVENT_MODBUS_ANSWER;
+    if (len <= 0) {
+        event = TRACE_EVENT_MODBUS_TIMEOUT;
+    } else if (!modbusIsOk(err)) {
+        event = TRACE_EVENT_MODBUS_BAD_ANSWER;
+    }
+    trace_record(event, TRACE_ARG(request[1], request[0]));
+}
+
+
 static LIGHTMODBUS_RET_ERROR build_custom_request(ModbusMaster *status, uint8_t function, uint8_t *data, size_t len) {
     if (modbusMasterAllocateRequest(status, len + 1)) {
         return MODBUS_GENERAL_ERROR(ALLOC);
@@ -589,9 +748,55 @@ static void send_custom_function(ModbusMaster *master, uint8_t address, uint8_t
     assert(modbusIsOk(err));
     err = modbusEndRequestRTU(master, MODBUS_BROADCAST_ADDRESS);
     assert(modbusIsOk(err));
+    bus_accessed = 1;
+    /* Broadcast message, we expect no answer */
+    trace_request(master);
+    rs485_write(modbusMasterGetRequest(master), modbusMasterGetRequestLength(master));
+    vTaskDelay(pdMS_TO_TICKS(MODBUS_TIMEOUT));
+}
+
+
+/*
+ * Heartbeat payload: sequence step, safety state and the desired output bitmap (bit 0 of the first byte is address 1).
+ * Until the controller provides one the heartbeat is sent empty, as before.
+ */
+static void send_heartbeat(ModbusMaster *master, const heartbeat_t *heartbeat) {
+    if (!heartbeat->enabled) {
+        send_custom_function(master, MODBUS_BROADCAST_ADDRESS, EASYCONNECT_FUNCTION_CODE_HEARTBEAT, NULL, 0);
+        return;
+    }
+
+    uint8_t  latched = safety_latched();
+    uint32_t outputs = latched ? 0 : heartbeat->outputs;
+
+    uint8_t data[2 + HEARTBEAT_OUTPUTS_LEN] = {heartbeat->sequence, latched ? 0 : heartbeat->safety};
+    for (size_t i = 0; i < HEARTBEAT_OUTPUTS_LEN; i++) {
+        data[2 + i] = (outputs >> (i * 8)) & 0xFF;
+    }
+
+    send_custom_function(master, MODBUS_BROADCAST_ADDRESS, EASYCONNECT_FUNCTION_CODE_HEARTBEAT, data, sizeof(data));
+}
+
+
+/*
+ * Broadcast coil write switching every output off, followed by a heartbeat that already carries the trip
+ */
+static void broadcast_all_off(ModbusMaster *master, const heartbeat_t *heartbeat) {
+    uint8_t         coils = 0;
+    ModbusErrorInfo err   = modbusBuildRequest15RTU(master, MODBUS_BROADCAST_ADDRESS, 0, 2, &coils);
+    assert(modbusIsOk(err));
+    bus_accessed = 1;
+    rs485_flush();
     /* Broadcast message, we expect no answer */
+    trace_request(master);
     rs485_write(modbusMasterGetRequest(master), modbusMasterGetRequestLength(master));
     vTaskDelay(pdMS_TO_TICKS(MODBUS_TIMEOUT));
+
+    for (size_t i = 1; i <= MODBUS_MAX_DEVICES; i++) {
+        register_cache_invalidate_class(i, REGISTER_CLASS_STATE);
+    }
+
+    send_heartbeat(master, heartbeat);
 }
 
 
@@ -601,16 +806,22 @@ static int write_holding_registers(ModbusMaster *master, uint8_t address, uint16
     int     res                            = 0;
     size_t  counter                        = 0;
 
+    // Whatever the outcome, the cached values cannot be trusted anymore
+    register_cache_invalidate(address, starting_address, num);
+    bus_accessed = 1;
+
     do {
         res                 = 0;
         ModbusErrorInfo err = modbusBuildRequest16RTU(master, address, starting_address, num, data);
         assert(modbusIsOk(err));
         rs485_flush();
+        trace_request(master);
         rs485_write(modbusMasterGetRequest(master), modbusMasterGetRequestLength(master));
 
         int len = rs485_read(buffer, sizeof(buffer), pdMS_TO_TICKS(MODBUS_TIMEOUT));
         err     = modbusParseResponseRTU(master, modbusMasterGetRequest(master), modbusMasterGetRequestLength(master),
                                          buffer, len);
+        trace_outcome(master, err, len);
 
         if (!modbusIsOk(err)) {
             ESP_LOGW(TAG, "Write holding registers for %i error: %i %i", address, err.source, err.error);
@@ -633,15 +844,19 @@ static int write_coils(ModbusMaster *master, uint8_t address, uint16_t index, si
     int     res                            = 0;
     size_t  counter                        = 0;
 
+    bus_accessed = 1;
+
     do {
         ModbusErrorInfo err = modbusBuildRequest15RTU(master, address, index, num_values, values);
         assert(modbusIsOk(err));
         rs485_flush();
+        trace_request(master);
         rs485_write(modbusMasterGetRequest(master), modbusMasterGetRequestLength(master));
 
         int len = rs485_read(buffer, sizeof(buffer), pdMS_TO_TICKS(MODBUS_TIMEOUT));
         err     = modbusParseResponseRTU(master, modbusMasterGetRequest(master), modbusMasterGetRequestLength(master),
                                          buffer, len);
+        trace_outcome(master, err, len);
 
         if (!modbusIsOk(err)) {
             ESP_LOGW(TAG, "Write coil for %i error: %i %i", address, err.source, err.error);
@@ -661,6 +876,8 @@ static int read_holding_registers(ModbusMaster *master, uint16_t *registers, uin
     int             res     = 0;
     size_t          counter = 0;
 
+    bus_accessed = 1;
+
     master_context_t ctx = {.pointer = registers, .start = start};
     if (registers == NULL) {
         modbusMasterSetUserPointer(master, NULL);
@@ -673,11 +890,13 @@ static int read_holding_registers(ModbusMaster *master, uint16_t *registers, uin
         err = modbusBuildRequest03RTU(master, address, start, count);
         assert(modbusIsOk(err));
         rs485_flush();
+        trace_request(master);
         rs485_write(modbusMasterGetRequest(master), modbusMasterGetRequestLength(master));
 
         int len = rs485_read(buffer, sizeof(buffer), pdMS_TO_TICKS(MODBUS_TIMEOUT));
         err     = modbusParseResponseRTU(master, modbusMasterGetRequest(master), modbusMasterGetRequestLength(master),
                                          buffer, len);
+        trace_outcome(master, err, len);
 
         if (!modbusIsOk(err)) {
             ESP_LOGW(TAG, "Read holding registers for %i error %zu: %i %i", address, counter, err.source, err.error);
@@ -693,3 +912,20 @@ static int read_holding_registers(ModbusMaster *master, uint16_t *registers, uin
 
     return res;
 }
+
+
+static int read_holding_registers_cached(ModbusMaster *master, uint16_t *registers, uint8_t address, uint16_t start,
+                                         uint16_t count, register_class_t class, uint8_t *from_cache) {
+    *from_cache = register_cache_read(address, start, count, registers, get_millis()) == 0;
+    if (*from_cache) {
+        ESP_LOGD(TAG, "Holding registers %i-%i for %i served from cache", start, start + count - 1, address);
+        return 0;
+    }
+
+    int res = read_holding_registers(master, registers, address, start, count);
+    if (res == 0) {
+        register_cache_store(address, class, start, count, registers, get_millis());
+    }
+
+    return res;
+}
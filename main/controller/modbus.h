@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include "model/model.h"
+#include "AUTOGEN_FILE_registers.h"
 
 typedef enum {
     MODBUS_RESPONSE_CODE_INFO,
@@ -21,23 +22,24 @@ typedef struct {
     uint8_t                address;
     int                    error;
     int                    scanning;
+    uint8_t                from_cache;     // Served by the register cache, the device was not asked
     int                    devices_number;
     union {
         struct {
-            uint16_t class;
-            uint16_t firmware_version;
-            uint32_t serial_number;
+            REGISTERS_INFO_FIELDS
         };
         struct {
-            uint16_t alarms;
-            uint16_t state;
+            REGISTERS_STATE_FIELDS
         };
         struct {
             int16_t temperature;
             int16_t pressure;
             int16_t humidity;
         };
-        uint16_t work_hours;
+        struct {
+            REGISTERS_WORK_HOURS_FIELDS
+        };
+        uint8_t output;
         struct {
             uint16_t event_count;
         };
@@ -46,20 +48,24 @@ typedef struct {
 } modbus_response_t;
 
 
-void modbus_init(void);
-void modbus_read_device_info(uint8_t address);
-void modbus_read_device_messages(uint8_t address, uint8_t device_model);
-void modbus_read_device_inputs(uint8_t address);
-void modbus_set_device_output(uint8_t address, uint8_t value, uint8_t bypass);
-int  modbus_get_response(modbus_response_t *response);
-void modbus_set_class_output(uint16_t class, uint8_t value, uint8_t bypass);
-void modbus_scan(void);
-void modbus_stop_current_operation(void);
-void modbus_set_fan_percentage(uint8_t address, uint8_t percentage);
-void modbus_read_device_state(uint8_t address);
-void modbus_read_device_pressure(uint8_t address);
-void modbus_update_time(void);
-void modbus_read_device_work_hours(uint8_t address);
-void modbus_reset_device_work_hours(uint8_t address);
+void     modbus_init(void);
+void     modbus_read_device_info(uint8_t address);
+void     modbus_read_device_messages(uint8_t address, uint8_t device_model);
+void     modbus_read_device_inputs(uint8_t address);
+void     modbus_set_device_output(uint8_t address, uint8_t value, uint8_t bypass);
+int      modbus_get_response(modbus_response_t *response);
+void     modbus_set_class_output(uint16_t class, uint8_t value, uint8_t bypass);
+void     modbus_scan(void);
+void     modbus_stop_current_operation(void);
+void     modbus_set_fan_percentage(uint8_t address, uint8_t percentage);
+void     modbus_read_device_state(uint8_t address);
+void     modbus_read_device_pressure(uint8_t address);
+void     modbus_update_time(void);
+void     modbus_read_device_work_hours(uint8_t address);
+void     modbus_reset_device_work_hours(uint8_t address);
+void     modbus_set_heartbeat(uint8_t sequence, uint8_t safety, uint32_t outputs);
+void     modbus_safety_trip(uint8_t from_isr);
+uint32_t modbus_safety_generation(void);
+void     modbus_safety_clear(uint32_t generation);
 
 #endif
@@ -1,152 +1,116 @@
-#include "watcher.h"
 #include "model/model.h"
 #include "observer.h"
-#include "services/system_time.h"
 #include "bsp/interface.h"
 #include "esp_log.h"
-#include "modbus.h"
+#include "services/trace.h"
 #include "easyconnect_interface.h"
 
 
-static void sequence_changed_cb(void *old_value, const void *new_value, watcher_size_t size, void *user_ptr, void *arg);
-static void ballast_changed_cb(void *old_value, const void *new_value, watcher_size_t size, void *user_ptr, void *arg);
-static void ballast_comm_changed_cb(void *old_value, const void *new_value, watcher_size_t size, void *user_ptr,
-                                    void *arg);
-static void work_hours_changed_cb(void *old_value, const void *new_value, watcher_size_t size, void *user_ptr,
-                                  void *arg);
-static void update_all_ballast(model_t *pmodel, int value);
-
-
-static const char *TAG     = "Observer";
-static watcher_t   watcher = {0};
-
-
-void observer_init(model_t *pmodel) {
-    WATCHER_INIT_STD(&watcher, (void *)pmodel);
-
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->sequence, sequence_changed_cb, NULL);
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[0].comm_ok, ballast_comm_changed_cb,
-                      (void *)(uintptr_t)INTERFACE_LED_1);
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[0].present, ballast_comm_changed_cb,
-                      (void *)(uintptr_t)INTERFACE_LED_1);
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[0].state, ballast_changed_cb, (void *)(uintptr_t)INTERFACE_LED_1);
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[0].alarms, ballast_changed_cb, (void *)(uintptr_t)INTERFACE_LED_1);
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[0].class, ballast_changed_cb, (void *)(uintptr_t)INTERFACE_LED_1);
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[0].work_hours, work_hours_changed_cb, NULL);
-
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[1].comm_ok, ballast_comm_changed_cb,
-                      (void *)(uintptr_t)INTERFACE_LED_2);
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[1].present, ballast_comm_changed_cb,
-                      (void *)(uintptr_t)INTERFACE_LED_2);
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[1].state, ballast_changed_cb, (void *)(uintptr_t)INTERFACE_LED_2);
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[1].alarms, ballast_changed_cb, (void *)(uintptr_t)INTERFACE_LED_2);
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[1].class, ballast_changed_cb, (void *)(uintptr_t)INTERFACE_LED_2);
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[1].work_hours, work_hours_changed_cb, NULL);
-
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[2].comm_ok, ballast_comm_changed_cb,
-                      (void *)(uintptr_t)INTERFACE_LED_3);
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[2].present, ballast_comm_changed_cb,
-                      (void *)(uintptr_t)INTERFACE_LED_3);
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[2].state, ballast_changed_cb, (void *)(uintptr_t)INTERFACE_LED_3);
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[2].alarms, ballast_changed_cb, (void *)(uintptr_t)INTERFACE_LED_3);
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[2].class, ballast_changed_cb, (void *)(uintptr_t)INTERFACE_LED_3);
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[2].work_hours, work_hours_changed_cb, NULL);
-
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[3].comm_ok, ballast_comm_changed_cb,
-                      (void *)(uintptr_t)INTERFACE_LED_4);
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[3].present, ballast_comm_changed_cb,
-                      (void *)(uintptr_t)INTERFACE_LED_4);
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[3].state, ballast_changed_cb, (void *)(uintptr_t)INTERFACE_LED_4);
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[3].alarms, ballast_changed_cb, (void *)(uintptr_t)INTERFACE_LED_4);
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[3].class, ballast_changed_cb, (void *)(uintptr_t)INTERFACE_LED_4);
-    WATCHER_ADD_ENTRY(&watcher, &pmodel->ballast[3].work_hours, work_hours_changed_cb, NULL);
-
-    watcher_trigger_all(&watcher);
+/*
+ * The model setters mark the fields they change; each pass only visits the set bits and dispatches them through a
+ * handler table, so the cost depends on the number of changes rather than on the size of the model.
+ */
 
+
+typedef void (*field_handler_t)(model_t *pmodel, size_t ballast);
+
+
+static void update_ballast_led(model_t *pmodel, size_t ballast);
+static void update_all_ballast_leds(model_t *pmodel, size_t ballast);
+static void update_work_hours_led(model_t *pmodel, size_t ballast);
+static void update_safety_led(model_t *pmodel, size_t ballast);
+static void dispatch(model_t *pmodel, size_t field);
+
+
+static const field_handler_t ballast_handlers[MODEL_BALLAST_FIELD_NUM] = {
+    [MODEL_BALLAST_FIELD_COMMUNICATION] = update_ballast_led,
+    [MODEL_BALLAST_FIELD_STATE]         = update_ballast_led,
+    [MODEL_BALLAST_FIELD_WORK_HOURS]    = update_work_hours_led,
+};
+
+
+static const char *TAG = "Observer";
+
+
+void observer_init(mut_model_t *pmodel) {
+    // Refresh the whole interface on the first pass
+    model_mark_all_dirty(pmodel);
     ESP_LOGI(TAG, "Initialized");
 }
 
 
-void observer_manage(void) {
-    watcher_watch(&watcher, get_millis());
-}
+void observer_manage(mut_model_t *pmodel) {
+    for (size_t word = 0; word < MODEL_DIRTY_WORDS; word++) {
+        uint32_t dirty = pmodel->dirty[word];
+        // Handlers only read the model, so the bits can be cleared up front
+        pmodel->dirty[word] = 0;
 
+        while (dirty) {
+            size_t bit = __builtin_ctz(dirty);
+            dirty &= dirty - 1;
+            trace_record(TRACE_EVENT_OBSERVER_FIELD, word * 32 + bit);
+            dispatch(pmodel, word * 32 + bit);
+        }
+    }
+}
 
-static void ballast_changed_cb(void *old_value, const void *new_value, watcher_size_t size, void *user_ptr, void *arg) {
-    (void)old_value;
-    (void)new_value;
-    (void)size;
 
-    model_t        *pmodel  = user_ptr;
-    interface_led_t ballast = (interface_led_t)(uintptr_t)arg;
+static void dispatch(model_t *pmodel, size_t field) {
+    if (field < MODEL_FIELD_SEQUENCE) {
+        size_t ballast = field / MODEL_BALLAST_FIELD_NUM;
+        ballast_handlers[field % MODEL_BALLAST_FIELD_NUM](pmodel, ballast);
 
-    if (model_is_ballast_configured_correctly(pmodel, ballast)) {
-        if (pmodel->ballast[ballast].state == 0 && !model_ballast_should_be_on(pmodel, ballast)) {
-            ESP_LOGD(TAG, "Ballast %i off (%i %i)", ballast, pmodel->sequence,
-                     !model_ballast_should_be_on(pmodel, ballast));
-            interface_set_led_state_off(ballast);
-        } else if (pmodel->ballast[ballast].alarms) {
-            ESP_LOGD(TAG, "Ballast %i with alarms", ballast);
-            interface_set_led_state_blink(ballast, 500);
-        } else {
-            ESP_LOGD(TAG, "Ballast %i on", ballast);
-            interface_set_led_state_on(ballast);
-        }
-    } else {
-        ESP_LOGD(TAG, "Ballast %i error", ballast);
-        if (!pmodel->ballast[ballast].comm_ok && model_ballast_present(pmodel, ballast)) {
-            interface_set_led_state_blink(ballast, 100);
-        } else {
-            interface_set_led_state_off(ballast);
+        // Safety alarms are reported in the ballast state
+        if (field % MODEL_BALLAST_FIELD_NUM == MODEL_BALLAST_FIELD_STATE) {
+            update_safety_led(pmodel, ballast);
         }
+    } else if (field == MODEL_FIELD_SEQUENCE) {
+        update_all_ballast_leds(pmodel, 0);
+    } else if (field == MODEL_FIELD_SAFETY) {
+        update_safety_led(pmodel, 0);
     }
 }
 
 
-static void ballast_comm_changed_cb(void *old_value, const void *new_value, watcher_size_t size, void *user_ptr,
-                                    void *arg) {
-    (void)old_value;
-    (void)new_value;
-    (void)size;
-
-    model_t        *pmodel  = user_ptr;
-    interface_led_t ballast = (interface_led_t)(uintptr_t)arg;
+static void update_ballast_led(model_t *pmodel, size_t ballast) {
+    // Only the first ballasts have a LED
+    if (ballast >= NUM_LED_BALLAST) {
+        return;
+    }
 
     if (model_is_ballast_configured_correctly(pmodel, ballast)) {
-        if (pmodel->ballast[ballast].state == 0 && !model_ballast_should_be_on(pmodel, ballast)) {
-            ESP_LOGD(TAG, "Ballast %i off (%i %i)", ballast, pmodel->sequence,
+        if (model_get_ballast_state(pmodel, ballast) == 0 && !model_ballast_should_be_on(pmodel, ballast)) {
+            ESP_LOGD(TAG, "Ballast %zu off (%i %i)", ballast, model_get_sequence_step(pmodel),
                      !model_ballast_should_be_on(pmodel, ballast));
             interface_set_led_state_off(ballast);
-        } else if (pmodel->ballast[ballast].alarms) {
-            ESP_LOGD(TAG, "Ballast %i with alarms", ballast);
+        } else if (model_get_ballast_alarms(pmodel, ballast)) {
+            ESP_LOGD(TAG, "Ballast %zu with alarms", ballast);
             interface_set_led_state_blink(ballast, 500);
         } else {
-            ESP_LOGD(TAG, "Ballast %i on", ballast);
+            ESP_LOGD(TAG, "Ballast %zu on", ballast);
             interface_set_led_state_on(ballast);
         }
     } else {
-        ESP_LOGD(TAG, "Ballast %i error", ballast);
-        if (!pmodel->ballast[ballast].comm_ok && model_ballast_present(pmodel, ballast)) {
+        ESP_LOGD(TAG, "Ballast %zu error", ballast);
+        if (!model_is_ballast_comm_ok(pmodel, ballast) && model_ballast_present(pmodel, ballast)) {
             interface_set_led_state_blink(ballast, 100);
         } else {
             interface_set_led_state_off(ballast);
         }
     }
+}
 
-    if (model_ballast_should_be_on(pmodel, ballast)) {
-        modbus_set_device_output(ballast + 1, 1, 0);
+
+static void update_all_ballast_leds(model_t *pmodel, size_t ballast) {
+    (void)ballast;
+    for (size_t i = 0; i < MODBUS_MAX_DEVICES && i < NUM_LED_BALLAST; i++) {
+        update_ballast_led(pmodel, i);
     }
 }
 
 
-static void work_hours_changed_cb(void *old_value, const void *new_value, watcher_size_t size, void *user_ptr,
-                                  void *arg) {
-    (void)old_value;
-    (void)new_value;
-    (void)size;
-    (void)arg;
-
-    model_t *pmodel = user_ptr;
+static void update_work_hours_led(model_t *pmodel, size_t ballast) {
+    (void)ballast;
     if (model_get_working_hours_alarm(pmodel)) {
         interface_set_alarm();
     } else if (model_get_working_hours_warning(pmodel)) {
@@ -157,58 +121,7 @@ static void work_hours_changed_cb(void *old_value, const void *new_value, watche
 }
 
 
-static void sequence_changed_cb(void *old_value, const void *new_value, watcher_size_t size, void *user_ptr,
-                                void *arg) {
-    (void)old_value;
-    (void)new_value;
-    (void)size;
-    (void)arg;
-
-    model_t *pmodel = user_ptr;
-    switch (pmodel->sequence) {
-        case BALLAST_SEQUENCE_NONE:
-            update_all_ballast(pmodel, 0);
-            break;
-
-        case BALLAST_SEQUENCE_1:
-            modbus_set_device_output(1, 1, 0);
-            modbus_set_device_output(2, 0, 0);
-            modbus_set_device_output(3, 0, 0);
-            modbus_set_device_output(4, 0, 0);
-            modbus_read_device_state(1);
-            break;
-
-        case BALLAST_SEQUENCE_2:
-            modbus_set_device_output(2, 1, 0);
-            modbus_set_device_output(1, 1, 0);
-            modbus_set_device_output(3, 0, 0);
-            modbus_set_device_output(4, 0, 0);
-            modbus_read_device_state(2);
-            break;
-
-        case BALLAST_SEQUENCE_3:
-            modbus_set_device_output(3, 1, 0);
-            modbus_set_device_output(2, 1, 0);
-            modbus_set_device_output(1, 1, 0);
-            modbus_set_device_output(4, 0, 0);
-            modbus_read_device_state(3);
-            break;
-
-        case BALLAST_SEQUENCE_4:
-            update_all_ballast(pmodel, 1);
-            modbus_read_device_state(4);
-            break;
-
-        case BALLAST_SEQUENCE_DONE:
-            update_all_ballast(pmodel, 1);
-            break;
-    }
-}
-
-
-static void update_all_ballast(model_t *pmodel, int value) {
-    modbus_set_device_output(4, value > 0, 0);
-    modbus_set_device_output(3, value > 0, 0);
-    modbus_set_device_output(2, value > 0, 0);
-    modbus_set_device_output(1, value > 0, 0);
+static void update_safety_led(model_t *pmodel, size_t ballast) {
+    (void)ballast;
+    interface_set_safety(!model_is_safety_ok(pmodel));
 }
@@ -5,7 +5,7 @@
 #include "model/model.h"
 
 
-void observer_init(model_t *pmodel);
-void observer_manage(void);
+void observer_init(mut_model_t *pmodel);
+void observer_manage(mut_model_t *pmodel);
 
 #endif
@@ -0,0 +1,180 @@
+#include <assert.h>
+#include "reconciler.h"
+#include "modbus.h"
+#include "model/model.h"
+#include "services/system_time.h"
+#include "config/app_config.h"
+#include "esp_log.h"
+
+
+/*
+ * Keeps the ballast outputs in line with the model: the desired state comes from the sequence and safety,
+ * the actual state from write acknowledgements and state reads. Writes are only issued while the two differ.
+ */
+
+
+typedef enum {
+    OUTPUT_UNKNOWN = 0,
+    OUTPUT_OFF,
+    OUTPUT_ON,
+} output_state_t;
+
+
+typedef struct {
+    uint8_t        desired;
+    output_state_t actual;
+    uint8_t        pending;
+    unsigned long  desired_ts;
+    unsigned long  write_ts;
+} output_t;
+
+
+static unsigned long reconcile(model_t *pmodel, size_t ballast);
+static uint32_t      get_desired_outputs(model_t *pmodel);
+static void          update_heartbeat(model_t *pmodel, uint32_t desired);
+
+
+static const char *TAG                         = "Reconciler";
+static output_t    outputs[MODBUS_MAX_DEVICES] = {0};
+
+
+void reconciler_init(void) {
+    for (size_t i = 0; i < MODBUS_MAX_DEVICES; i++) {
+        outputs[i].desired    = 0;
+        outputs[i].actual     = OUTPUT_UNKNOWN;
+        outputs[i].pending    = 0;
+        outputs[i].desired_ts = get_millis();
+        outputs[i].write_ts   = get_millis() - APP_CONFIG_OUTPUT_RETRY_MS;
+    }
+}
+
+
+/*
+ * Returns the time left before the next write or retry may be due
+ */
+unsigned long reconciler_manage(model_t *pmodel) {
+    assert(pmodel != NULL);
+    unsigned long next = DEADLINE_NONE;
+
+    uint32_t desired = get_desired_outputs(pmodel);
+    update_heartbeat(pmodel, desired);
+
+    for (size_t i = 0; i < MODBUS_MAX_DEVICES; i++) {
+        output_t *output  = &outputs[i];
+        uint8_t   changed = (uint8_t)((desired >> i) & 1) != output->desired;
+
+        if (changed) {
+            output->desired    = (desired >> i) & 1;
+            output->desired_ts = get_millis();
+            output->pending    = 0;
+        }
+
+        next = MIN(next, reconcile(pmodel, i));
+
+        // Read the state back after a change, the sequencer waits for it to confirm the ignition
+        if (changed && model_is_ballast_comm_ok(pmodel, i)) {
+            modbus_read_device_state(i + 1);
+        }
+    }
+
+    return next;
+}
+
+
+void reconciler_output_confirmed(uint8_t address, uint8_t value) {
+    if (address < 1 || address > MODBUS_MAX_DEVICES) {
+        return;
+    }
+
+    output_t *output = &outputs[address - 1];
+    output->actual   = value ? OUTPUT_ON : OUTPUT_OFF;
+    output->pending  = 0;
+}
+
+
+void reconciler_state_observed(uint8_t address, uint16_t state) {
+    if (address < 1 || address > MODBUS_MAX_DEVICES) {
+        return;
+    }
+
+    output_t *output = &outputs[address - 1];
+    // Right after a write the state may still lag behind the coil; trust the acknowledgement for a while
+    if (is_expired(output->write_ts, get_millis(), APP_CONFIG_OUTPUT_FALLBACK_MS)) {
+        output->actual  = state != 0 ? OUTPUT_ON : OUTPUT_OFF;
+        output->pending = 0;
+    }
+}
+
+
+static unsigned long reconcile(model_t *pmodel, size_t ballast) {
+    output_t     *output  = &outputs[ballast];
+    uint8_t       address = ballast + 1;
+    unsigned long wait    = 0;
+
+    if (!model_is_ballast_comm_ok(pmodel, ballast)) {
+        // Whatever the device had is lost with it; rewrite once it comes back
+        output->actual  = OUTPUT_UNKNOWN;
+        output->pending = 0;
+        return DEADLINE_NONE;
+    }
+
+    if (output->actual == (output->desired ? OUTPUT_ON : OUTPUT_OFF)) {
+        return DEADLINE_NONE;
+    }
+
+#if APP_CONFIG_HEARTBEAT_OUTPUTS
+    // Give the device the chance to follow the heartbeat before falling back to a direct write
+    wait = MAX(wait, time_remaining(output->desired_ts, get_millis(), APP_CONFIG_OUTPUT_FALLBACK_MS));
+#endif
+    if (output->pending) {
+        wait = MAX(wait, time_remaining(output->write_ts, get_millis(), APP_CONFIG_OUTPUT_RETRY_MS));
+    }
+    wait = MAX(wait, time_remaining(output->write_ts, get_millis(), APP_CONFIG_OUTPUT_MIN_INTERVAL_MS));
+
+    if (wait > 0) {
+        return wait;
+    }
+
+    ESP_LOGI(TAG, "Writing output %i to device %i%s", output->desired, address, output->pending ? " (retry)" : "");
+    modbus_set_device_output(address, output->desired, 0);
+    output->pending  = 1;
+    output->write_ts = get_millis();
+    return APP_CONFIG_OUTPUT_RETRY_MS;
+}
+
+
+static uint32_t get_desired_outputs(model_t *pmodel) {
+    uint32_t desired = 0;
+
+    if (model_is_safety_ok(pmodel)) {
+        for (size_t i = 0; i < MODBUS_MAX_DEVICES; i++) {
+            if (model_ballast_should_be_on(pmodel, i)) {
+                desired |= 1UL << i;
+            }
+        }
+    }
+
+    return desired;
+}
+
+
+static void update_heartbeat(model_t *pmodel, uint32_t desired) {
+#if APP_CONFIG_HEARTBEAT_OUTPUTS
+    static uint8_t  initialized       = 0;
+    static uint8_t  sequence          = 0;
+    static uint8_t  safety            = 0;
+    static uint32_t heartbeat_outputs = 0;
+
+    if (!initialized || sequence != model_get_sequence_step(pmodel) || safety != model_is_safety_ok(pmodel) ||
+        heartbeat_outputs != desired) {
+        initialized       = 1;
+        sequence          = model_get_sequence_step(pmodel);
+        safety            = model_is_safety_ok(pmodel);
+        heartbeat_outputs = desired;
+        modbus_set_heartbeat(sequence, safety, heartbeat_outputs);
+    }
+#else
+    (void)pmodel;
+    (void)desired;
+#endif
+}
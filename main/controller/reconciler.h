@@ -0,0 +1,15 @@
+#ifndef RECONCILER_H_INCLUDED
+#define RECONCILER_H_INCLUDED
+
+
+#include <stdint.h>
+#include "model/model.h"
+
+
+void reconciler_init(void);
+unsigned long reconciler_manage(model_t *pmodel);
+void reconciler_output_confirmed(uint8_t address, uint8_t value);
+void reconciler_state_observed(uint8_t address, uint16_t state);
+
+
+#endif
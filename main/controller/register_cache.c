@@ -0,0 +1,147 @@
+#include <assert.h>
+#include "register_cache.h"
+#include "model/model.h"
+#include "services/system_time.h"
+
+
+/*
+ * Holding register values last read from each device, keyed by (address, register).
+ * Only accessed by the Modbus task, so no locking is needed.
+ */
+
+
+#define SLOTS_PER_DEVICE 8
+
+
+typedef struct {
+    uint8_t          valid;
+    register_class_t class;
+    uint16_t         index;
+    uint16_t         value;
+    unsigned long    timestamp;
+} cache_slot_t;
+
+
+static cache_slot_t *find_slot(uint8_t address, uint16_t index);
+static cache_slot_t *get_free_slot(uint8_t address, unsigned long now);
+
+
+// How long a value is considered fresh, per register class
+static const unsigned long ttl_ms[REGISTER_CLASS_NUM] = {
+    [REGISTER_CLASS_STATE]      = 100,
+    [REGISTER_CLASS_INFO]       = 10000,
+    [REGISTER_CLASS_WORK_HOURS] = 60000,
+};
+
+static cache_slot_t cache[MODBUS_MAX_DEVICES][SLOTS_PER_DEVICE] = {0};
+
+
+void register_cache_init(void) {
+    for (size_t i = 0; i < MODBUS_MAX_DEVICES; i++) {
+        for (size_t j = 0; j < SLOTS_PER_DEVICE; j++) {
+            cache[i][j].valid = 0;
+        }
+    }
+}
+
+
+/*
+ * Fills `registers` only if every register in the range is cached and still fresh.
+ * Returns 0 on a hit, 1 on a miss.
+ */
+int register_cache_read(uint8_t address, uint16_t start, uint16_t count, uint16_t *registers, unsigned long now) {
+    assert(registers != NULL);
+
+    for (uint16_t i = 0; i < count; i++) {
+        cache_slot_t *slot = find_slot(address, start + i);
+        if (slot == NULL || is_expired(slot->timestamp, now, ttl_ms[slot->class])) {
+            return 1;
+        }
+    }
+
+    for (uint16_t i = 0; i < count; i++) {
+        registers[i] = find_slot(address, start + i)->value;
+    }
+
+    return 0;
+}
+
+
+void register_cache_store(uint8_t address, register_class_t class, uint16_t start, uint16_t count,
+                          const uint16_t *registers, unsigned long now) {
+    assert(registers != NULL);
+
+    for (uint16_t i = 0; i < count; i++) {
+        cache_slot_t *slot = find_slot(address, start + i);
+        if (slot == NULL) {
+            slot = get_free_slot(address, now);
+        }
+        if (slot == NULL) {
+            return;
+        }
+
+        slot->valid     = 1;
+        slot->class     = class;
+        slot->index     = start + i;
+        slot->value     = registers[i];
+        slot->timestamp = now;
+    }
+}
+
+
+void register_cache_invalidate(uint8_t address, uint16_t start, uint16_t count) {
+    for (uint16_t i = 0; i < count; i++) {
+        cache_slot_t *slot = find_slot(address, start + i);
+        if (slot != NULL) {
+            slot->valid = 0;
+        }
+    }
+}
+
+
+void register_cache_invalidate_class(uint8_t address, register_class_t class) {
+    if (address < 1 || address > MODBUS_MAX_DEVICES) {
+        return;
+    }
+
+    for (size_t i = 0; i < SLOTS_PER_DEVICE; i++) {
+        if (cache[address - 1][i].class == class) {
+            cache[address - 1][i].valid = 0;
+        }
+    }
+}
+
+
+static cache_slot_t *find_slot(uint8_t address, uint16_t index) {
+    if (address < 1 || address > MODBUS_MAX_DEVICES) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < SLOTS_PER_DEVICE; i++) {
+        if (cache[address - 1][i].valid && cache[address - 1][i].index == index) {
+            return &cache[address - 1][i];
+        }
+    }
+
+    return NULL;
+}
+
+
+static cache_slot_t *get_free_slot(uint8_t address, unsigned long now) {
+    if (address < 1 || address > MODBUS_MAX_DEVICES) {
+        return NULL;
+    }
+
+    // Prefer an empty slot, otherwise evict the oldest value
+    cache_slot_t *oldest = &cache[address - 1][0];
+    for (size_t i = 0; i < SLOTS_PER_DEVICE; i++) {
+        cache_slot_t *slot = &cache[address - 1][i];
+        if (!slot->valid) {
+            return slot;
+        } else if ((long)(now - slot->timestamp) > (long)(now - oldest->timestamp)) {
+            oldest = slot;
+        }
+    }
+
+    return oldest;
+}
@@ -0,0 +1,25 @@
+#ifndef REGISTER_CACHE_H_INCLUDED
+#define REGISTER_CACHE_H_INCLUDED
+
+
+#include <stdint.h>
+#include <stdlib.h>
+
+
+typedef enum {
+    REGISTER_CLASS_STATE = 0,
+    REGISTER_CLASS_INFO,
+    REGISTER_CLASS_WORK_HOURS,
+    REGISTER_CLASS_NUM,
+} register_class_t;
+
+
+void register_cache_init(void);
+int  register_cache_read(uint8_t address, uint16_t start, uint16_t count, uint16_t *registers, unsigned long now);
+void register_cache_store(uint8_t address, register_class_t class, uint16_t start, uint16_t count,
+                          const uint16_t *registers, unsigned long now);
+void register_cache_invalidate(uint8_t address, uint16_t start, uint16_t count);
+void register_cache_invalidate_class(uint8_t address, register_class_t class);
+
+
+#endif
@@ -0,0 +1,110 @@
+#include <assert.h>
+#include <string.h>
+#include "snapshot.h"
+#include "model/model.h"
+#include "services/record_store.h"
+#include "services/system_time.h"
+#include "esp_log.h"
+
+
+/*
+ * Last known device map and work hours, persisted so that the next boot can start from them
+ * instead of waiting for the first polling round.
+ */
+
+
+#define SNAPSHOT_KEY          "DEVMAP"
+#define SNAPSHOT_MIN_INTERVAL 10000UL
+
+
+typedef struct __attribute__((packed)) {
+    uint8_t  present;
+    uint16_t class;
+    uint16_t firmware_version;
+    uint32_t serial_number;
+    uint16_t work_hours;
+} snapshot_device_t;
+
+typedef struct __attribute__((packed)) {
+    snapshot_device_t devices[MODBUS_MAX_DEVICES];
+} snapshot_t;
+
+
+static void take_snapshot(model_t *pmodel, snapshot_t *snapshot);
+
+
+// Add a migration here whenever the layout changes
+static const record_type_t snapshot_record = {
+    .version    = 1,
+    .size       = sizeof(snapshot_t),
+    .migrations = NULL,
+};
+
+static const char *TAG           = "Snapshot";
+static snapshot_t  last_snapshot = {0};
+
+
+void snapshot_restore(mut_model_t *pmodel) {
+    assert(pmodel != NULL);
+
+    snapshot_t snapshot = {0};
+    if (record_store_load(&snapshot_record, SNAPSHOT_KEY, &snapshot)) {
+        ESP_LOGI(TAG, "No device map to restore");
+        return;
+    }
+
+    for (size_t i = 0; i < MODBUS_MAX_DEVICES; i++) {
+        snapshot_device_t *device = &snapshot.devices[i];
+        if (device->present == BALLAST_PRESENCE_UNKNOWN) {
+            continue;
+        }
+
+        ESP_LOGI(TAG, "Restoring device %zu: class 0x%02X, serial %u, %ih", i + 1, device->class,
+                 (unsigned int)device->serial_number, device->work_hours);
+        model_restore_ballast(pmodel, i, device->present, device->class, device->firmware_version,
+                              device->serial_number, device->work_hours);
+    }
+
+    last_snapshot = snapshot;
+}
+
+
+/*
+ * Saves the device map whenever it changes, at most once every SNAPSHOT_MIN_INTERVAL milliseconds.
+ * Returns the time left before a pending change can be saved.
+ */
+unsigned long snapshot_manage(model_t *pmodel) {
+    static unsigned long timestamp = 0;
+    assert(pmodel != NULL);
+
+    snapshot_t snapshot = {0};
+    take_snapshot(pmodel, &snapshot);
+
+    if (memcmp(&snapshot, &last_snapshot, sizeof(snapshot)) == 0) {
+        return DEADLINE_NONE;
+    } else if (!is_expired(timestamp, get_millis(), SNAPSHOT_MIN_INTERVAL)) {
+        return time_remaining(timestamp, get_millis(), SNAPSHOT_MIN_INTERVAL);
+    }
+
+    record_store_save(&snapshot_record, SNAPSHOT_KEY, &snapshot);
+    last_snapshot = snapshot;
+    timestamp     = get_millis();
+    return DEADLINE_NONE;
+}
+
+
+static void take_snapshot(model_t *pmodel, snapshot_t *snapshot) {
+    for (size_t i = 0; i < MODBUS_MAX_DEVICES; i++) {
+        // Provisional information has not been confirmed yet, keep what was saved
+        if (model_is_ballast_provisional(pmodel, i)) {
+            snapshot->devices[i] = last_snapshot.devices[i];
+            continue;
+        }
+
+        snapshot->devices[i].present          = model_get_ballast_presence(pmodel, i);
+        snapshot->devices[i].class            = model_get_ballast_class(pmodel, i);
+        snapshot->devices[i].firmware_version = model_get_ballast_firmware_version(pmodel, i);
+        snapshot->devices[i].serial_number    = model_get_ballast_serial_number(pmodel, i);
+        snapshot->devices[i].work_hours       = model_get_ballast_work_hours(pmodel, i);
+    }
+}
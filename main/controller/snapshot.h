@@ -0,0 +1,12 @@
+#ifndef SNAPSHOT_H_INCLUDED
+#define SNAPSHOT_H_INCLUDED
+
+
+#include "model/model.h"
+
+
+void snapshot_restore(mut_model_t *pmodel);
+unsigned long snapshot_manage(model_t *pmodel);
+
+
+#endif
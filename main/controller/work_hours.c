@@ -0,0 +1,125 @@
+#include <assert.h>
+#include <stdlib.h>
+#include "work_hours.h"
+#include "modbus.h"
+#include "model/model.h"
+#include "config/app_config.h"
+#include "services/system_time.h"
+#include "esp_log.h"
+
+
+/*
+ * Work hours are counted locally from the on state reported by each ballast; the device counter is only read
+ * once an hour or when the ballast comes back online. A reading that differs from the estimate by more than
+ * APP_CONFIG_WORK_HOURS_DRIFT is flagged, and the device value always wins.
+ */
+
+
+#define MS_PER_HOUR (60UL * 60UL * 1000UL)
+
+
+typedef struct {
+    unsigned long on_ms;     // On time accumulated towards the next hour
+    unsigned long sync_ts;
+    uint8_t       synced;
+    uint8_t       comm_ok;
+    uint8_t       drift;
+} estimate_t;
+
+
+static const char   *TAG                           = "Work hours";
+static estimate_t    estimates[MODBUS_MAX_DEVICES] = {0};
+static unsigned long last_ts                       = 0;
+
+
+void work_hours_init(void) {
+    for (size_t i = 0; i < MODBUS_MAX_DEVICES; i++) {
+        estimates[i] = (estimate_t){0};
+    }
+    last_ts = get_millis();
+}
+
+
+/*
+ * Accumulates the on time since the previous pass and requests the readings that are due;
+ * returns the time left before the next synchronization.
+ */
+unsigned long work_hours_manage(mut_model_t *pmodel) {
+    assert(pmodel != NULL);
+
+    unsigned long now     = get_millis();
+    unsigned long elapsed = now - last_ts;
+    unsigned long next    = DEADLINE_NONE;
+    last_ts               = now;
+
+    for (size_t i = 0; i < MODBUS_MAX_DEVICES; i++) {
+        estimate_t *estimate = &estimates[i];
+        uint8_t     address  = i + 1;
+        uint8_t     comm_ok  = model_is_ballast_comm_ok(pmodel, i);
+
+        if (comm_ok && model_get_ballast_state(pmodel, i) != 0) {
+            estimate->on_ms += elapsed;
+            while (estimate->on_ms >= MS_PER_HOUR) {
+                estimate->on_ms -= MS_PER_HOUR;
+                model_set_ballast_work_hours(pmodel, address, model_get_ballast_work_hours(pmodel, i) + 1);
+            }
+        }
+
+        if (comm_ok) {
+            // Reconnection: whatever happened while offline is unknown
+            if (!estimate->comm_ok) {
+                estimate->synced = 0;
+            }
+
+            if (!estimate->synced || is_expired(estimate->sync_ts, now, APP_CONFIG_WORK_HOURS_SYNC_MS)) {
+                modbus_read_device_work_hours(address);
+                // Retried after a full period if the reading fails
+                estimate->synced  = 1;
+                estimate->sync_ts = now;
+            }
+
+            next = MIN(next, time_remaining(estimate->sync_ts, now, APP_CONFIG_WORK_HOURS_SYNC_MS));
+        }
+
+        estimate->comm_ok = comm_ok;
+    }
+
+    return next;
+}
+
+
+/*
+ * Called with the counter read from the device, before it replaces the estimate in the model
+ */
+void work_hours_device_reading(model_t *pmodel, uint8_t address, uint16_t work_hours) {
+    assert(pmodel != NULL);
+    if (address < 1 || address > MODBUS_MAX_DEVICES) {
+        return;
+    }
+
+    estimate_t *estimate = &estimates[address - 1];
+    uint16_t    expected = model_get_ballast_work_hours(pmodel, address - 1);
+
+    estimate->drift = abs((int)work_hours - (int)expected) > APP_CONFIG_WORK_HOURS_DRIFT;
+    if (estimate->drift) {
+        ESP_LOGW(TAG, "Device %i reports %ih, estimated %ih", address, work_hours, expected);
+    }
+}
+
+
+void work_hours_reset(uint8_t address) {
+    if (address < 1 || address > MODBUS_MAX_DEVICES) {
+        return;
+    }
+
+    estimates[address - 1].on_ms = 0;
+    estimates[address - 1].drift = 0;
+}
+
+
+uint8_t work_hours_has_drift(uint8_t address) {
+    if (address < 1 || address > MODBUS_MAX_DEVICES) {
+        return 0;
+    }
+    return estimates[address - 1].drift;
+}
@@ -0,0 +1,16 @@
+#ifndef WORK_HOURS_H_INCLUDED
+#define WORK_HOURS_H_INCLUDED
+
+
+#include <stdint.h>
+#include "model/model.h"
+
+
+void          work_hours_init(void);
+unsigned long work_hours_manage(mut_model_t *pmodel);
+void          work_hours_device_reading(model_t *pmodel, uint8_t address, uint16_t work_hours);
+void          work_hours_reset(uint8_t address);
+uint8_t       work_hours_has_drift(uint8_t address);
+
+
+#endif
@@ -8,6 +8,9 @@
 #include "bsp/interface.h"
 #include "bsp/safety.h"
 #include "bsp/rs485.h"
+#include "bsp/storage.h"
+#include "bsp/console.h"
+#include "services/wakeup.h"
 
 
 static const char *TAG = "Main";
@@ -16,16 +19,19 @@ static const char *TAG = "Main";
 void app_main(void) {
     mut_model_t model;
 
+    wakeup_init();
     safety_init();
     interface_init();
     rs485_init();
+    storage_init();
+    console_init();
 
     model_init(&model);
     controller_init(&model);
 
     ESP_LOGI(TAG, "Begin main loop");
     for (;;) {
-        controller_manage(&model);
-        vTaskDelay(pdMS_TO_TICKS(10));
+        // Sleep until the next deadline, or until a Modbus response, safety change or button press comes in
+        wakeup_wait(controller_manage(&model));
     }
 }
@@ -6,6 +6,10 @@
 
 
 static size_t ballast_from_address(uint8_t address);
+static void   set_present(mut_model_t *pmodel, size_t ballast);
+static void   mark_dirty(mut_model_t *pmodel, size_t field);
+static void   update_summary(mut_model_t *pmodel, size_t ballast);
+static void   set_bit(uint32_t *mask, size_t ballast, uint8_t value);
 
 
 static const char *TAG = "Model";
@@ -15,119 +19,228 @@ void model_init(mut_model_t *pmodel) {
     assert(pmodel != NULL);
 
     for (size_t i = 0; i < MODBUS_MAX_DEVICES; i++) {
-        pmodel->ballast[i].present    = BALLAST_PRESENCE_UNKNOWN;
-        pmodel->ballast[i].comm_ok    = 0;
-        pmodel->ballast[i].class      = 0;
-        pmodel->ballast[i].alarms     = 0;
-        pmodel->ballast[i].state      = 0;
-        pmodel->ballast[i].work_hours = 0;
+        pmodel->ballast[i].present          = BALLAST_PRESENCE_UNKNOWN;
+        pmodel->ballast[i].class            = 0;
+        pmodel->ballast[i].firmware_version = 0;
+        pmodel->ballast[i].serial_number    = 0;
+        pmodel->ballast[i].alarms           = 0;
+        pmodel->ballast[i].state            = 0;
+        pmodel->ballast[i].state_updates    = 0;
+        pmodel->ballast[i].work_hours       = 0;
     }
 
-    pmodel->sequence    = BALLAST_SEQUENCE_1;
-    pmodel->sequence_ts = 0;
-    pmodel->safety_ok   = 0;
+    pmodel->comm_ok_mask       = 0;
+    pmodel->provisional_mask   = 0;
+    pmodel->alarm_mask         = 0;
+    pmodel->safety_alarm_mask  = 0;
+    pmodel->hours_warning_mask = 0;
+    pmodel->hours_alarm_mask   = 0;
+
+    // Nothing is switched on before the first pass of the updater has seen the safety input
+    pmodel->sequence         = BALLAST_SEQUENCE_NONE;
+    pmodel->sequence_stage   = 0;
+    pmodel->sequence_outputs = 0;
+    pmodel->sequence_ts      = 0;
+    pmodel->safety_ok        = 0;
+
+    model_mark_all_dirty(pmodel);
 
     ESP_LOGI(TAG, "Initialized");
 }
 
 
-uint8_t model_are_all_ballast_working(model_t *pmodel) {
+void model_mark_all_dirty(mut_model_t *pmodel) {
     assert(pmodel != NULL);
-
-    for (size_t i = 0; i < MODBUS_MAX_DEVICES; i++) {
-        if (pmodel->ballast[i].alarms > 0) {
-            return 0;
-        }
+    for (size_t i = 0; i < MODEL_FIELD_NUM; i++) {
+        mark_dirty(pmodel, i);
     }
+}
+
 
-    return 1;
+uint8_t model_are_all_ballast_working(model_t *pmodel) {
+    assert(pmodel != NULL);
+    return pmodel->alarm_mask == 0;
 }
 
 
 uint8_t model_is_ballast_configured_correctly(model_t *pmodel, size_t ballast) {
     assert(pmodel != NULL);
-    return pmodel->ballast[ballast].comm_ok && CLASS_GET_MODE(pmodel->ballast[ballast].class) == DEVICE_MODE_UVC;
+    // A device restored from the last run is trusted until the first transaction tells otherwise
+    return (model_is_ballast_comm_ok(pmodel, ballast) || model_is_ballast_provisional(pmodel, ballast)) &&
+           CLASS_GET_MODE(pmodel->ballast[ballast].class) == DEVICE_MODE_UVC;
 }
 
 
 void model_set_ballast_communication_ok(mut_model_t *pmodel, uint8_t address, uint8_t comm_ok) {
     assert(pmodel != NULL);
-    pmodel->ballast[ballast_from_address(address)].comm_ok = comm_ok;
-    if (pmodel->ballast[ballast_from_address(address)].present == BALLAST_PRESENCE_UNKNOWN) {
-        pmodel->ballast[ballast_from_address(address)].present =
-            comm_ok ? BALLAST_PRESENCE_FOUND : BALLAST_PRESENCE_MISSING;
+    size_t ballast = ballast_from_address(address);
+
+    uint8_t present     = pmodel->ballast[ballast].present;
+    uint8_t provisional = model_is_ballast_provisional(pmodel, ballast);
+    // Restored presence only holds until the first transaction
+    if (present == BALLAST_PRESENCE_UNKNOWN || provisional) {
+        present = comm_ok ? BALLAST_PRESENCE_FOUND : BALLAST_PRESENCE_MISSING;
+    }
+
+    if (model_is_ballast_comm_ok(pmodel, ballast) != (comm_ok > 0) || pmodel->ballast[ballast].present != present ||
+        provisional) {
+        pmodel->ballast[ballast].present = present;
+        set_bit(&pmodel->comm_ok_mask, ballast, comm_ok);
+        set_bit(&pmodel->provisional_mask, ballast, 0);
+        mark_dirty(pmodel, MODEL_FIELD_BALLAST(ballast, MODEL_BALLAST_FIELD_COMMUNICATION));
     }
 }
 
 
 void model_set_ballast_class(mut_model_t *pmodel, uint8_t address, uint16_t class) {
     assert(pmodel != NULL);
-    pmodel->ballast[ballast_from_address(address)].class = class;
+    size_t ballast = ballast_from_address(address);
+
+    if (pmodel->ballast[ballast].class != class) {
+        pmodel->ballast[ballast].class = class;
+        mark_dirty(pmodel, MODEL_FIELD_BALLAST(ballast, MODEL_BALLAST_FIELD_STATE));
+    }
+}
+
+
+void model_set_ballast_info(mut_model_t *pmodel, uint8_t address, uint16_t class, uint16_t firmware_version,
+                            uint32_t serial_number) {
+    assert(pmodel != NULL);
+    size_t ballast = ballast_from_address(address);
+
+    model_set_ballast_class(pmodel, address, class);
+    pmodel->ballast[ballast].firmware_version = firmware_version;
+    pmodel->ballast[ballast].serial_number    = serial_number;
+}
+
+
+/*
+ * Loads what was known about a ballast at the end of the last run; it stays provisional until confirmed
+ */
+void model_restore_ballast(mut_model_t *pmodel, size_t ballast, ballast_presence_t present, uint16_t class,
+                           uint16_t firmware_version, uint32_t serial_number, uint16_t work_hours) {
+    assert(pmodel != NULL);
+    pmodel->ballast[ballast].present          = present;
+    pmodel->ballast[ballast].class            = class;
+    pmodel->ballast[ballast].firmware_version = firmware_version;
+    pmodel->ballast[ballast].serial_number    = serial_number;
+    pmodel->ballast[ballast].work_hours       = work_hours;
+    set_bit(&pmodel->provisional_mask, ballast, present == BALLAST_PRESENCE_FOUND);
+    update_summary(pmodel, ballast);
+
+    mark_dirty(pmodel, MODEL_FIELD_BALLAST(ballast, MODEL_BALLAST_FIELD_COMMUNICATION));
+    mark_dirty(pmodel, MODEL_FIELD_BALLAST(ballast, MODEL_BALLAST_FIELD_STATE));
+    mark_dirty(pmodel, MODEL_FIELD_BALLAST(ballast, MODEL_BALLAST_FIELD_WORK_HOURS));
+}
+
+
+/*
+ * Unlike model_set_ballast_work_hours the ballast is not marked as present
+ */
+void model_restore_ballast_work_hours(mut_model_t *pmodel, size_t ballast, uint16_t work_hours) {
+    assert(pmodel != NULL);
+    pmodel->ballast[ballast].work_hours = work_hours;
+    update_summary(pmodel, ballast);
+    mark_dirty(pmodel, MODEL_FIELD_BALLAST(ballast, MODEL_BALLAST_FIELD_WORK_HOURS));
 }
 
 
 void model_set_ballast_state(mut_model_t *pmodel, uint8_t address, uint16_t state, uint16_t alarms) {
     assert(pmodel != NULL);
-    pmodel->ballast[ballast_from_address(address)].comm_ok = 1;
-    pmodel->ballast[ballast_from_address(address)].state   = state;
-    pmodel->ballast[ballast_from_address(address)].alarms  = alarms;
-    pmodel->ballast[ballast_from_address(address)].present = BALLAST_PRESENCE_FOUND;
+    size_t ballast = ballast_from_address(address);
+
+    if (pmodel->ballast[ballast].state != state || pmodel->ballast[ballast].alarms != alarms) {
+        pmodel->ballast[ballast].state  = state;
+        pmodel->ballast[ballast].alarms = alarms;
+        update_summary(pmodel, ballast);
+        mark_dirty(pmodel, MODEL_FIELD_BALLAST(ballast, MODEL_BALLAST_FIELD_STATE));
+    }
+    set_present(pmodel, ballast);
+    // Lets the sequencer tell a fresh reading from one taken before the stage started
+    pmodel->ballast[ballast].state_updates++;
 }
 
 
 void model_set_ballast_work_hours(mut_model_t *pmodel, uint8_t address, uint16_t work_hours) {
     assert(pmodel != NULL);
-    pmodel->ballast[ballast_from_address(address)].comm_ok    = 1;
-    pmodel->ballast[ballast_from_address(address)].work_hours = work_hours;
-    pmodel->ballast[ballast_from_address(address)].present    = BALLAST_PRESENCE_FOUND;
+    size_t ballast = ballast_from_address(address);
+
+    if (pmodel->ballast[ballast].work_hours != work_hours) {
+        pmodel->ballast[ballast].work_hours = work_hours;
+        update_summary(pmodel, ballast);
+        mark_dirty(pmodel, MODEL_FIELD_BALLAST(ballast, MODEL_BALLAST_FIELD_WORK_HOURS));
+    }
+    set_present(pmodel, ballast);
 }
 
 
-uint8_t model_is_safety_ok(model_t *pmodel) {
+void model_set_sequence(mut_model_t *pmodel, ballast_sequence_t sequence, uint8_t stage, uint32_t outputs) {
     assert(pmodel != NULL);
-    for (size_t i = 0; i < MODBUS_MAX_DEVICES; i++) {
-        if ((pmodel->ballast[i].alarms & EASYCONNECT_SAFETY_ALARM) > 0) {
-            return 0;
-        }
+
+    if (pmodel->sequence != sequence || pmodel->sequence_stage != stage || pmodel->sequence_outputs != outputs) {
+        pmodel->sequence         = sequence;
+        pmodel->sequence_stage   = stage;
+        pmodel->sequence_outputs = outputs;
+        mark_dirty(pmodel, MODEL_FIELD_SEQUENCE);
     }
+}
+
+
+void model_set_safety_ok(mut_model_t *pmodel, uint8_t safety_ok) {
+    assert(pmodel != NULL);
+
+    if (pmodel->safety_ok != safety_ok) {
+        pmodel->safety_ok = safety_ok;
+        mark_dirty(pmodel, MODEL_FIELD_SAFETY);
+    }
+}
+
+
+/*
+ * Both the safety chain and the ballasts' own safety alarms
+ */
+uint8_t model_is_safety_ok(model_t *pmodel) {
+    assert(pmodel != NULL);
+    return pmodel->safety_alarm_mask == 0 && pmodel->safety_ok;
+}
+
+
+uint8_t model_get_safety_input(model_t *pmodel) {
+    assert(pmodel != NULL);
     return pmodel->safety_ok;
 }
 
 
 uint8_t model_get_working_hours_warning(model_t *pmodel) {
     assert(pmodel != NULL);
-    for (size_t i = 0; i < MODBUS_MAX_DEVICES; i++) {
-        if (pmodel->ballast[i].work_hours >= APP_CONFIG_HOURS_WARNING) {
-            return 1;
-        }
-    }
-    return 0;
+    return pmodel->hours_warning_mask != 0;
 }
 
 
 uint8_t model_get_working_hours_alarm(model_t *pmodel) {
     assert(pmodel != NULL);
-    for (size_t i = 0; i < MODBUS_MAX_DEVICES; i++) {
-        if (pmodel->ballast[i].work_hours >= APP_CONFIG_HOURS_ALARM) {
-            return 1;
-        }
-    }
-    return 0;
+    return pmodel->hours_alarm_mask != 0;
 }
 
 
 uint8_t model_ballast_should_be_on(model_t *pmodel, size_t ballast) {
+    assert(pmodel != NULL);
+    if (pmodel->sequence == BALLAST_SEQUENCE_NONE) {
+        return 0;
+    }
+    return (pmodel->sequence_outputs & (1UL << ballast)) > 0;
+}
+
+
+/*
+ * 0 while the sequence is stopped, then the 1-based number of the running stage
+ */
+uint8_t model_get_sequence_step(model_t *pmodel) {
     assert(pmodel != NULL);
     switch (pmodel->sequence) {
-        case BALLAST_SEQUENCE_1:
-            return ballast == 0;
-        case BALLAST_SEQUENCE_2:
-            return ballast <= 1;
-        case BALLAST_SEQUENCE_3:
-            return ballast <= 2;
-        case BALLAST_SEQUENCE_4:
+        case BALLAST_SEQUENCE_RUNNING:
         case BALLAST_SEQUENCE_DONE:
-            return ballast <= 3;
+            return pmodel->sequence_stage + 1;
         default:
             return 0;
     }
@@ -140,6 +253,99 @@ uint8_t model_ballast_present(model_t *pmodel, size_t ballast) {
 }
 
 
+ballast_presence_t model_get_ballast_presence(model_t *pmodel, size_t ballast) {
+    assert(pmodel != NULL);
+    return pmodel->ballast[ballast].present;
+}
+
+
+uint8_t model_is_ballast_comm_ok(model_t *pmodel, size_t ballast) {
+    assert(pmodel != NULL);
+    return (pmodel->comm_ok_mask & (1UL << ballast)) > 0;
+}
+
+
+uint8_t model_is_ballast_provisional(model_t *pmodel, size_t ballast) {
+    assert(pmodel != NULL);
+    return (pmodel->provisional_mask & (1UL << ballast)) > 0;
+}
+
+
+uint16_t model_get_ballast_class(model_t *pmodel, size_t ballast) {
+    assert(pmodel != NULL);
+    return pmodel->ballast[ballast].class;
+}
+
+
+uint16_t model_get_ballast_firmware_version(model_t *pmodel, size_t ballast) {
+    assert(pmodel != NULL);
+    return pmodel->ballast[ballast].firmware_version;
+}
+
+
+uint32_t model_get_ballast_serial_number(model_t *pmodel, size_t ballast) {
+    assert(pmodel != NULL);
+    return pmodel->ballast[ballast].serial_number;
+}
+
+
+uint16_t model_get_ballast_state(model_t *pmodel, size_t ballast) {
+    assert(pmodel != NULL);
+    return pmodel->ballast[ballast].state;
+}
+
+
+uint16_t model_get_ballast_alarms(model_t *pmodel, size_t ballast) {
+    assert(pmodel != NULL);
+    return pmodel->ballast[ballast].alarms;
+}
+
+
+uint8_t model_get_ballast_state_updates(model_t *pmodel, size_t ballast) {
+    assert(pmodel != NULL);
+    return pmodel->ballast[ballast].state_updates;
+}
+
+
+uint16_t model_get_ballast_work_hours(model_t *pmodel, size_t ballast) {
+    assert(pmodel != NULL);
+    return pmodel->ballast[ballast].work_hours;
+}
+
+
 static size_t ballast_from_address(uint8_t address) {
     return address - 1;
 }
+
+
+/*
+ * Refreshes the aggregate masks after the alarms or the work hours of a ballast changed
+ */
+static void update_summary(mut_model_t *pmodel, size_t ballast) {
+    set_bit(&pmodel->alarm_mask, ballast, pmodel->ballast[ballast].alarms > 0);
+    set_bit(&pmodel->safety_alarm_mask, ballast, (pmodel->ballast[ballast].alarms & EASYCONNECT_SAFETY_ALARM) > 0);
+    set_bit(&pmodel->hours_warning_mask, ballast, pmodel->ballast[ballast].work_hours >= APP_CONFIG_HOURS_WARNING);
+    set_bit(&pmodel->hours_alarm_mask, ballast, pmodel->ballast[ballast].work_hours >= APP_CONFIG_HOURS_ALARM);
+}
+
+
+static void set_bit(uint32_t *mask, size_t ballast, uint8_t value) {
+    if (value) {
+        *mask |= 1UL << ballast;
+    } else {
+        *mask &= ~(1UL << ballast);
+    }
+}
+
+
+static void set_present(mut_model_t *pmodel, size_t ballast) {
+    if (pmodel->ballast[ballast].present != BALLAST_PRESENCE_FOUND) {
+        pmodel->ballast[ballast].present = BALLAST_PRESENCE_FOUND;
+        mark_dirty(pmodel, MODEL_FIELD_BALLAST(ballast, MODEL_BALLAST_FIELD_COMMUNICATION));
+    }
+}
+
+
+static void mark_dirty(mut_model_t *pmodel, size_t field) {
+    pmodel->dirty[field / 32] |= 1UL << (field % 32);
+}
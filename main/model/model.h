@@ -3,17 +3,19 @@
 
 
 #include <stdlib.h>
+#include <stdint.h>
 
 
+#ifndef MODBUS_MAX_DEVICES
 #define MODBUS_MAX_DEVICES 4
+#endif
+
+_Static_assert(MODBUS_MAX_DEVICES <= 32, "Ballast masks are 32 bits wide");
 
 
 typedef enum {
     BALLAST_SEQUENCE_NONE = 0,
-    BALLAST_SEQUENCE_1,
-    BALLAST_SEQUENCE_2,
-    BALLAST_SEQUENCE_3,
-    BALLAST_SEQUENCE_4,
+    BALLAST_SEQUENCE_RUNNING,
     BALLAST_SEQUENCE_DONE,
 } ballast_sequence_t;
 
@@ -25,19 +27,54 @@ typedef enum {
 } ballast_presence_t;
 
 
+/*
+ * Every observable field has a dirty bit, set by the setters when its value actually changes.
+ * Ballast fields are numbered per ballast: MODEL_FIELD_BALLAST(ballast, field).
+ */
+typedef enum {
+    MODEL_BALLAST_FIELD_COMMUNICATION = 0,     // comm_ok, presence
+    MODEL_BALLAST_FIELD_STATE,                 // state, alarms, class
+    MODEL_BALLAST_FIELD_WORK_HOURS,
+    MODEL_BALLAST_FIELD_NUM,
+} model_ballast_field_t;
+
+#define MODEL_FIELD_BALLAST(ballast, field) ((ballast) * MODEL_BALLAST_FIELD_NUM + (field))
+#define MODEL_FIELD_SEQUENCE                (MODBUS_MAX_DEVICES * MODEL_BALLAST_FIELD_NUM)
+#define MODEL_FIELD_SAFETY                  (MODEL_FIELD_SEQUENCE + 1)
+#define MODEL_FIELD_NUM                     (MODEL_FIELD_SAFETY + 1)
+#define MODEL_DIRTY_WORDS                   ((MODEL_FIELD_NUM + 31) / 32)
+
+
+/*
+ * Per-device data is packed so that the whole device fits 16 bytes; flags and aggregates live in bitmasks with one
+ * bit per ballast, kept up to date by the setters.
+ */
 typedef struct {
     struct {
-        uint8_t present;
-        uint8_t comm_ok;
+        uint32_t serial_number;
         uint16_t class;
+        uint16_t firmware_version;
         uint16_t alarms;
         uint16_t state;
         uint16_t work_hours;
+        uint8_t  present : 2;     // ballast_presence_t
+        uint8_t  state_updates;
     } ballast[MODBUS_MAX_DEVICES];
 
+    uint32_t comm_ok_mask;
+    uint32_t provisional_mask;
+    uint32_t alarm_mask;
+    uint32_t safety_alarm_mask;
+    uint32_t hours_warning_mask;
+    uint32_t hours_alarm_mask;
+
     ballast_sequence_t sequence;
+    uint8_t            sequence_stage;
+    uint32_t           sequence_outputs;
     unsigned long      sequence_ts;
     uint8_t            safety_ok;
+
+    uint32_t dirty[MODEL_DIRTY_WORDS];
 } mut_model_t;
 
 typedef const mut_model_t model_t;
@@ -51,10 +88,31 @@ uint8_t model_get_working_hours_warning(model_t *pmodel);
 uint8_t model_get_working_hours_alarm(model_t *pmodel);
 uint8_t model_is_ballast_configured_correctly(model_t *pmodel, size_t ballast);
 void    model_set_ballast_class(mut_model_t *pmodel, uint8_t address, uint16_t class);
+void    model_set_ballast_info(mut_model_t *pmodel, uint8_t address, uint16_t class, uint16_t firmware_version,
+                               uint32_t serial_number);
+void    model_restore_ballast(mut_model_t *pmodel, size_t ballast, ballast_presence_t present, uint16_t class,
+                              uint16_t firmware_version, uint32_t serial_number, uint16_t work_hours);
+void    model_restore_ballast_work_hours(mut_model_t *pmodel, size_t ballast, uint16_t work_hours);
 uint8_t model_are_all_ballast_working(model_t *pmodel);
 uint8_t model_is_safety_ok(model_t *pmodel);
 uint8_t model_ballast_should_be_on(model_t *pmodel, size_t ballast);
 uint8_t model_ballast_present(model_t *pmodel, size_t ballast);
+uint8_t model_get_sequence_step(model_t *pmodel);
+void    model_set_sequence(mut_model_t *pmodel, ballast_sequence_t sequence, uint8_t stage, uint32_t outputs);
+void    model_set_safety_ok(mut_model_t *pmodel, uint8_t safety_ok);
+void    model_mark_all_dirty(mut_model_t *pmodel);
+uint8_t model_get_safety_input(model_t *pmodel);
+
+ballast_presence_t model_get_ballast_presence(model_t *pmodel, size_t ballast);
+uint8_t            model_is_ballast_comm_ok(model_t *pmodel, size_t ballast);
+uint8_t            model_is_ballast_provisional(model_t *pmodel, size_t ballast);
+uint16_t           model_get_ballast_class(model_t *pmodel, size_t ballast);
+uint16_t           model_get_ballast_firmware_version(model_t *pmodel, size_t ballast);
+uint32_t           model_get_ballast_serial_number(model_t *pmodel, size_t ballast);
+uint16_t           model_get_ballast_state(model_t *pmodel, size_t ballast);
+uint16_t           model_get_ballast_alarms(model_t *pmodel, size_t ballast);
+uint8_t            model_get_ballast_state_updates(model_t *pmodel, size_t ballast);
+uint16_t           model_get_ballast_work_hours(model_t *pmodel, size_t ballast);
 
 
 #endif
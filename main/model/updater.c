@@ -1,50 +1,117 @@
 #include <assert.h>
 #include "updater.h"
 #include "model.h"
+#include "config/app_config.h"
 #include "services/system_time.h"
 
 
-static const unsigned long SEQUENCE_PERIOD_MS = 1000;
+/*
+ * Soft start: the ballasts are switched on APP_CONFIG_SEQUENCE_STAGE_SIZE at a time, in address order, and each
+ * stage waits until they report the on state, or for at most APP_CONFIG_SEQUENCE_STAGE_MS to limit the inrush
+ * current. Stages whose ballasts are all missing are skipped.
+ */
 
 
-void model_updater_manage(mut_model_t *pmodel) {
+#define NUM_STAGES ((MODBUS_MAX_DEVICES + APP_CONFIG_SEQUENCE_STAGE_SIZE - 1) / APP_CONFIG_SEQUENCE_STAGE_SIZE)
+
+
+static void     start_stage(mut_model_t *pmodel, uint8_t stage, uint32_t outputs);
+static uint32_t stage_ballasts(uint8_t stage);
+static uint8_t  is_stage_missing(model_t *pmodel, uint8_t stage);
+static uint8_t  is_stage_confirmed(model_t *pmodel, uint8_t stage);
+
+// Number of state readings per ballast when the current stage started
+static uint8_t stage_state_updates[MODBUS_MAX_DEVICES] = {0};
+
+
+/*
+ * Returns the time left before the current stage times out
+ */
+unsigned long model_updater_manage(mut_model_t *pmodel) {
     assert(pmodel != NULL);
 
     if (model_is_safety_ok(pmodel) && !model_get_working_hours_alarm(pmodel)) {
         switch (pmodel->sequence) {
             case BALLAST_SEQUENCE_NONE:
-                pmodel->sequence    = BALLAST_SEQUENCE_1;
-                pmodel->sequence_ts = get_millis();
+                start_stage(pmodel, 0, 0);
                 break;
 
-            case BALLAST_SEQUENCE_1:
-                if (is_expired(pmodel->sequence_ts, get_millis(), SEQUENCE_PERIOD_MS)) {
-                    pmodel->sequence    = BALLAST_SEQUENCE_2;
-                    pmodel->sequence_ts = get_millis();
-                }
-                break;
-            case BALLAST_SEQUENCE_2:
-                if (is_expired(pmodel->sequence_ts, get_millis(), SEQUENCE_PERIOD_MS)) {
-                    pmodel->sequence    = BALLAST_SEQUENCE_3;
-                    pmodel->sequence_ts = get_millis();
-                }
-                break;
-            case BALLAST_SEQUENCE_3:
-                if (is_expired(pmodel->sequence_ts, get_millis(), SEQUENCE_PERIOD_MS)) {
-                    pmodel->sequence    = BALLAST_SEQUENCE_4;
-                    pmodel->sequence_ts = get_millis();
-                }
-                break;
-            case BALLAST_SEQUENCE_4:
-                if (is_expired(pmodel->sequence_ts, get_millis(), SEQUENCE_PERIOD_MS)) {
-                    pmodel->sequence    = BALLAST_SEQUENCE_DONE;
-                    pmodel->sequence_ts = get_millis();
+            case BALLAST_SEQUENCE_RUNNING:
+                if (is_stage_confirmed(pmodel, pmodel->sequence_stage) ||
+                    is_expired(pmodel->sequence_ts, get_millis(), APP_CONFIG_SEQUENCE_STAGE_MS)) {
+                    start_stage(pmodel, pmodel->sequence_stage + 1, pmodel->sequence_outputs);
                 }
                 break;
+
             case BALLAST_SEQUENCE_DONE:
                 break;
         }
     } else {
-        pmodel->sequence = BALLAST_SEQUENCE_NONE;
+        model_set_sequence(pmodel, BALLAST_SEQUENCE_NONE, 0, 0);
+    }
+
+    if (pmodel->sequence == BALLAST_SEQUENCE_RUNNING) {
+        return time_remaining(pmodel->sequence_ts, get_millis(), APP_CONFIG_SEQUENCE_STAGE_MS);
+    } else {
+        return DEADLINE_NONE;
+    }
+}
+
+
+static void start_stage(mut_model_t *pmodel, uint8_t stage, uint32_t outputs) {
+    // Missing ballasts are still enabled, so they turn on if they come back
+    while (stage < NUM_STAGES && is_stage_missing(pmodel, stage)) {
+        outputs |= stage_ballasts(stage);
+        stage++;
+    }
+
+    if (stage >= NUM_STAGES) {
+        model_set_sequence(pmodel, BALLAST_SEQUENCE_DONE, NUM_STAGES, outputs);
+    } else {
+        model_set_sequence(pmodel, BALLAST_SEQUENCE_RUNNING, stage, outputs | stage_ballasts(stage));
+
+        for (size_t i = 0; i < MODBUS_MAX_DEVICES; i++) {
+            stage_state_updates[i] = model_get_ballast_state_updates(pmodel, i);
+        }
+    }
+
+    pmodel->sequence_ts = get_millis();
+}
+
+
+static uint32_t stage_ballasts(uint8_t stage) {
+    uint32_t ballasts = 0;
+    size_t   first    = (size_t)stage * APP_CONFIG_SEQUENCE_STAGE_SIZE;
+    for (size_t i = first; i < first + APP_CONFIG_SEQUENCE_STAGE_SIZE && i < MODBUS_MAX_DEVICES; i++) {
+        ballasts |= 1UL << i;
+    }
+    return ballasts;
+}
+
+
+static uint8_t is_stage_missing(model_t *pmodel, uint8_t stage) {
+    uint32_t ballasts = stage_ballasts(stage);
+    for (size_t i = 0; i < MODBUS_MAX_DEVICES; i++) {
+        if ((ballasts & (1UL << i)) && model_ballast_present(pmodel, i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * Every present ballast of the stage reported the on state after the stage started
+ */
+static uint8_t is_stage_confirmed(model_t *pmodel, uint8_t stage) {
+    uint32_t ballasts = stage_ballasts(stage);
+    for (size_t i = 0; i < MODBUS_MAX_DEVICES; i++) {
+        if ((ballasts & (1UL << i)) && model_ballast_present(pmodel, i)) {
+            if (model_get_ballast_state_updates(pmodel, i) == stage_state_updates[i] ||
+                model_get_ballast_state(pmodel, i) == 0) {
+                return 0;
+            }
+        }
     }
+    return 1;
 }
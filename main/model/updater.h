@@ -5,7 +5,7 @@
 #include "model/model.h"
 
 
-void model_updater_manage(mut_model_t *pmodel);
+unsigned long model_updater_manage(mut_model_t *pmodel);
 
 
 #endif
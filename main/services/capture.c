@@ -0,0 +1,270 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdatomic.h>
+#include "config/app_config.h"
+#include "capture.h"
+
+#if APP_CONFIG_CAPTURE
+
+#include "services/trace.h"
+#include "services/record_store.h"
+#include "services/system_time.h"
+#include "esp_log.h"
+
+
+/*
+ * Frames are appended to a byte ring as a header followed by the data. The ring is written only by the Modbus task
+ * and consumed only by the main loop, so neither side ever waits: when it is full the frame is dropped and the next
+ * one is flagged. The transaction path only pays for two copies.
+ *
+ * Without spill slots the main loop keeps some room in the ring by discarding the oldest frames. With spill slots
+ * it moves the ring, in chunks of CHUNK_DATA bytes, to a ring of APP_CONFIG_CAPTURE_SPILL_SLOTS records that the
+ * storage task writes to flash later; frames straddle chunks, every chunk tells where its first frame starts.
+ *
+ * Dumps list the spilled chunks, oldest first, then the bytes still in RAM; tools/capture2pcap.py rebuilds the
+ * frames.
+ */
+
+
+#define CAPTURE_MASK      (APP_CONFIG_CAPTURE_BUFFER - 1)
+#define CAPTURE_HEADROOM  (APP_CONFIG_CAPTURE_BUFFER / 4)
+#define CAPTURE_PERIOD_MS 50
+#define SPILL_BURST       4     // Chunks per pass at most, so that a backlog does not stall the main loop
+#define CHUNK_DATA        72
+#define CHUNK_NO_FRAME    0xFF
+#define CHUNK_KEY_FORMAT  "CAP%u"
+#define BYTES_PER_LINE    (CHUNK_DATA / 2)
+
+_Static_assert((APP_CONFIG_CAPTURE_BUFFER & CAPTURE_MASK) == 0, "The capture ring size must be a power of two");
+
+
+typedef struct __attribute__((packed)) {
+    uint32_t sequence;
+    uint8_t  first;     // Offset of the first frame starting in this chunk, CHUNK_NO_FRAME if none does
+    uint8_t  data[CHUNK_DATA];
+} chunk_t;
+
+
+static void copy_in(uint32_t offset, const void *data, size_t len);
+static void copy_out(uint32_t offset, void *data, size_t len);
+static void skip_frames(uint32_t limit);
+static void dump_bytes(const uint8_t *data, size_t len, const char *prefix);
+#if APP_CONFIG_CAPTURE_SPILL_SLOTS > 0
+static void spill(void);
+static void dump_chunks(void);
+static void key_for_slot(char *key, size_t len, uint32_t sequence);
+#endif
+
+
+static const char          *TAG                             = "Capture";
+static uint8_t              ring[APP_CONFIG_CAPTURE_BUFFER] = {0};
+static atomic_uint_fast32_t head                            = 0;     // Written by the Modbus task
+static atomic_uint_fast32_t tail                            = 0;     // Written by the main loop
+static atomic_uint_fast32_t dropped                         = 0;
+static uint32_t             boundary                        = 0;     // Start of the oldest frame not before tail
+
+#if APP_CONFIG_CAPTURE_SPILL_SLOTS > 0
+static const record_type_t capture_chunk = {
+    .version    = 1,
+    .size       = sizeof(chunk_t),
+    .migrations = NULL,
+};
+
+static uint32_t sequence = 0;     // Of the next spilled chunk
+#endif
+
+
+void capture_init(void) {
+#if APP_CONFIG_CAPTURE_SPILL_SLOTS > 0
+    // Continue the sequence of the previous run, so that its chunks are overwritten oldest first
+    uint8_t found = 0;
+    for (uint32_t i = 0; i < APP_CONFIG_CAPTURE_SPILL_SLOTS; i++) {
+        char key[16];
+        key_for_slot(key, sizeof(key), i);
+
+        chunk_t chunk = {0};
+        if (record_store_load(&capture_chunk, key, &chunk) == 0 &&
+            (!found || (int32_t)(chunk.sequence + 1 - sequence) > 0)) {
+            sequence = chunk.sequence + 1;
+            found    = 1;
+        }
+    }
+#endif
+
+    ESP_LOGI(TAG, "Capturing RS485 frames, %i bytes in RAM, %i chunks in flash", APP_CONFIG_CAPTURE_BUFFER,
+             APP_CONFIG_CAPTURE_SPILL_SLOTS);
+}
+
+
+/*
+ * Only to be called by the Modbus task; never blocks
+ */
+void capture_frame(capture_direction_t direction, const uint8_t *data, size_t len) {
+    static uint8_t flags = CAPTURE_FLAG_BOOT;
+
+    uint32_t start = atomic_load_explicit(&head, memory_order_relaxed);
+    uint32_t used  = start - atomic_load_explicit(&tail, memory_order_acquire);
+
+    if (used + sizeof(capture_header_t) + len > APP_CONFIG_CAPTURE_BUFFER) {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        flags |= CAPTURE_FLAG_DROPPED;
+        return;
+    }
+
+    capture_header_t header = {
+        .timestamp = trace_timestamp(),
+        .len       = len,
+        .direction = direction,
+        .flags     = flags,
+    };
+    copy_in(start, &header, sizeof(header));
+    copy_in(start + sizeof(header), data, len);
+    atomic_store_explicit(&head, start + sizeof(header) + len, memory_order_release);
+    flags = 0;
+}
+
+
+/*
+ * Frees the ring, either spilling it or discarding the oldest frames; returns when to run again
+ */
+unsigned long capture_manage(void) {
+#if APP_CONFIG_CAPTURE_SPILL_SLOTS > 0
+    spill();
+#endif
+    skip_frames(APP_CONFIG_CAPTURE_BUFFER - CAPTURE_HEADROOM);
+    return CAPTURE_PERIOD_MS;
+}
+
+
+void capture_dump(void) {
+    uint32_t end   = atomic_load_explicit(&head, memory_order_acquire);
+    uint32_t start = atomic_load_explicit(&tail, memory_order_relaxed);
+
+    ESP_LOGI(TAG, "begin %u", (unsigned int)atomic_load(&dropped));
+#if APP_CONFIG_CAPTURE_SPILL_SLOTS > 0
+    dump_chunks();
+#endif
+
+    ESP_LOGI(TAG, "ram %u", (unsigned int)(boundary - start));
+    for (uint32_t offset = start; offset != end;) {
+        uint8_t line[BYTES_PER_LINE];
+        size_t  len = MIN(end - offset, sizeof(line));
+        copy_out(offset, line, len);
+        dump_bytes(line, len, "");
+        offset += len;
+    }
+    ESP_LOGI(TAG, "end");
+}
+
+
+static void copy_in(uint32_t offset, const void *data, size_t len) {
+    size_t index = offset & CAPTURE_MASK;
+    size_t first = MIN(len, APP_CONFIG_CAPTURE_BUFFER - index);
+    memcpy(&ring[index], data, first);
+    memcpy(ring, (const uint8_t *)data + first, len - first);
+}
+
+
+static void copy_out(uint32_t offset, void *data, size_t len) {
+    size_t index = offset & CAPTURE_MASK;
+    size_t first = MIN(len, APP_CONFIG_CAPTURE_BUFFER - index);
+    memcpy(data, &ring[index], first);
+    memcpy((uint8_t *)data + first, ring, len - first);
+}
+
+
+/*
+ * Discards the oldest frames until no more than `limit` bytes are used; a frame already partly spilled goes too
+ */
+static void skip_frames(uint32_t limit) {
+    uint32_t end = atomic_load_explicit(&head, memory_order_acquire);
+    if (end - atomic_load_explicit(&tail, memory_order_relaxed) <= limit) {
+        return;
+    }
+
+    while (end - boundary > limit) {
+        capture_header_t header;
+        copy_out(boundary, &header, sizeof(header));
+        boundary += sizeof(header) + header.len;
+        // Losing frames is expected in RAM only, not when they should have been spilled
+        if (APP_CONFIG_CAPTURE_SPILL_SLOTS > 0) {
+            atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        }
+    }
+    atomic_store_explicit(&tail, boundary, memory_order_release);
+}
+
+
+static void dump_bytes(const uint8_t *data, size_t len, const char *prefix) {
+    char line[BYTES_PER_LINE * 2 + 1];
+    for (size_t i = 0; i < len; i++) {
+        snprintf(&line[i * 2], sizeof(line) - i * 2, "%02x", data[i]);
+    }
+    line[len * 2] = '\0';
+    ESP_LOGI(TAG, "%s%s", prefix, line);
+}
+
+
+#if APP_CONFIG_CAPTURE_SPILL_SLOTS > 0
+
+static void spill(void) {
+    uint32_t end   = atomic_load_explicit(&head, memory_order_acquire);
+    uint32_t start = atomic_load_explicit(&tail, memory_order_relaxed);
+
+    for (size_t i = 0; i < SPILL_BURST && end - start >= CHUNK_DATA; i++) {
+        chunk_t chunk = {.sequence = sequence, .first = CHUNK_NO_FRAME};
+        copy_out(start, chunk.data, CHUNK_DATA);
+
+        // Every frame that starts in the chunk is complete, the head only moves past whole frames
+        if (boundary - start < CHUNK_DATA) {
+            chunk.first = boundary - start;
+        }
+        while (boundary - start < CHUNK_DATA) {
+            capture_header_t header;
+            copy_out(boundary, &header, sizeof(header));
+            boundary += sizeof(header) + header.len;
+        }
+
+        char key[16];
+        key_for_slot(key, sizeof(key), sequence);
+        record_store_save(&capture_chunk, key, &chunk);
+        sequence++;
+
+        start += CHUNK_DATA;
+        atomic_store_explicit(&tail, start, memory_order_release);
+    }
+}
+
+
+/*
+ * Oldest first; a missing chunk is reported as a gap
+ */
+static void dump_chunks(void) {
+    uint32_t oldest = sequence > APP_CONFIG_CAPTURE_SPILL_SLOTS ? sequence - APP_CONFIG_CAPTURE_SPILL_SLOTS : 0;
+
+    for (uint32_t i = oldest; i != sequence; i++) {
+        char key[16];
+        key_for_slot(key, sizeof(key), i);
+
+        chunk_t chunk = {0};
+        if (record_store_load(&capture_chunk, key, &chunk) || chunk.sequence != i) {
+            ESP_LOGI(TAG, "gap");
+            continue;
+        }
+
+        char prefix[16];
+        snprintf(prefix, sizeof(prefix), "chunk %u ", chunk.first);
+        // Two lines per chunk, the second one carries on the first
+        dump_bytes(chunk.data, BYTES_PER_LINE, prefix);
+        dump_bytes(&chunk.data[BYTES_PER_LINE], BYTES_PER_LINE, "");
+    }
+}
+
+
+static void key_for_slot(char *key, size_t len, uint32_t sequence) {
+    snprintf(key, len, CHUNK_KEY_FORMAT, (unsigned int)(sequence % APP_CONFIG_CAPTURE_SPILL_SLOTS));
+}
+
+#endif
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef CAPTURE_H_INCLUDED
+#define CAPTURE_H_INCLUDED
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "config/app_config.h"
+#include "services/system_time.h"
+
+
+typedef enum {
+    CAPTURE_DIRECTION_TX = 0,
+    CAPTURE_DIRECTION_RX,
+} capture_direction_t;
+
+
+#define CAPTURE_FLAG_BOOT    0x01     // First frame since boot
+#define CAPTURE_FLAG_DROPPED 0x02     // Frames were lost before this one, the ring was full
+
+
+/*
+ * Part of the dump format, read by tools/capture2pcap.py; the frame data follows
+ */
+typedef struct __attribute__((packed)) {
+    uint32_t timestamp;     // Microseconds, same time base as the event trace
+    uint16_t len;
+    uint8_t  direction;
+    uint8_t  flags;
+} capture_header_t;
+
+
+#if APP_CONFIG_CAPTURE
+
+void          capture_init(void);
+void          capture_frame(capture_direction_t direction, const uint8_t *data, size_t len);
+unsigned long capture_manage(void);
+void          capture_dump(void);
+
+#else
+
+static inline void capture_init(void) {}
+
+
+static inline void capture_frame(capture_direction_t direction, const uint8_t *data, size_t len) {
+    (void)direction;
+    (void)data;
+    (void)len;
+}
+
+
+static inline unsigned long capture_manage(void) {
+    return DEADLINE_NONE;
+}
+
+
+static inline void capture_dump(void) {}
+
+#endif
+
+
+#endif
@@ -0,0 +1,18 @@
+#include "crc.h"
+
+
+/*
+ * Standard reflected CRC-32 (polynomial 0xEDB88320); start from 0 and chain by passing the previous result
+ */
+uint32_t crc32(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *bytes = data;
+
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc ^= bytes[i];
+        for (size_t bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xEDB88320UL & -(crc & 1));
+        }
+    }
+    return ~crc;
+}
@@ -0,0 +1,12 @@
+#ifndef CRC_H_INCLUDED
+#define CRC_H_INCLUDED
+
+
+#include <stdint.h>
+#include <stdlib.h>
+
+
+uint32_t crc32(uint32_t crc, const void *data, size_t len);
+
+
+#endif
@@ -0,0 +1,100 @@
+#include <assert.h>
+#include <stddef.h>
+#include <string.h>
+#include "record_store.h"
+#include "crc.h"
+#include "bsp/storage.h"
+#include "esp_log.h"
+
+
+/*
+ * Every record is saved as a single blob: a header with the schema version, the payload length and a CRC,
+ * followed by the payload. Records written by an older firmware are upgraded at load time through the
+ * migrations of their type and saved back, so a schema change never loses what was stored.
+ */
+
+
+typedef struct __attribute__((packed)) {
+    uint16_t version;
+    uint16_t len;
+    uint32_t crc;
+} record_header_t;
+
+typedef struct __attribute__((packed)) {
+    record_header_t header;
+    uint8_t         data[RECORD_STORE_MAX_SIZE];
+} record_t;
+
+
+static uint32_t record_crc(const record_t *record);
+
+
+static const char *TAG = "Records";
+
+
+/*
+ * Returns 0 if a valid record was found (and upgraded if needed), -1 otherwise, leaving `data` untouched
+ */
+int record_store_load(const record_type_t *type, const char *key, void *data) {
+    assert(type->size <= RECORD_STORE_MAX_SIZE);
+
+    record_t record = {0};
+    if (storage_load_blob(&record, sizeof(record), (char *)key)) {
+        return -1;
+    }
+
+    if (record.header.version == 0) {
+        // Never saved
+        return -1;
+    } else if (record.header.len > RECORD_STORE_MAX_SIZE || record.header.crc != record_crc(&record)) {
+        ESP_LOGW(TAG, "Corrupted record %s", key);
+        return -1;
+    } else if (record.header.version > type->version) {
+        ESP_LOGW(TAG, "Record %s has version %i, newer than %i", key, record.header.version, type->version);
+        return -1;
+    }
+
+    uint8_t migrated = record.header.version < type->version;
+    while (record.header.version < type->version) {
+        size_t len = record.header.len;
+        if (type->migrations == NULL || type->migrations[record.header.version - 1](record.data, &len) ||
+            len > RECORD_STORE_MAX_SIZE) {
+            ESP_LOGW(TAG, "Unable to migrate record %s from version %i", key, record.header.version);
+            return -1;
+        }
+
+        ESP_LOGI(TAG, "Record %s migrated to version %i", key, record.header.version + 1);
+        record.header.len = len;
+        record.header.version++;
+    }
+
+    if (record.header.len != type->size) {
+        ESP_LOGW(TAG, "Record %s has size %i instead of %zu", key, record.header.len, type->size);
+        return -1;
+    }
+
+    memcpy(data, record.data, type->size);
+    if (migrated) {
+        record_store_save(type, key, data);
+    }
+    return 0;
+}
+
+
+void record_store_save(const record_type_t *type, const char *key, const void *data) {
+    assert(type->size <= RECORD_STORE_MAX_SIZE);
+
+    record_t record       = {0};
+    record.header.version = type->version;
+    record.header.len     = type->size;
+    memcpy(record.data, data, type->size);
+    record.header.crc = record_crc(&record);
+
+    storage_save_blob(&record, sizeof(record_header_t) + type->size, (char *)key);
+}
+
+
+static uint32_t record_crc(const record_t *record) {
+    uint32_t crc = crc32(0, record, offsetof(record_header_t, crc));
+    return crc32(crc, record->data, record->header.len);
+}
@@ -0,0 +1,33 @@
+#ifndef RECORD_STORE_H_INCLUDED
+#define RECORD_STORE_H_INCLUDED
+
+
+#include <stdint.h>
+#include <stdlib.h>
+
+
+// Records grow with MODBUS_MAX_DEVICES; larger builds (e.g. the simulator benchmarks) raise the limit
+#ifndef RECORD_STORE_MAX_SIZE
+#define RECORD_STORE_MAX_SIZE 80
+#endif
+
+
+/*
+ * Upgrades a record from version `n` to `n + 1` in place; `len` is the current payload size and must be
+ * updated. The buffer holds RECORD_STORE_MAX_SIZE bytes. Returns 0 on success.
+ */
+typedef int (*record_migration_t)(uint8_t *data, size_t *len);
+
+
+typedef struct {
+    uint16_t                  version;     // Current schema version, starting from 1
+    size_t                    size;
+    const record_migration_t *migrations;  // migrations[n - 1] upgrades version n
+} record_type_t;
+
+
+int  record_store_load(const record_type_t *type, const char *key, void *data);
+void record_store_save(const record_type_t *type, const char *key, const void *data);
+
+
+#endif
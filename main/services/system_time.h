@@ -15,4 +15,19 @@ static inline __attribute__((always_inline)) uint8_t is_expired(unsigned long st
 
 #define get_millis() (xTaskGetTickCount() * portTICK_PERIOD_MS)
 
+// Returned by the periodic routines when they have nothing scheduled
+#define DEADLINE_NONE ((unsigned long)-1)
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+static inline __attribute__((always_inline)) unsigned long time_remaining(unsigned long start, unsigned long current,
+                                                                          unsigned long delay) {
+    return is_expired(start, current, delay) ? 0 : start + delay - current;
+}
+
 #endif
@@ -0,0 +1,90 @@
+#include <stdio.h>
+#include <stdatomic.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "config/app_config.h"
+#include "services/system_time.h"
+#include "esp_log.h"
+#include "trace.h"
+
+#ifndef PC_SIMULATOR
+#include "esp_timer.h"
+#endif
+
+
+/*
+ * Lock free ring of fixed size records, safe from any task or interrupt: a writer reserves its slot with a single
+ * atomic increment and fills it. The oldest records are overwritten; a dump taken while the ring is busy may show
+ * a torn record at its start.
+ *
+ * Dumps are log lines with the records in hex, oldest first, between "begin" and "end" markers.
+ */
+
+
+#define TRACE_MASK         (APP_CONFIG_TRACE_RECORDS - 1)
+#define RECORDS_PER_LINE   4
+
+_Static_assert((APP_CONFIG_TRACE_RECORDS & TRACE_MASK) == 0, "The trace ring size must be a power of two");
+
+
+static const char          *TAG                               = "Trace";
+static trace_record_t       records[APP_CONFIG_TRACE_RECORDS] = {0};
+static atomic_uint_fast32_t next                              = 0;
+
+
+void trace_record(trace_event_t event, uint16_t arg) {
+    uint32_t        index  = atomic_fetch_add_explicit(&next, 1, memory_order_relaxed);
+    trace_record_t *record = &records[index & TRACE_MASK];
+
+    record->timestamp = trace_timestamp();
+    record->event     = event;
+    record->arg       = arg;
+}
+
+
+/*
+ * Copies the last `max` records at most, oldest first; returns how many
+ */
+size_t trace_snapshot(trace_record_t *buffer, size_t max) {
+    uint32_t end   = atomic_load(&next);
+    size_t   count = MIN(MIN(end, APP_CONFIG_TRACE_RECORDS), max);
+
+    for (size_t i = 0; i < count; i++) {
+        buffer[i] = records[(end - count + i) & TRACE_MASK];
+    }
+    return count;
+}
+
+
+void trace_dump(void) {
+    uint32_t end   = atomic_load(&next);
+    size_t   count = MIN(end, APP_CONFIG_TRACE_RECORDS);
+    char     line[RECORDS_PER_LINE * sizeof(trace_record_t) * 2 + 1];
+
+    ESP_LOGI(TAG, "begin %zu", count);
+    for (size_t i = 0; i < count; i += RECORDS_PER_LINE) {
+        size_t len = 0;
+        for (size_t j = i; j < count && j < i + RECORDS_PER_LINE; j++) {
+            trace_record_t record = records[(end - count + j) & TRACE_MASK];
+            const uint8_t *bytes  = (const uint8_t *)&record;
+            for (size_t k = 0; k < sizeof(record); k++) {
+                len += snprintf(&line[len], sizeof(line) - len, "%02x", bytes[k]);
+            }
+        }
+        ESP_LOGI(TAG, "%s", line);
+    }
+    ESP_LOGI(TAG, "end");
+}
+
+
+/*
+ * Microseconds, shared with the other recorders so that their timelines line up
+ */
+uint32_t trace_timestamp(void) {
+#ifdef PC_SIMULATOR
+    // Follows the tick, so that the trace matches the virtual time of the simulation
+    return (uint32_t)(xTaskGetTickCount() * portTICK_PERIOD_MS * 1000UL);
+#else
+    return (uint32_t)esp_timer_get_time();
+#endif
+}
@@ -0,0 +1,49 @@
+#ifndef TRACE_H_INCLUDED
+#define TRACE_H_INCLUDED
+
+
+#include <stdint.h>
+#include <stdlib.h>
+
+
+#define TRACE_ARG(high, low) ((uint16_t)((((high)&0xFF) << 8) | ((low)&0xFF)))
+
+
+/*
+ * Event ids are part of the dump format: append new ones at the end. tools/trace2chrome.py reads the names from
+ * this enum.
+ */
+typedef enum {
+    TRACE_EVENT_MODBUS_ENQUEUE = 0,         // Message code, address
+    TRACE_EVENT_MODBUS_DROP,                // Message code, address; the queue was full
+    TRACE_EVENT_MODBUS_DEQUEUE,             // Message code, address
+    TRACE_EVENT_MODBUS_SEND,                // Function code, address
+    TRACE_EVENT_MODBUS_ANSWER,              // Function code, address
+    TRACE_EVENT_MODBUS_BAD_ANSWER,          // Function code, address
+    TRACE_EVENT_MODBUS_TIMEOUT,             // Function code, address
+    TRACE_EVENT_MODBUS_RESPONSE,            // Response code, address; handed to the controller
+    TRACE_EVENT_WAKEUP,                     // Events that woke the main loop, 0 on timeout
+    TRACE_EVENT_CONTROLLER_BEGIN,
+    TRACE_EVENT_CONTROLLER_END,             // Milliseconds until the next pass, saturated
+    TRACE_EVENT_CONTROLLER_RESPONSE,        // Response code, address
+    TRACE_EVENT_OBSERVER_FIELD,             // Model field
+    TRACE_EVENT_SAFETY_TRIP,                // 1 from the interrupt
+    TRACE_EVENT_SAFETY_RESTORE,
+    TRACE_EVENT_NUM,
+} trace_event_t;
+
+
+typedef struct __attribute__((packed)) {
+    uint32_t timestamp;     // Microseconds, wraps around every 71 minutes
+    uint16_t event;
+    uint16_t arg;
+} trace_record_t;
+
+
+void     trace_record(trace_event_t event, uint16_t arg);
+size_t   trace_snapshot(trace_record_t *records, size_t max);
+void     trace_dump(void);
+uint32_t trace_timestamp(void);
+
+
+#endif
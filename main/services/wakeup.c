@@ -0,0 +1,45 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "wakeup.h"
+#include "trace.h"
+
+
+/*
+ * Lets the main loop sleep until there is something to do: events are notification bits on the task
+ * that called wakeup_init()
+ */
+
+
+static TaskHandle_t main_task = NULL;
+
+
+void wakeup_init(void) {
+    main_task = xTaskGetCurrentTaskHandle();
+}
+
+
+void wakeup_signal(uint32_t events) {
+    if (main_task != NULL) {
+        xTaskNotify(main_task, events, eSetBits);
+    }
+}
+
+
+void wakeup_signal_from_isr(uint32_t events) {
+    BaseType_t woken = pdFALSE;
+    if (main_task != NULL) {
+        xTaskNotifyFromISR(main_task, events, eSetBits, &woken);
+    }
+    portYIELD_FROM_ISR(woken);
+}
+
+
+/*
+ * Blocks until an event is signalled or `ms` milliseconds have passed; returns the events received
+ */
+uint32_t wakeup_wait(unsigned long ms) {
+    uint32_t events = 0;
+    xTaskNotifyWait(0, UINT32_MAX, &events, pdMS_TO_TICKS(ms));
+    trace_record(TRACE_EVENT_WAKEUP, (uint16_t)events);
+    return events;
+}
@@ -0,0 +1,21 @@
+#ifndef WAKEUP_H_INCLUDED
+#define WAKEUP_H_INCLUDED
+
+
+#include <stdint.h>
+
+
+typedef enum {
+    WAKEUP_EVENT_MODBUS = 0x01,
+    WAKEUP_EVENT_SAFETY = 0x02,
+    WAKEUP_EVENT_BUTTON = 0x04,
+} wakeup_event_t;
+
+
+void     wakeup_init(void);
+void     wakeup_signal(uint32_t events);
+void     wakeup_signal_from_isr(uint32_t events);
+uint32_t wakeup_wait(unsigned long ms);
+
+
+#endif
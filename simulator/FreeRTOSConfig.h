@@ -76,6 +76,15 @@ unsigned long ulGetRunTimeCounterValue( void ); /* Prototype of function that re
 void vConfigureTimerForRunTimeStats( void );	/* Prototype of function that initialises the run time counter. */
 #define configGENERATE_RUN_TIME_STATS			1
 
+/* Virtual time (see port/virtual_time.c): when every task is blocked the tick jumps to the next wake up instead of
+waiting for it.  The kernel refuses a threshold below 2 at compile time, where virtual_time_active evaluates to 0;
+in virtual time even a single idle tick has to be jumped since no timer advances the tick anymore. */
+extern int virtual_time_active;
+void virtual_time_sleep( unsigned long idle_ticks );
+#define configUSE_TICKLESS_IDLE					1
+#define configEXPECTED_IDLE_TIME_BEFORE_SLEEP	( virtual_time_active ? 1 : 2 )
+#define portSUPPRESS_TICKS_AND_SLEEP( x )		virtual_time_sleep( x )
+
 /* Co-routine related configuration options. */
 #define configUSE_CO_ROUTINES 					0
 #define configMAX_CO_ROUTINE_PRIORITIES			( 2 )
@@ -0,0 +1,454 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "esp_log.h"
+#include "cJSON.h"
+#include "config/app_config.h"
+#include "model/model.h"
+#include "controller/controller.h"
+#include "bsp/interface.h"
+#include "bsp/safety.h"
+#include "bsp/rs485.h"
+#include "bsp/storage.h"
+#include "services/wakeup.h"
+#include "services/system_time.h"
+#include "services/trace.h"
+#include "easyconnect_interface.h"
+#include "emulator/easyconnect_bus.h"
+#include "emulator/fault_injection.h"
+#include "emulator/session.h"
+#include "simulated.h"
+#include "virtual_time.h"
+#include "simulator_env.h"
+#include "samples.h"
+
+
+/*
+ * Runs the firmware against the bus emulator under a standard workload and writes the results as JSON.
+ * The workload is picked with BENCHMARK_WORKLOAD; since the controller cannot be initialized twice every
+ * workload is a separate run (`scons benchmark` goes through all of them). Faults in SIMULATOR_FAULTS are added
+ * to the ones of the workload. With SIMULATOR_VIRTUAL_TIME set the run goes as fast as the host allows and is
+ * repeatable for a given BENCHMARK_SEED. BENCHMARK_TRACE names a file for the last records of the event trace, for
+ * tools/trace2chrome.py, SIMULATOR_SESSION a file to record the session to, for simulator/replay.
+ *
+ * - State observation: a device alarm register changes, until the model shows it.
+ * - Output propagation: the model asks for a different output, until the emulated device switches.
+ * - Safety trip: the safety chain opens, until every device is off. The run fails if one takes longer than
+ *   BENCHMARK_SAFETY_TRIP_BUDGET_MS (TRIP_BUDGET_MS by default).
+ * - Sequence: the safety chain closes again, until the start sequence is done.
+ */
+
+
+#define WARMUP_MS           5000
+#define DEFAULT_DURATION_MS 60000
+#define ALARM_PERIOD_MS     250
+#define SETTLE_MS           1000
+#define MAX_SAMPLES         4096
+#define MAX_CPU_SAMPLES     65536
+#define TRIP_BUDGET_MS      100     // From the safety chain opening to the last output off, at most
+
+
+typedef struct {
+    const char   *name;
+    size_t        devices;
+    size_t        dropped;     // Devices that leave the bus when the measurement starts
+    const char   *faults;      // Fault injection specification, see fault_injection.c
+    unsigned long open_ms;     // Safety chain cycling: how long it stays open, 0 for none
+} workload_t;
+
+
+typedef enum {
+    CYCLE_RUNNING = 0,
+    CYCLE_OPEN,
+    CYCLE_STARTING,
+} cycle_phase_t;
+
+
+typedef struct {
+    uint8_t       pending;
+    uint16_t      value;
+    unsigned long ts;
+} probe_t;
+
+
+static const workload_t *find_workload(const char *name);
+static void              start_measurement(void);
+static unsigned long     stimulate(mut_model_t *pmodel, unsigned long now);
+static unsigned long     stimulate_alarms(unsigned long now);
+static unsigned long     stimulate_safety(mut_model_t *pmodel, unsigned long now);
+static void              observe(mut_model_t *pmodel, unsigned long command_ts, unsigned long now);
+static uint8_t           report(unsigned long elapsed);
+static void              write_trace(void);
+static uint16_t          alarm_bit(void);
+static unsigned long     elapsed_ns(const struct timespec *begin, const struct timespec *end);
+
+
+static const workload_t workloads[] = {
+    {.name = "polling_1", .devices = 1},
+    {.name = "polling_4", .devices = 4},
+    {.name = "polling_32", .devices = 32},
+    {.name = "sequence_start", .devices = 4, .open_ms = 2000},
+    {.name = "safety_trip", .devices = 4, .open_ms = 300},
+    {.name = "missing_devices", .devices = 4, .dropped = 2},
+    {.name = "noisy_line", .devices = 4, .faults = "corrupt=5"},
+    {.name = "degraded_line", .devices = 4, .faults = "corrupt=2,truncate=1,delay=2,exception=1,duplicate=1"},
+    // Device 2 drops off the bus for 20 s in the middle of the measurement
+    {.name = "drop_off", .devices = 4, .faults = "2:silence@25000-45000", .open_ms = 300},
+};
+
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+
+SAMPLES_DEFINE(state_samples, MAX_SAMPLES);
+SAMPLES_DEFINE(output_samples, MAX_SAMPLES);
+SAMPLES_DEFINE(trip_samples, MAX_SAMPLES);
+SAMPLES_DEFINE(sequence_samples, MAX_SAMPLES);
+SAMPLES_DEFINE(cpu_samples, MAX_CPU_SAMPLES);
+
+static const char       *TAG                               = "Benchmark";
+static const workload_t *workload                          = NULL;
+static size_t            tracked                           = 0;
+static uint8_t           measuring                         = 0;
+static probe_t           alarm_probes[MODBUS_MAX_DEVICES]  = {0};
+static probe_t           output_probes[MODBUS_MAX_DEVICES] = {0};
+static probe_t           trip_probe                        = {0};
+static size_t            next_device                       = 0;
+static unsigned long     alarm_ts                          = 0;
+static cycle_phase_t     phase                             = CYCLE_RUNNING;
+static unsigned long     phase_ts                          = 0;
+
+
+void app_main(void *arg) {
+    mut_model_t model;
+    (void)arg;
+
+    workload = find_workload(getenv("BENCHMARK_WORKLOAD"));
+    if (workload == NULL) {
+        ESP_LOGE(TAG, "Unknown workload, set BENCHMARK_WORKLOAD to one of:");
+        for (size_t i = 0; i < NUM_WORKLOADS; i++) {
+            ESP_LOGE(TAG, "  %s", workloads[i].name);
+        }
+        exit(1);
+    } else if (workload->devices > MODBUS_MAX_DEVICES) {
+        ESP_LOGE(TAG, "%s needs a build with at least %zu devices", workload->name, workload->devices);
+        exit(1);
+    }
+    tracked = workload->devices;
+
+    if (simulator_env_number("SIMULATOR_VIRTUAL_TIME", 0)) {
+        virtual_time_init();
+    }
+    if (session_record(getenv("SIMULATOR_SESSION"))) {
+        exit(1);
+    }
+
+    simulator_blank_database(".benchmark_db.json");
+
+    easyconnect_bus_config_t bus_config = {
+        .baudrate   = simulator_env_number("SIMULATOR_BAUDRATE", 0),
+        .latency_us = simulator_env_number("SIMULATOR_LATENCY_US", 1000),
+    };
+    easyconnect_bus_init(workload->devices, &bus_config);
+    fault_injection_init(simulator_env_number("BENCHMARK_SEED", 1));
+    if (fault_injection_parse(workload->faults) || fault_injection_parse(getenv("SIMULATOR_FAULTS"))) {
+        exit(1);
+    }
+
+    wakeup_init();
+    safety_init();
+    interface_init();
+    rs485_init();
+    storage_init();
+
+    model_init(&model);
+    controller_init(&model);
+
+    unsigned long duration   = simulator_env_number("BENCHMARK_DURATION_MS", DEFAULT_DURATION_MS);
+    unsigned long start_ts   = get_millis();
+    unsigned long measure_ts = 0;
+
+    ESP_LOGI(TAG, "Running %s for %lu ms", workload->name, duration);
+    for (;;) {
+        unsigned long now = get_millis();
+        if (measuring && is_expired(measure_ts, now, duration)) {
+            break;
+        } else if (!measuring && is_expired(start_ts, now, WARMUP_MS)) {
+            start_measurement();
+            measure_ts = now;
+        }
+
+        struct timespec begin, end;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &begin);
+        unsigned long next = controller_manage(&model);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+
+        if (measuring) {
+            samples_add(&cpu_samples, elapsed_ns(&begin, &end));
+        }
+
+        observe(&model, now, get_millis());
+        next = MIN(next, stimulate(&model, get_millis()));
+        if (!measuring) {
+            next = MIN(next, time_remaining(start_ts, get_millis(), WARMUP_MS));
+        }
+        wakeup_wait(next);
+    }
+
+    uint8_t within_budget = report(get_millis() - measure_ts);
+    write_trace();
+    session_close();
+    exit(within_budget ? 0 : 1);
+}
+
+
+static const workload_t *find_workload(const char *name) {
+    if (name == NULL) {
+        return NULL;
+    }
+
+    for (size_t i = 0; i < NUM_WORKLOADS; i++) {
+        if (strcmp(workloads[i].name, name) == 0) {
+            return &workloads[i];
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * The warm-up lets the device map and the start sequence settle; everything before is discarded
+ */
+static void start_measurement(void) {
+    for (size_t i = 0; i < workload->dropped; i++) {
+        easyconnect_bus_set_present(workload->devices - i, 0);
+    }
+    tracked -= workload->dropped;
+
+    easyconnect_bus_reset_stats();
+    fault_injection_reset_stats();
+    measuring = 1;
+    alarm_ts  = get_millis();
+    phase_ts  = get_millis();
+}
+
+
+/*
+ * Applies the stimuli that are due; returns the time until the next one
+ */
+static unsigned long stimulate(mut_model_t *pmodel, unsigned long now) {
+    if (!measuring) {
+        return DEADLINE_NONE;
+    } else if (workload->open_ms > 0) {
+        return stimulate_safety(pmodel, now);
+    } else {
+        return stimulate_alarms(now);
+    }
+}
+
+
+static unsigned long stimulate_alarms(unsigned long now) {
+    if (is_expired(alarm_ts, now, ALARM_PERIOD_MS)) {
+        alarm_ts = now;
+
+        size_t i    = next_device;
+        next_device = (next_device + 1) % tracked;
+
+        if (!alarm_probes[i].pending) {
+            easyconnect_device_t device;
+            easyconnect_bus_get_device(i + 1, &device);
+
+            alarm_probes[i] = (probe_t){.pending = 1, .value = device.alarms ? 0 : alarm_bit(), .ts = now};
+            easyconnect_bus_set_alarms(i + 1, alarm_probes[i].value);
+        }
+    }
+
+    return time_remaining(alarm_ts, now, ALARM_PERIOD_MS);
+}
+
+
+/*
+ * Opens the safety chain once the sequence has been done for a while, then closes it again after `open_ms`
+ */
+static unsigned long stimulate_safety(mut_model_t *pmodel, unsigned long now) {
+    switch (phase) {
+        case CYCLE_RUNNING:
+            if (pmodel->sequence != BALLAST_SEQUENCE_DONE) {
+                phase_ts = now;
+                return DEADLINE_NONE;
+            } else if (is_expired(phase_ts, now, SETTLE_MS)) {
+                trip_probe = (probe_t){.pending = 1, .ts = now};
+                safety_simulate_input(0);
+                phase    = CYCLE_OPEN;
+                phase_ts = now;
+                return workload->open_ms;
+            } else {
+                return time_remaining(phase_ts, now, SETTLE_MS);
+            }
+
+        case CYCLE_OPEN:
+            if (is_expired(phase_ts, now, workload->open_ms)) {
+                safety_simulate_input(1);
+                phase    = CYCLE_STARTING;
+                phase_ts = now;
+                return DEADLINE_NONE;
+            } else {
+                return time_remaining(phase_ts, now, workload->open_ms);
+            }
+
+        case CYCLE_STARTING:
+            if (pmodel->sequence == BALLAST_SEQUENCE_DONE) {
+                samples_add(&sequence_samples, now - phase_ts);
+                phase    = CYCLE_RUNNING;
+                phase_ts = now;
+                return SETTLE_MS;
+            }
+            return DEADLINE_NONE;
+    }
+
+    return DEADLINE_NONE;
+}
+
+
+/*
+ * Closes the probes whose effect became visible. Output changes are timed from `command_ts`, the start of the
+ * controller pass that produced them, to the moment the emulated device switched.
+ */
+static void observe(mut_model_t *pmodel, unsigned long command_ts, unsigned long now) {
+    unsigned long last_off = 0;
+    uint8_t       all_off  = 1;
+
+    for (size_t i = 0; i < tracked; i++) {
+        if (alarm_probes[i].pending && model_get_ballast_alarms(pmodel, i) == alarm_probes[i].value) {
+            alarm_probes[i].pending = 0;
+            samples_add(&state_samples, now - alarm_probes[i].ts);
+        }
+
+        easyconnect_device_t device;
+        easyconnect_bus_get_device(i + 1, &device);
+
+        uint8_t desired = model_ballast_should_be_on(pmodel, i);
+        if (desired != output_probes[i].value) {
+            output_probes[i] = (probe_t){.pending = 1, .value = desired, .ts = command_ts};
+        }
+        if (output_probes[i].pending && device.output == output_probes[i].value) {
+            output_probes[i].pending = 0;
+            if (measuring) {
+                samples_add(&output_samples, time_after_or_equal(device.output_ts, output_probes[i].ts)
+                                                 ? device.output_ts - output_probes[i].ts
+                                                 : 0);
+            }
+        }
+
+        if (device.output) {
+            all_off = 0;
+        } else if (time_after_or_equal(device.output_ts, last_off)) {
+            last_off = device.output_ts;
+        }
+    }
+
+    if (trip_probe.pending && all_off) {
+        trip_probe.pending = 0;
+        samples_add(&trip_samples, time_after_or_equal(last_off, trip_probe.ts) ? last_off - trip_probe.ts : 0);
+    }
+}
+
+
+/*
+ * Returns 0 if the safety trip went over budget
+ */
+static uint8_t report(unsigned long elapsed) {
+    easyconnect_bus_stats_t stats;
+    easyconnect_bus_get_stats(&stats);
+    fault_injection_stats_t faults;
+    fault_injection_get_stats(&faults);
+    // Requests lost on the way never reached the emulator, injected exceptions never left it
+    unsigned long requests = stats.requests + faults.injected[FAULT_SILENCE];
+    unsigned long replies  = stats.replies + faults.injected[FAULT_EXCEPTION];
+
+    easyconnect_bus_config_t bus_config;
+    easyconnect_bus_get_config(&bus_config);
+
+    double seconds = elapsed / 1000.;
+
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "firmware", APP_CONFIG_FIRMWARE_VERSION);
+    cJSON_AddStringToObject(json, "workload", workload->name);
+    cJSON_AddNumberToObject(json, "devices", workload->devices);
+    cJSON_AddNumberToObject(json, "dropped_devices", workload->dropped);
+    cJSON_AddNumberToObject(json, "max_devices", MODBUS_MAX_DEVICES);
+    cJSON_AddNumberToObject(json, "baudrate", bus_config.baudrate);
+    cJSON_AddNumberToObject(json, "latency_us", bus_config.latency_us);
+    cJSON_AddStringToObject(json, "faults", workload->faults != NULL ? workload->faults : "");
+    cJSON_AddNumberToObject(json, "duration_ms", elapsed);
+    cJSON_AddBoolToObject(json, "virtual_time", virtual_time_active);
+    cJSON_AddNumberToObject(json, "speedup", virtual_time_speedup());
+
+    cJSON *bus = cJSON_AddObjectToObject(json, "bus");
+    cJSON_AddNumberToObject(bus, "utilisation", stats.busy_us / (seconds * 1000000.));
+    cJSON_AddNumberToObject(bus, "transactions_per_s", (requests + stats.broadcasts) / seconds);
+    cJSON_AddNumberToObject(bus, "requests", requests);
+    cJSON_AddNumberToObject(bus, "broadcasts", stats.broadcasts);
+    cJSON_AddNumberToObject(bus, "replies", replies);
+    cJSON_AddNumberToObject(bus, "unanswered", requests - replies);
+    cJSON_AddNumberToObject(bus, "exceptions", stats.exceptions + faults.injected[FAULT_EXCEPTION]);
+    cJSON_AddItemToObject(bus, "faults", fault_injection_stats_to_json());
+
+    cJSON_AddItemToObject(json, "state_observation_ms", samples_to_json(&state_samples));
+    cJSON_AddItemToObject(json, "output_propagation_ms", samples_to_json(&output_samples));
+    cJSON_AddItemToObject(json, "safety_trip_ms", samples_to_json(&trip_samples));
+    unsigned long trip_budget   = simulator_env_number("BENCHMARK_SAFETY_TRIP_BUDGET_MS", TRIP_BUDGET_MS);
+    // A trip that never completed counts too
+    uint8_t       stuck         = trip_probe.pending && is_expired(trip_probe.ts, get_millis(), trip_budget);
+    uint8_t       within_budget = trip_samples.max <= trip_budget && !stuck;
+    cJSON_AddNumberToObject(json, "safety_trip_budget_ms", trip_budget);
+    cJSON_AddBoolToObject(json, "safety_trip_within_budget", within_budget);
+    cJSON_AddItemToObject(json, "sequence_ms", samples_to_json(&sequence_samples));
+    cJSON_AddItemToObject(json, "controller_cpu_ns", samples_to_json(&cpu_samples));
+
+    char default_output[64];
+    snprintf(default_output, sizeof(default_output), "benchmark_%s.json", workload->name);
+    simulator_write_json(json, "BENCHMARK_OUTPUT", default_output);
+    cJSON_Delete(json);
+
+    if (!within_budget) {
+        ESP_LOGE(TAG, "Safety trip took %lu ms, over the budget of %lu ms", trip_samples.max, trip_budget);
+    }
+    return within_budget;
+}
+
+
+static void write_trace(void) {
+    const char *output = getenv("BENCHMARK_TRACE");
+    if (output == NULL) {
+        return;
+    }
+
+    static trace_record_t records[APP_CONFIG_TRACE_RECORDS];
+    size_t                count = trace_snapshot(records, APP_CONFIG_TRACE_RECORDS);
+
+    FILE *f = fopen(output, "wb");
+    if (f == NULL) {
+        ESP_LOGE(TAG, "Could not write %s", output);
+    } else {
+        fwrite(records, sizeof(trace_record_t), count, f);
+        fclose(f);
+        ESP_LOGI(TAG, "%zu trace records written to %s", count, output);
+    }
+}
+
+
+/*
+ * Lowest alarm that does not count as a safety alarm, so the probes do not stop the sequence
+ */
+static uint16_t alarm_bit(void) {
+    uint16_t free = (uint16_t)~EASYCONNECT_SAFETY_ALARM;
+    return free & (~free + 1);
+}
+
+
+static unsigned long elapsed_ns(const struct timespec *begin, const struct timespec *end) {
+    return (end->tv_sec - begin->tv_sec) * 1000000000UL + end->tv_nsec - begin->tv_nsec;
+}
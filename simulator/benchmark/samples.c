@@ -0,0 +1,57 @@
+#include <stdlib.h>
+#include "samples.h"
+
+
+static int compare(const void *a, const void *b);
+
+
+void samples_add(samples_t *samples, unsigned long value) {
+    if (samples->stored < samples->capacity) {
+        samples->values[samples->stored++] = value;
+    }
+    samples->count++;
+    samples->sum += value;
+    if (value > samples->max) {
+        samples->max = value;
+    }
+}
+
+
+void samples_reset(samples_t *samples) {
+    samples->stored = 0;
+    samples->count  = 0;
+    samples->sum    = 0;
+    samples->max    = 0;
+}
+
+
+/*
+ * Nearest rank; reorders the stored values
+ */
+unsigned long samples_percentile(samples_t *samples, unsigned int percent) {
+    if (samples->stored == 0) {
+        return 0;
+    }
+
+    qsort(samples->values, samples->stored, sizeof(samples->values[0]), compare);
+    size_t rank = (samples->stored * percent + 99) / 100;
+    return samples->values[rank > 0 ? rank - 1 : 0];
+}
+
+
+cJSON *samples_to_json(samples_t *samples) {
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json, "count", samples->count);
+    cJSON_AddNumberToObject(json, "mean", samples->count > 0 ? (double)samples->sum / samples->count : 0);
+    cJSON_AddNumberToObject(json, "p50", samples_percentile(samples, 50));
+    cJSON_AddNumberToObject(json, "p99", samples_percentile(samples, 99));
+    cJSON_AddNumberToObject(json, "max", samples->max);
+    return json;
+}
+
+
+static int compare(const void *a, const void *b) {
+    unsigned long first  = *(const unsigned long *)a;
+    unsigned long second = *(const unsigned long *)b;
+    return (first > second) - (first < second);
+}
@@ -0,0 +1,34 @@
+#ifndef SAMPLES_H_INCLUDED
+#define SAMPLES_H_INCLUDED
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "cJSON.h"
+
+
+/*
+ * Latency samples; percentiles are computed over the first `capacity` values, count, mean and max over all of them
+ */
+typedef struct {
+    unsigned long *values;
+    size_t         capacity;
+    size_t         stored;
+    size_t         count;
+    uint64_t       sum;
+    unsigned long  max;
+} samples_t;
+
+
+#define SAMPLES_DEFINE(name, size)                                                                                     \
+    static unsigned long name##_values[size];                                                                          \
+    static samples_t     name = {.values = name##_values, .capacity = size}
+
+
+void          samples_add(samples_t *samples, unsigned long value);
+void          samples_reset(samples_t *samples);
+unsigned long samples_percentile(samples_t *samples, unsigned int percent);
+cJSON        *samples_to_json(samples_t *samples);
+
+
+#endif
@@ -0,0 +1,480 @@
+#include <string.h>
+#include <assert.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "services/system_time.h"
+#include "easyconnect_interface.h"
+#include "AUTOGEN_FILE_registers.h"
+#include "esp_log.h"
+#include "easyconnect_bus.h"
+
+
+/*
+ * In-process emulation of the EasyConnect ballasts sitting on the RS485 line: every frame the master writes is
+ * parsed as Modbus RTU and, when addressed to a present device, answered with the frame that device would send.
+ * Timing is left to the caller, which reports every frame it puts on the line with easyconnect_bus_drive.
+ */
+
+
+#define BROADCAST_ADDRESS 0
+
+#define EXCEPTION_ILLEGAL_FUNCTION     0x01
+#define EXCEPTION_ILLEGAL_DATA_ADDRESS 0x02
+#define EXCEPTION_ILLEGAL_DATA_VALUE   0x03
+
+#define COIL_OUTPUT 0
+#define COIL_BYPASS 1
+#define NUM_COILS   2
+
+#define HOUR_MS (60UL * 60UL * 1000UL)
+
+#define GET_U16(buffer) ((uint16_t)(((buffer)[0] << 8) | (buffer)[1]))
+
+
+static size_t   handle_request(easyconnect_device_t *device, const uint8_t *pdu, size_t len, uint8_t *reply,
+                               size_t max);
+static void     handle_broadcast(const uint8_t *pdu, size_t len);
+static int      read_register(easyconnect_device_t *device, uint16_t index, uint16_t *value);
+static int      write_register(easyconnect_device_t *device, uint16_t index, uint16_t value);
+static void     write_coil(easyconnect_device_t *device, uint16_t index, uint8_t value);
+static void     set_output(easyconnect_device_t *device, uint8_t value);
+static void     update_work_hours(easyconnect_device_t *device, unsigned long now);
+static size_t   exception(uint8_t *reply, uint8_t function, uint8_t code);
+static uint16_t default_class(void);
+
+
+static const char              *TAG                                  = "Bus";
+static SemaphoreHandle_t        sem                                  = NULL;
+static easyconnect_device_t     devices[EASYCONNECT_BUS_MAX_DEVICES] = {0};
+static easyconnect_bus_config_t config                               = {0};
+static easyconnect_bus_stats_t  stats                                = {0};
+
+
+void easyconnect_bus_init(size_t num_devices, const easyconnect_bus_config_t *pconfig) {
+    static StaticSemaphore_t sem_buffer;
+    sem = xSemaphoreCreateMutexStatic(&sem_buffer);
+
+    config = *pconfig;
+    if (config.baudrate == 0) {
+        config.baudrate = EASYCONNECT_BAUDRATE;
+    }
+
+    uint16_t class = default_class();
+    for (size_t i = 0; i < EASYCONNECT_BUS_MAX_DEVICES; i++) {
+        devices[i] = (easyconnect_device_t){
+            .present           = i < num_devices,
+            .follows_heartbeat = 1,
+            .firmware_version  = 0x0100,
+            .class             = class,
+            .serial_number     = 1000 + i + 1,
+            .timestamp         = get_millis(),
+        };
+    }
+
+    ESP_LOGI(TAG, "%zu devices at %lu baud, %lu us turnaround", num_devices, config.baudrate, config.latency_us);
+}
+
+
+/*
+ * Delivers a request frame to the devices; returns the length of the reply, 0 if nobody answers
+ */
+size_t easyconnect_bus_transaction(const uint8_t *request, size_t len, uint8_t *reply, size_t max) {
+    size_t res = 0;
+
+    xSemaphoreTake(sem, portMAX_DELAY);
+    // Address, function and CRC at the very least; devices silently drop anything malformed
+    if (len < 4 || easyconnect_bus_crc16(request, len) != 0) {
+        xSemaphoreGive(sem);
+        return 0;
+    }
+
+    uint8_t address = request[0];
+    if (address == BROADCAST_ADDRESS) {
+        stats.broadcasts++;
+        handle_broadcast(&request[1], len - 3);
+    } else {
+        stats.requests++;
+
+        if (address <= EASYCONNECT_BUS_MAX_DEVICES && devices[address - 1].present && max >= 5) {
+            easyconnect_device_t *device = &devices[address - 1];
+            update_work_hours(device, get_millis());
+
+            reply[0]      = address;
+            size_t length = handle_request(device, &request[1], len - 3, &reply[1], max - 3);
+            if (length > 0) {
+                uint16_t crc      = easyconnect_bus_crc16(reply, length + 1);
+                reply[length + 1] = crc & 0xFF;
+                reply[length + 2] = crc >> 8;
+                res               = length + 3;
+                stats.replies++;
+                if (reply[1] & 0x80) {
+                    stats.exceptions++;
+                }
+            }
+        }
+    }
+    xSemaphoreGive(sem);
+
+    return res;
+}
+
+
+/*
+ * Time needed to put a frame on the line, including the 3.5 characters of silence that terminate it
+ */
+unsigned long easyconnect_bus_frame_time_us(size_t len) {
+    // 8N1: ten bits per character; above 19200 baud the silent interval is fixed by the specification
+    unsigned long gap = config.baudrate > 19200 ? 1750 : (35UL * 1000000UL) / config.baudrate;
+    return (unsigned long)(((uint64_t)len * 10 * 1000000UL) / config.baudrate) + gap;
+}
+
+
+/*
+ * Accounts for a frame sent by either side; returns its wire time
+ */
+unsigned long easyconnect_bus_drive(size_t len) {
+    unsigned long us = easyconnect_bus_frame_time_us(len);
+    xSemaphoreTake(sem, portMAX_DELAY);
+    stats.busy_us += us;
+    xSemaphoreGive(sem);
+    return us;
+}
+
+
+unsigned long easyconnect_bus_latency_us(void) {
+    return config.latency_us;
+}
+
+
+/*
+ * The configuration in use, defaults applied
+ */
+void easyconnect_bus_get_config(easyconnect_bus_config_t *pconfig) {
+    *pconfig = config;
+}
+
+
+void easyconnect_bus_get_device(uint8_t address, easyconnect_device_t *device) {
+    assert(address > 0 && address <= EASYCONNECT_BUS_MAX_DEVICES);
+    xSemaphoreTake(sem, portMAX_DELAY);
+    update_work_hours(&devices[address - 1], get_millis());
+    *device = devices[address - 1];
+    xSemaphoreGive(sem);
+}
+
+
+void easyconnect_bus_set_device(uint8_t address, const easyconnect_device_t *device) {
+    assert(address > 0 && address <= EASYCONNECT_BUS_MAX_DEVICES);
+    xSemaphoreTake(sem, portMAX_DELAY);
+    devices[address - 1] = *device;
+    xSemaphoreGive(sem);
+}
+
+
+void easyconnect_bus_set_present(uint8_t address, uint8_t present) {
+    assert(address > 0 && address <= EASYCONNECT_BUS_MAX_DEVICES);
+    xSemaphoreTake(sem, portMAX_DELAY);
+    devices[address - 1].present = present;
+    xSemaphoreGive(sem);
+}
+
+
+void easyconnect_bus_set_alarms(uint8_t address, uint16_t alarms) {
+    assert(address > 0 && address <= EASYCONNECT_BUS_MAX_DEVICES);
+    xSemaphoreTake(sem, portMAX_DELAY);
+    devices[address - 1].alarms = alarms;
+    xSemaphoreGive(sem);
+}
+
+
+void easyconnect_bus_get_stats(easyconnect_bus_stats_t *pstats) {
+    xSemaphoreTake(sem, portMAX_DELAY);
+    *pstats = stats;
+    xSemaphoreGive(sem);
+}
+
+
+void easyconnect_bus_reset_stats(void) {
+    xSemaphoreTake(sem, portMAX_DELAY);
+    memset(&stats, 0, sizeof(stats));
+    xSemaphoreGive(sem);
+}
+
+
+/*
+ * Modbus CRC; running it over a frame that includes its own CRC yields 0
+ */
+uint16_t easyconnect_bus_crc16(const uint8_t *data, size_t len) {
+    uint16_t crc = 0xFFFF;
+
+    for (size_t i = 0; i < len; i++) {
+        crc ^= data[i];
+        for (size_t j = 0; j < 8; j++) {
+            crc = (crc & 1) ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+    }
+
+    return crc;
+}
+
+
+/*
+ * Builds the reply PDU (function code onwards) in `reply`; returns its length
+ */
+static size_t handle_request(easyconnect_device_t *device, const uint8_t *pdu, size_t len, uint8_t *reply,
+                             size_t max) {
+    uint8_t function = pdu[0];
+
+    switch (function) {
+        case 2: {
+            if (len != 5) {
+                return exception(reply, function, EXCEPTION_ILLEGAL_DATA_VALUE);
+            }
+            uint16_t count = GET_U16(&pdu[3]);
+            if (count == 0 || count > 8) {
+                return exception(reply, function, EXCEPTION_ILLEGAL_DATA_VALUE);
+            }
+            // No inputs are wired on the emulated devices
+            reply[0] = function;
+            reply[1] = 1;
+            reply[2] = 0;
+            return 3;
+        }
+
+        case 3: {
+            if (len != 5) {
+                return exception(reply, function, EXCEPTION_ILLEGAL_DATA_VALUE);
+            }
+            uint16_t start = GET_U16(&pdu[1]);
+            uint16_t count = GET_U16(&pdu[3]);
+            if (count == 0 || count > 125 || 2 + count * 2U > max) {
+                return exception(reply, function, EXCEPTION_ILLEGAL_DATA_VALUE);
+            }
+
+            reply[0] = function;
+            reply[1] = count * 2;
+            for (uint16_t i = 0; i < count; i++) {
+                uint16_t value = 0;
+                if (read_register(device, start + i, &value)) {
+                    return exception(reply, function, EXCEPTION_ILLEGAL_DATA_ADDRESS);
+                }
+                reply[2 + i * 2]     = value >> 8;
+                reply[2 + i * 2 + 1] = value & 0xFF;
+            }
+            return 2 + count * 2;
+        }
+
+        case 5: {
+            if (len != 5) {
+                return exception(reply, function, EXCEPTION_ILLEGAL_DATA_VALUE);
+            }
+            uint16_t index = GET_U16(&pdu[1]);
+            uint16_t value = GET_U16(&pdu[3]);
+            if (index >= NUM_COILS) {
+                return exception(reply, function, EXCEPTION_ILLEGAL_DATA_ADDRESS);
+            } else if (value != 0xFF00 && value != 0x0000) {
+                return exception(reply, function, EXCEPTION_ILLEGAL_DATA_VALUE);
+            }
+            write_coil(device, index, value == 0xFF00);
+            memcpy(reply, pdu, 5);
+            return 5;
+        }
+
+        case 6: {
+            if (len != 5) {
+                return exception(reply, function, EXCEPTION_ILLEGAL_DATA_VALUE);
+            }
+            if (write_register(device, GET_U16(&pdu[1]), GET_U16(&pdu[3]))) {
+                return exception(reply, function, EXCEPTION_ILLEGAL_DATA_ADDRESS);
+            }
+            memcpy(reply, pdu, 5);
+            return 5;
+        }
+
+        case 15: {
+            if (len < 7) {
+                return exception(reply, function, EXCEPTION_ILLEGAL_DATA_VALUE);
+            }
+            uint16_t start = GET_U16(&pdu[1]);
+            uint16_t count = GET_U16(&pdu[3]);
+            if (count == 0 || pdu[5] != (count + 7) / 8 || len != 6U + pdu[5]) {
+                return exception(reply, function, EXCEPTION_ILLEGAL_DATA_VALUE);
+            } else if (start + count > NUM_COILS) {
+                return exception(reply, function, EXCEPTION_ILLEGAL_DATA_ADDRESS);
+            }
+            for (uint16_t i = 0; i < count; i++) {
+                write_coil(device, start + i, (pdu[6 + i / 8] >> (i % 8)) & 1);
+            }
+            memcpy(reply, pdu, 5);
+            return 5;
+        }
+
+        case 16: {
+            if (len < 8) {
+                return exception(reply, function, EXCEPTION_ILLEGAL_DATA_VALUE);
+            }
+            uint16_t start = GET_U16(&pdu[1]);
+            uint16_t count = GET_U16(&pdu[3]);
+            if (count == 0 || pdu[5] != count * 2 || len != 6U + pdu[5]) {
+                return exception(reply, function, EXCEPTION_ILLEGAL_DATA_VALUE);
+            }
+            for (uint16_t i = 0; i < count; i++) {
+                if (write_register(device, start + i, GET_U16(&pdu[6 + i * 2]))) {
+                    return exception(reply, function, EXCEPTION_ILLEGAL_DATA_ADDRESS);
+                }
+            }
+            memcpy(reply, pdu, 5);
+            return 5;
+        }
+
+        default:
+            return exception(reply, function, EXCEPTION_ILLEGAL_FUNCTION);
+    }
+}
+
+
+static void handle_broadcast(const uint8_t *pdu, size_t len) {
+    unsigned long now = get_millis();
+    for (size_t i = 0; i < EASYCONNECT_BUS_MAX_DEVICES; i++) {
+        update_work_hours(&devices[i], now);
+    }
+
+    uint8_t        function = pdu[0];
+    const uint8_t *data     = &pdu[1];
+    size_t         data_len = len - 1;
+
+    if (function == 15) {
+        if (data_len < 6 || data[4] != (GET_U16(&data[2]) + 7) / 8 || data_len != 5U + data[4]) {
+            return;
+        }
+        uint16_t start = GET_U16(&data[0]);
+        uint16_t count = GET_U16(&data[2]);
+        if (start + count > NUM_COILS) {
+            return;
+        }
+        for (size_t i = 0; i < EASYCONNECT_BUS_MAX_DEVICES; i++) {
+            for (uint16_t j = 0; j < count; j++) {
+                write_coil(&devices[i], start + j, (data[5 + j / 8] >> (j % 8)) & 1);
+            }
+        }
+    } else if (function == EASYCONNECT_FUNCTION_CODE_HEARTBEAT) {
+        // An empty heartbeat only keeps the devices from timing out
+        if (data_len < 2) {
+            return;
+        }
+        for (size_t i = 0; i < EASYCONNECT_BUS_MAX_DEVICES; i++) {
+            devices[i].sequence = data[0];
+            devices[i].safety   = data[1];
+
+            if (devices[i].follows_heartbeat && 2 + i / 8 < data_len) {
+                set_output(&devices[i], (data[2 + i / 8] >> (i % 8)) & 1);
+            }
+        }
+    } else if (function == EASYCONNECT_FUNCTION_CODE_SET_CLASS_OUTPUT) {
+        if (data_len != 4) {
+            return;
+        }
+        uint16_t class = GET_U16(&data[0]);
+        for (size_t i = 0; i < EASYCONNECT_BUS_MAX_DEVICES; i++) {
+            if (devices[i].class == class) {
+                set_output(&devices[i], data[2] != 0);
+                devices[i].bypass = data[3] != 0;
+            }
+        }
+    }
+    // Network initialization and time updates need no emulated behaviour
+}
+
+
+static int read_register(easyconnect_device_t *device, uint16_t index, uint16_t *value) {
+    if (index == REGISTERS_INFO_START) {
+        *value = device->firmware_version;
+    } else if (index == REGISTERS_INFO_START + 1) {
+        *value = device->class;
+    } else if (index == REGISTERS_INFO_START + 2) {
+        *value = device->serial_number >> 16;
+    } else if (index == REGISTERS_INFO_START + 3) {
+        *value = device->serial_number & 0xFFFF;
+    } else if (index > REGISTERS_INFO_START + 3 && index < REGISTERS_INFO_START + REGISTERS_INFO_COUNT) {
+        // Reserved, read along with the information block
+        *value = 0;
+    } else if (index == EASYCONNECT_HOLDING_REGISTER_ALARMS) {
+        *value = device->alarms;
+    } else if (index == EASYCONNECT_HOLDING_REGISTER_STATE) {
+        *value = device->output;
+    } else if (index == REGISTERS_WORK_HOURS_START) {
+        *value = device->work_hours;
+    } else if (index == EASYCONNECT_HOLDING_REGISTER_LOGS_COUNTER) {
+        *value = device->logs_counter;
+    } else if (index >= EASYCONNECT_HOLDING_REGISTER_LOGS &&
+               index < EASYCONNECT_HOLDING_REGISTER_LOGS + EASYCONNECT_BUS_MAX_LOGS) {
+        *value = device->logs[index - EASYCONNECT_HOLDING_REGISTER_LOGS];
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int write_register(easyconnect_device_t *device, uint16_t index, uint16_t value) {
+    if (index == REGISTERS_WORK_HOURS_START) {
+        device->work_hours = value;
+        device->on_time    = 0;
+        return 0;
+    } else {
+        return -1;
+    }
+}
+
+
+static void write_coil(easyconnect_device_t *device, uint16_t index, uint8_t value) {
+    if (index == COIL_OUTPUT) {
+        set_output(device, value);
+    } else if (index == COIL_BYPASS) {
+        device->bypass = value;
+    }
+}
+
+
+/*
+ * Work hours are counted lazily, whenever the device is touched
+ */
+static void update_work_hours(easyconnect_device_t *device, unsigned long now) {
+    if (device->output) {
+        device->on_time += now - device->timestamp;
+        while (device->on_time >= HOUR_MS) {
+            device->on_time -= HOUR_MS;
+            device->work_hours++;
+        }
+    }
+    device->timestamp = now;
+}
+
+
+static void set_output(easyconnect_device_t *device, uint8_t value) {
+    if (device->output != value) {
+        device->output    = value;
+        device->output_ts = get_millis();
+    }
+}
+
+
+static size_t exception(uint8_t *reply, uint8_t function, uint8_t code) {
+    reply[0] = function | 0x80;
+    reply[1] = code;
+    return 2;
+}
+
+
+/*
+ * The class layout belongs to the EasyConnect interface: pick the first one it recognizes as UVC
+ */
+static uint16_t default_class(void) {
+    for (uint32_t class = 0; class <= 0xFFFF; class++) {
+        if (CLASS_GET_MODE(class) == DEVICE_MODE_UVC) {
+            return class;
+        }
+    }
+    return 0;
+}
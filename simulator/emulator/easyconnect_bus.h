@@ -0,0 +1,66 @@
+#ifndef EASYCONNECT_BUS_H_INCLUDED
+#define EASYCONNECT_BUS_H_INCLUDED
+
+
+#include <stdint.h>
+#include <stdlib.h>
+
+
+#define EASYCONNECT_BUS_MAX_DEVICES 32
+#define EASYCONNECT_BUS_MAX_LOGS    16
+
+
+typedef struct {
+    unsigned long baudrate;
+    unsigned long latency_us;     // Turnaround between the end of a request and the start of the reply
+} easyconnect_bus_config_t;
+
+
+typedef struct {
+    uint8_t       present;               // Not present devices never answer
+    uint8_t       follows_heartbeat;     // Drives its output from the heartbeat bitmap
+    uint16_t      firmware_version;
+    uint16_t      class;
+    uint32_t      serial_number;
+    uint16_t      alarms;
+    uint8_t       output;
+    uint8_t       bypass;
+    unsigned long output_ts;             // Last time the output changed
+    uint16_t      work_hours;
+    uint16_t      logs_counter;
+    uint16_t      logs[EASYCONNECT_BUS_MAX_LOGS];
+
+    // Last heartbeat seen by the device
+    uint8_t sequence;
+    uint8_t safety;
+
+    unsigned long on_time;     // Milliseconds towards the next work hour
+    unsigned long timestamp;
+} easyconnect_device_t;
+
+
+typedef struct {
+    unsigned long requests;     // Delivered to the devices
+    unsigned long broadcasts;
+    unsigned long replies;
+    unsigned long exceptions;
+    uint64_t      busy_us;      // Time the line was driven, by either side
+} easyconnect_bus_stats_t;
+
+
+void          easyconnect_bus_init(size_t num_devices, const easyconnect_bus_config_t *config);
+size_t        easyconnect_bus_transaction(const uint8_t *request, size_t len, uint8_t *reply, size_t max);
+unsigned long easyconnect_bus_frame_time_us(size_t len);
+unsigned long easyconnect_bus_drive(size_t len);
+unsigned long easyconnect_bus_latency_us(void);
+void          easyconnect_bus_get_config(easyconnect_bus_config_t *config);
+void          easyconnect_bus_get_device(uint8_t address, easyconnect_device_t *device);
+void          easyconnect_bus_set_device(uint8_t address, const easyconnect_device_t *device);
+void          easyconnect_bus_set_present(uint8_t address, uint8_t present);
+void          easyconnect_bus_set_alarms(uint8_t address, uint16_t alarms);
+void          easyconnect_bus_get_stats(easyconnect_bus_stats_t *stats);
+void          easyconnect_bus_reset_stats(void);
+uint16_t      easyconnect_bus_crc16(const uint8_t *data, size_t len);
+
+
+#endif
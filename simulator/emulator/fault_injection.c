@@ -0,0 +1,317 @@
+#include <string.h>
+#include <assert.h>
+#include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
+#include "services/system_time.h"
+#include "esp_log.h"
+#include "easyconnect_bus.h"
+#include "fault_injection.h"
+
+
+/*
+ * Degrades the emulated line. Every unicast transaction gets a plan, drawn from per-device probabilities
+ * (address 0 applies to every device without its own setting) and from time windows in which a fault is always
+ * injected. Broadcasts are never touched.
+ *
+ * Specifications, as accepted by fault_injection_parse, are comma separated entries:
+ *   [address:]kind=percent        e.g. corrupt=2, 3:silence=10
+ *   [address:]kind@from-to        milliseconds from fault_injection_init, e.g. 2:silence@20000-40000
+ *   delay_ms=N, exception_code=N
+ */
+
+
+#define DEFAULT_DELAY_MS       50
+#define DEFAULT_EXCEPTION_CODE 0x04     // Slave device failure
+
+
+typedef struct {
+    uint8_t       address;
+    fault_kind_t  kind;
+    unsigned long from_ms;
+    unsigned long to_ms;
+} schedule_t;
+
+
+static uint8_t  happens(uint8_t address, fault_kind_t kind, unsigned long elapsed);
+static int      parse_entry(char *entry);
+static int      parse_kind(const char *name, fault_kind_t *kind);
+static uint32_t random_next(void);
+
+
+static const char *const kind_names[FAULT_NUM] = {
+    [FAULT_CORRUPT]   = "corrupt",
+    [FAULT_TRUNCATE]  = "truncate",
+    [FAULT_DELAY]     = "delay",
+    [FAULT_SILENCE]   = "silence",
+    [FAULT_EXCEPTION] = "exception",
+    [FAULT_DUPLICATE] = "duplicate",
+};
+
+static const char             *TAG                                                       = "Faults";
+static SemaphoreHandle_t       sem                                                       = NULL;
+static double                  probabilities[EASYCONNECT_BUS_MAX_DEVICES + 1][FAULT_NUM] = {0};
+static schedule_t              schedules[FAULT_INJECTION_MAX_SCHEDULES]                  = {0};
+static size_t                  num_schedules                                             = 0;
+static unsigned long           delay_ms                                                  = DEFAULT_DELAY_MS;
+static uint8_t                 exception_code                                            = DEFAULT_EXCEPTION_CODE;
+static unsigned long           epoch                                                     = 0;
+static uint32_t                random_state                                              = 1;
+static fault_injection_stats_t stats                                                     = {0};
+
+
+void fault_injection_init(uint32_t seed) {
+    static StaticSemaphore_t sem_buffer;
+    sem = xSemaphoreCreateMutexStatic(&sem_buffer);
+
+    random_state = seed != 0 ? seed : 1;
+    epoch        = get_millis();
+}
+
+
+void fault_injection_set_probability(uint8_t address, fault_kind_t kind, double percent) {
+    assert(address <= EASYCONNECT_BUS_MAX_DEVICES && kind < FAULT_NUM);
+    xSemaphoreTake(sem, portMAX_DELAY);
+    probabilities[address][kind] = percent;
+    xSemaphoreGive(sem);
+}
+
+
+/*
+ * The fault is injected on every transaction with `address` between `from_ms` and `to_ms` after the start
+ */
+int fault_injection_schedule(uint8_t address, fault_kind_t kind, unsigned long from_ms, unsigned long to_ms) {
+    int res = 0;
+
+    assert(address <= EASYCONNECT_BUS_MAX_DEVICES && kind < FAULT_NUM);
+    xSemaphoreTake(sem, portMAX_DELAY);
+    if (num_schedules < FAULT_INJECTION_MAX_SCHEDULES) {
+        schedules[num_schedules++] = (schedule_t){.address = address, .kind = kind, .from_ms = from_ms, .to_ms = to_ms};
+    } else {
+        res = -1;
+    }
+    xSemaphoreGive(sem);
+
+    return res;
+}
+
+
+void fault_injection_set_delay(unsigned long ms) {
+    delay_ms = ms;
+}
+
+
+void fault_injection_set_exception(uint8_t code) {
+    exception_code = code;
+}
+
+
+int fault_injection_parse(const char *spec) {
+    if (spec == NULL) {
+        return 0;
+    }
+
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", spec);
+
+    char *saveptr = NULL;
+    for (char *entry = strtok_r(copy, ", ;", &saveptr); entry != NULL; entry = strtok_r(NULL, ", ;", &saveptr)) {
+        if (parse_entry(entry)) {
+            ESP_LOGE(TAG, "Invalid fault specification: %s", entry);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+void fault_injection_plan(uint8_t address, fault_plan_t *plan) {
+    memset(plan, 0, sizeof(*plan));
+    if (address == 0 || address > EASYCONNECT_BUS_MAX_DEVICES) {
+        return;
+    }
+
+    xSemaphoreTake(sem, portMAX_DELAY);
+    unsigned long elapsed = get_millis() - epoch;
+
+    // A silent device does nothing else
+    if (happens(address, FAULT_SILENCE, elapsed)) {
+        plan->silence = 1;
+        stats.injected[FAULT_SILENCE]++;
+    } else if (happens(address, FAULT_EXCEPTION, elapsed)) {
+        plan->exception = 1;
+        stats.injected[FAULT_EXCEPTION]++;
+    } else {
+        if (happens(address, FAULT_CORRUPT, elapsed)) {
+            plan->corrupt = 1;
+            stats.injected[FAULT_CORRUPT]++;
+        }
+        if (happens(address, FAULT_TRUNCATE, elapsed)) {
+            plan->truncate = 1;
+            stats.injected[FAULT_TRUNCATE]++;
+        }
+        if (happens(address, FAULT_DUPLICATE, elapsed)) {
+            plan->duplicate = 1;
+            stats.injected[FAULT_DUPLICATE]++;
+        }
+        if (happens(address, FAULT_DELAY, elapsed)) {
+            plan->delay_us = delay_ms * 1000UL;
+            stats.injected[FAULT_DELAY]++;
+        }
+    }
+    xSemaphoreGive(sem);
+}
+
+
+/*
+ * Builds the exception reply to `request`; returns its length
+ */
+size_t fault_injection_exception(const uint8_t *request, uint8_t *reply) {
+    reply[0]     = request[0];
+    reply[1]     = request[1] | 0x80;
+    reply[2]     = exception_code;
+    uint16_t crc = easyconnect_bus_crc16(reply, 3);
+    reply[3]     = crc & 0xFF;
+    reply[4]     = crc >> 8;
+    return 5;
+}
+
+
+/*
+ * Alters a reply according to the plan; returns the new length
+ */
+size_t fault_injection_apply(const fault_plan_t *plan, uint8_t *reply, size_t len, size_t max) {
+    if (len == 0) {
+        return 0;
+    }
+
+    xSemaphoreTake(sem, portMAX_DELAY);
+    if (plan->corrupt) {
+        uint32_t bit = random_next() % (len * 8);
+        reply[bit / 8] ^= 1 << (bit % 8);
+    }
+    if (plan->truncate && len > 1) {
+        len = 1 + random_next() % (len - 1);
+    }
+    if (plan->duplicate && len * 2 <= max) {
+        memcpy(&reply[len], reply, len);
+        len *= 2;
+    }
+    xSemaphoreGive(sem);
+
+    return len;
+}
+
+
+void fault_injection_get_stats(fault_injection_stats_t *pstats) {
+    xSemaphoreTake(sem, portMAX_DELAY);
+    *pstats = stats;
+    xSemaphoreGive(sem);
+}
+
+
+void fault_injection_reset_stats(void) {
+    xSemaphoreTake(sem, portMAX_DELAY);
+    memset(&stats, 0, sizeof(stats));
+    xSemaphoreGive(sem);
+}
+
+
+cJSON *fault_injection_stats_to_json(void) {
+    fault_injection_stats_t current;
+    fault_injection_get_stats(&current);
+
+    cJSON *json = cJSON_CreateObject();
+    for (size_t i = 0; i < FAULT_NUM; i++) {
+        cJSON_AddNumberToObject(json, kind_names[i], current.injected[i]);
+    }
+    return json;
+}
+
+
+const char *fault_injection_kind_name(fault_kind_t kind) {
+    return kind < FAULT_NUM ? kind_names[kind] : "unknown";
+}
+
+
+static uint8_t happens(uint8_t address, fault_kind_t kind, unsigned long elapsed) {
+    for (size_t i = 0; i < num_schedules; i++) {
+        if ((schedules[i].address == FAULT_INJECTION_ALL_DEVICES || schedules[i].address == address) &&
+            schedules[i].kind == kind && elapsed >= schedules[i].from_ms && elapsed < schedules[i].to_ms) {
+            return 1;
+        }
+    }
+
+    double percent = probabilities[address][kind] > 0 ? probabilities[address][kind]
+                                                      : probabilities[FAULT_INJECTION_ALL_DEVICES][kind];
+    return percent > 0 && (random_next() / 4294967296.) * 100. < percent;
+}
+
+
+static int parse_entry(char *entry) {
+    unsigned long value = 0;
+    if (sscanf(entry, "delay_ms=%lu", &value) == 1) {
+        fault_injection_set_delay(value);
+        return 0;
+    } else if (sscanf(entry, "exception_code=%lu", &value) == 1) {
+        fault_injection_set_exception((uint8_t)value);
+        return 0;
+    }
+
+    unsigned long address = FAULT_INJECTION_ALL_DEVICES;
+    char         *colon   = strchr(entry, ':');
+    if (colon != NULL) {
+        *colon  = '\0';
+        address = strtoul(entry, NULL, 10);
+        entry   = colon + 1;
+        if (address > EASYCONNECT_BUS_MAX_DEVICES) {
+            return -1;
+        }
+    }
+
+    char *separator = strpbrk(entry, "=@");
+    if (separator == NULL) {
+        return -1;
+    }
+    char type  = *separator;
+    *separator = '\0';
+
+    fault_kind_t kind;
+    if (parse_kind(entry, &kind)) {
+        return -1;
+    }
+
+    if (type == '=') {
+        fault_injection_set_probability(address, kind, strtod(separator + 1, NULL));
+        return 0;
+    } else {
+        unsigned long from = 0, to = 0;
+        if (sscanf(separator + 1, "%lu-%lu", &from, &to) != 2) {
+            return -1;
+        }
+        return fault_injection_schedule(address, kind, from, to);
+    }
+}
+
+
+static int parse_kind(const char *name, fault_kind_t *kind) {
+    for (size_t i = 0; i < FAULT_NUM; i++) {
+        if (strcmp(name, kind_names[i]) == 0) {
+            *kind = i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+
+/*
+ * xorshift32, so that a run can be repeated with the same seed
+ */
+static uint32_t random_next(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
@@ -0,0 +1,56 @@
+#ifndef FAULT_INJECTION_H_INCLUDED
+#define FAULT_INJECTION_H_INCLUDED
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "cJSON.h"
+
+
+#define FAULT_INJECTION_MAX_SCHEDULES 16
+#define FAULT_INJECTION_ALL_DEVICES   0
+
+
+typedef enum {
+    FAULT_CORRUPT = 0,     // A bit of the reply is flipped
+    FAULT_TRUNCATE,        // The reply loses its tail
+    FAULT_DELAY,           // The reply comes late by `delay_ms`
+    FAULT_SILENCE,         // The request never reaches the device
+    FAULT_EXCEPTION,       // The device refuses the request with `exception_code`
+    FAULT_DUPLICATE,       // The reply is sent twice
+    FAULT_NUM,
+} fault_kind_t;
+
+
+// Faults picked for a single transaction
+typedef struct {
+    uint8_t       silence;
+    uint8_t       exception;
+    uint8_t       corrupt;
+    uint8_t       truncate;
+    uint8_t       duplicate;
+    unsigned long delay_us;
+} fault_plan_t;
+
+
+typedef struct {
+    unsigned long injected[FAULT_NUM];
+} fault_injection_stats_t;
+
+
+void        fault_injection_init(uint32_t seed);
+void        fault_injection_set_probability(uint8_t address, fault_kind_t kind, double percent);
+int         fault_injection_schedule(uint8_t address, fault_kind_t kind, unsigned long from_ms, unsigned long to_ms);
+void        fault_injection_set_delay(unsigned long ms);
+void        fault_injection_set_exception(uint8_t code);
+int         fault_injection_parse(const char *spec);
+void        fault_injection_plan(uint8_t address, fault_plan_t *plan);
+size_t      fault_injection_exception(const uint8_t *request, uint8_t *reply);
+size_t      fault_injection_apply(const fault_plan_t *plan, uint8_t *reply, size_t len, size_t max);
+void        fault_injection_get_stats(fault_injection_stats_t *stats);
+void        fault_injection_reset_stats(void);
+cJSON      *fault_injection_stats_to_json(void);
+const char *fault_injection_kind_name(fault_kind_t kind);
+
+
+#endif
@@ -0,0 +1,618 @@
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "services/system_time.h"
+#include "esp_log.h"
+#include "easyconnect_bus.h"
+#include "session.h"
+
+
+/*
+ * A session is everything that reaches the firmware from the outside, in virtual time: the replies of the devices
+ * to every request, with the faults that shaped them, and the safety and button inputs. It is written as text, one
+ * event per line, with the microseconds since the start of the session:
+ *
+ *   <us> tx <hex>              request sent by the firmware
+ *   <us> rx <hex>              reply to the last request, completely received
+ *   <us> fault <kind>[,...]    faults injected into the last request
+ *   <us> safety 0|1
+ *   <us> button long
+ *
+ * On replay the recording takes the place of the devices: every request is matched to the next recorded one for the
+ * same address, function and registers, and gets its reply after the same delay. Recorded requests the firmware
+ * skips are reported as missing, requests that were never recorded as unexpected (they get the reply recorded
+ * nearest for the same registers, if any) and matched requests carrying different data as changed. The timing
+ * delta of a matched request is how much later than in the recording it was sent, counted from the first match.
+ *
+ * Field captures become sessions through tools/capture2pcap.py --session.
+ */
+
+
+#define SESSION_VERSION 1
+#define MAX_FRAME_SIZE  256
+#define MAX_LINE        (MAX_FRAME_SIZE * 4 + 64)
+#define LOOKAHEAD       64       // Recorded requests that can be skipped to find a match
+#define MAX_REPORTED    1000     // Divergences listed in the report, the others are only counted
+
+
+typedef enum {
+    DIVERGENCE_MISSING = 0,
+    DIVERGENCE_UNEXPECTED,
+    DIVERGENCE_CHANGED,
+    DIVERGENCE_NUM,
+} divergence_kind_t;
+
+
+typedef struct {
+    uint64_t ts;
+    uint64_t reply_ts;     // The reply was completely received
+    uint8_t  request[MAX_FRAME_SIZE];
+    size_t   request_len;
+    uint8_t  reply[MAX_FRAME_SIZE * 2];
+    size_t   reply_len;
+    uint8_t  faults;       // Bit mask of fault_kind_t
+    uint8_t  replayed;
+    uint64_t replayed_ts;
+} transaction_t;
+
+
+typedef struct {
+    uint64_t        ts;
+    session_input_t input;
+    uint8_t         value;
+} input_event_t;
+
+
+typedef struct {
+    divergence_kind_t kind;
+    uint64_t          ts;     // Replay time; recording time for missing requests
+    uint8_t           address;
+    uint8_t           function;
+} divergence_t;
+
+
+static uint64_t       now_us(void);
+static void           reset_clock(void);
+static void           write_frame(uint64_t ts, const char *kind, const uint8_t *data, size_t len);
+static int            parse_line(char *line);
+static size_t         parse_hex(const char *hex, uint8_t *data, size_t max);
+static void           match(const uint8_t *request, size_t len, uint64_t ts);
+static transaction_t *nearest(const uint8_t *request, size_t len);
+static uint8_t        same_registers(const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len);
+static void           diverge(divergence_kind_t kind, uint64_t ts, const uint8_t *request, size_t len);
+static void          *grow(void *array, size_t *capacity, size_t count, size_t size);
+static int            compare_deltas(const void *a, const void *b);
+
+
+static const char *const divergence_names[DIVERGENCE_NUM] = {
+    [DIVERGENCE_MISSING]    = "missing",
+    [DIVERGENCE_UNEXPECTED] = "unexpected",
+    [DIVERGENCE_CHANGED]    = "changed",
+};
+
+static const char *TAG = "Session";
+
+// Virtual clock of the session
+static TickType_t last_tick     = 0;
+static uint64_t   elapsed_ticks = 0;
+
+// Recording
+static FILE    *file             = NULL;
+static uint64_t last_request_ts  = 0;
+static size_t   last_request_len = 0;
+
+// Replay
+static uint8_t        replaying                         = 0;
+static transaction_t *transactions                      = NULL;
+static size_t         num_transactions                  = 0;
+static size_t         transactions_capacity             = 0;
+static input_event_t *inputs                            = NULL;
+static size_t         num_inputs                        = 0;
+static size_t         inputs_capacity                   = 0;
+static size_t         next_input                        = 0;
+static size_t         cursor                            = 0;
+static transaction_t *current                           = NULL;     // Answering the last request
+static divergence_t  *divergences                       = NULL;
+static size_t         num_divergences                   = 0;
+static size_t         divergences_capacity              = 0;
+static size_t         divergence_counts[DIVERGENCE_NUM] = {0};
+static uint8_t        aligned                           = 0;
+static int64_t        offset_us                         = 0;
+
+
+/*
+ * Starts recording to `path`; does nothing if it is NULL. Returns 0 on success
+ */
+int session_record(const char *path) {
+    if (path == NULL) {
+        return 0;
+    }
+
+    file = fopen(path, "w");
+    if (file == NULL) {
+        ESP_LOGE(TAG, "Could not write %s", path);
+        return -1;
+    }
+
+    // Every line is complete on disk even if the simulator is killed
+    setvbuf(file, NULL, _IOLBF, 0);
+    fprintf(file, "# easyconnect session %i\n", SESSION_VERSION);
+    reset_clock();
+
+    ESP_LOGI(TAG, "Recording to %s", path);
+    return 0;
+}
+
+
+void session_record_reply(const uint8_t *reply, size_t len, unsigned long delay_us, const fault_plan_t *plan) {
+    if (file == NULL) {
+        return;
+    }
+
+    const struct {
+        uint8_t      happened;
+        fault_kind_t kind;
+    } faults[] = {
+        {plan->silence, FAULT_SILENCE},
+        {plan->exception, FAULT_EXCEPTION},
+        {plan->corrupt, FAULT_CORRUPT},
+        {plan->truncate, FAULT_TRUNCATE},
+        {plan->duplicate, FAULT_DUPLICATE},
+        {plan->delay_us > 0, FAULT_DELAY},
+    };
+
+    char   names[96] = "";
+    size_t used      = 0;
+    for (size_t i = 0; i < sizeof(faults) / sizeof(faults[0]); i++) {
+        if (faults[i].happened) {
+            used += snprintf(&names[used], sizeof(names) - used, "%s%s", used > 0 ? "," : "",
+                             fault_injection_kind_name(faults[i].kind));
+        }
+    }
+    if (used > 0) {
+        fprintf(file, "%" PRIu64 " fault %s\n", last_request_ts, names);
+    }
+
+    if (len > 0) {
+        uint64_t ts = last_request_ts + easyconnect_bus_frame_time_us(last_request_len) + delay_us +
+                      easyconnect_bus_frame_time_us(len);
+        write_frame(ts, "rx", reply, len);
+    }
+}
+
+
+void session_record_input(session_input_t input, uint8_t value) {
+    if (file == NULL) {
+        return;
+    }
+
+    switch (input) {
+        case SESSION_INPUT_SAFETY:
+            fprintf(file, "%" PRIu64 " safety %u\n", now_us(), value);
+            break;
+        case SESSION_INPUT_LONG_PRESS:
+            fprintf(file, "%" PRIu64 " button long\n", now_us());
+            break;
+    }
+}
+
+
+void session_close(void) {
+    if (file != NULL) {
+        fclose(file);
+        file = NULL;
+    }
+}
+
+
+/*
+ * Loads a session and replaces the devices with it; returns 0 on success
+ */
+int session_load(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        ESP_LOGE(TAG, "Could not read %s", path);
+        return -1;
+    }
+
+    static char line[MAX_LINE];
+    size_t      number = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        number++;
+        if (parse_line(line)) {
+            ESP_LOGE(TAG, "%s:%zu: invalid event", path, number);
+            fclose(f);
+            return -1;
+        }
+    }
+    fclose(f);
+
+    // Inputs are written when they happen, replies when they were sent: keep the inputs in time order
+    for (size_t i = 1; i < num_inputs; i++) {
+        input_event_t event = inputs[i];
+        size_t        j     = i;
+        for (; j > 0 && inputs[j - 1].ts > event.ts; j--) {
+            inputs[j] = inputs[j - 1];
+        }
+        inputs[j] = event;
+    }
+
+    replaying = 1;
+    reset_clock();
+
+    ESP_LOGI(TAG, "Replaying %zu requests and %zu inputs from %s", num_transactions, num_inputs, path);
+    return 0;
+}
+
+
+uint8_t session_replaying(void) {
+    return replaying;
+}
+
+
+/*
+ * Called for every request the firmware sends
+ */
+void session_request(const uint8_t *request, size_t len) {
+    if (file == NULL && !replaying) {
+        return;
+    }
+
+    uint64_t ts = now_us();
+    if (file != NULL) {
+        last_request_ts  = ts;
+        last_request_len = len;
+        write_frame(ts, "tx", request, len);
+    }
+    if (replaying) {
+        match(request, len, ts);
+    }
+}
+
+
+/*
+ * Reply to the last request as recorded, 0 if there was none; `delay_us` goes from the end of the request to the
+ * start of the reply
+ */
+size_t session_reply(uint8_t *reply, size_t max, unsigned long *delay_us) {
+    if (current == NULL || current->reply_len == 0) {
+        return 0;
+    }
+
+    size_t len = MIN(current->reply_len, max);
+    memcpy(reply, current->reply, len);
+
+    uint64_t elapsed = current->reply_ts - current->ts;
+    uint64_t wire    = easyconnect_bus_frame_time_us(current->request_len) +
+                    easyconnect_bus_frame_time_us(current->reply_len);
+    *delay_us = elapsed > wire ? elapsed - wire : 0;
+    return len;
+}
+
+
+/*
+ * Returns 1 with the next input if it is due, otherwise 0 and how long until it is
+ */
+int session_take_input(session_input_t *input, uint8_t *value, unsigned long *wait_ms) {
+    if (next_input >= num_inputs) {
+        *wait_ms = DEADLINE_NONE;
+        return 0;
+    }
+
+    const input_event_t *event = &inputs[next_input];
+    uint64_t             now   = now_us();
+    if (event->ts > now) {
+        *wait_ms = (event->ts - now + 999) / 1000;
+        return 0;
+    }
+
+    *input = event->input;
+    *value = event->value;
+    next_input++;
+    return 1;
+}
+
+
+unsigned long session_duration_ms(void) {
+    uint64_t end = 0;
+    if (num_transactions > 0) {
+        end = MAX(transactions[num_transactions - 1].ts, transactions[num_transactions - 1].reply_ts);
+    }
+    if (num_inputs > 0) {
+        end = MAX(end, inputs[num_inputs - 1].ts);
+    }
+    return (unsigned long)(end / 1000);
+}
+
+
+/*
+ * Requests still waiting for the firmware count as missing. Returns how many divergences were found and the
+ * largest timing delta, in absolute value
+ */
+cJSON *session_report(size_t *total, unsigned long *max_delta_us) {
+    for (; cursor < num_transactions; cursor++) {
+        const transaction_t *transaction = &transactions[cursor];
+        diverge(DIVERGENCE_MISSING, transaction->ts, transaction->request, transaction->request_len);
+    }
+
+    int64_t      *deltas                  = malloc(sizeof(int64_t) * (num_transactions + 1));
+    size_t        replayed                = 0;
+    uint64_t      largest                 = 0;
+    unsigned long fault_counts[FAULT_NUM] = {0};
+
+    cJSON *json   = cJSON_CreateObject();
+    cJSON *events = cJSON_CreateArray();
+    for (size_t i = 0; i < num_transactions; i++) {
+        const transaction_t *transaction = &transactions[i];
+        for (size_t kind = 0; kind < FAULT_NUM; kind++) {
+            fault_counts[kind] += (transaction->faults >> kind) & 1;
+        }
+        if (!transaction->replayed) {
+            continue;
+        }
+
+        int64_t delta      = (int64_t)(transaction->replayed_ts - transaction->ts) - offset_us;
+        deltas[replayed++] = delta;
+        largest            = MAX(largest, (uint64_t)(delta < 0 ? -delta : delta));
+
+        cJSON *event = cJSON_CreateObject();
+        cJSON_AddNumberToObject(event, "recorded_us", (double)transaction->ts);
+        cJSON_AddNumberToObject(event, "address", transaction->request[0]);
+        cJSON_AddNumberToObject(event, "function", transaction->request_len > 1 ? transaction->request[1] : 0);
+        cJSON_AddNumberToObject(event, "delta_us", (double)delta);
+        cJSON_AddItemToArray(events, event);
+    }
+
+    cJSON_AddNumberToObject(json, "requests", num_transactions);
+    cJSON_AddNumberToObject(json, "inputs", num_inputs);
+    cJSON_AddNumberToObject(json, "replayed", replayed);
+    for (size_t kind = 0; kind < DIVERGENCE_NUM; kind++) {
+        cJSON_AddNumberToObject(json, divergence_names[kind], divergence_counts[kind]);
+    }
+
+    cJSON *faults = cJSON_AddObjectToObject(json, "recorded_faults");
+    for (size_t kind = 0; kind < FAULT_NUM; kind++) {
+        cJSON_AddNumberToObject(faults, fault_injection_kind_name(kind), fault_counts[kind]);
+    }
+
+    cJSON *summary = cJSON_AddObjectToObject(json, "delta_us");
+    if (replayed > 0) {
+        qsort(deltas, replayed, sizeof(deltas[0]), compare_deltas);
+        int64_t sum = 0;
+        for (size_t i = 0; i < replayed; i++) {
+            sum += deltas[i];
+        }
+        cJSON_AddNumberToObject(summary, "min", (double)deltas[0]);
+        cJSON_AddNumberToObject(summary, "p50", (double)deltas[(replayed * 50 + 99) / 100 - 1]);
+        cJSON_AddNumberToObject(summary, "p99", (double)deltas[(replayed * 99 + 99) / 100 - 1]);
+        cJSON_AddNumberToObject(summary, "max", (double)deltas[replayed - 1]);
+        cJSON_AddNumberToObject(summary, "mean", (double)sum / replayed);
+    }
+    free(deltas);
+
+    cJSON *list = cJSON_AddArrayToObject(json, "divergences");
+    for (size_t i = 0; i < num_divergences && i < MAX_REPORTED; i++) {
+        cJSON *divergence = cJSON_CreateObject();
+        cJSON_AddStringToObject(divergence, "kind", divergence_names[divergences[i].kind]);
+        cJSON_AddNumberToObject(divergence, "us", (double)divergences[i].ts);
+        cJSON_AddNumberToObject(divergence, "address", divergences[i].address);
+        cJSON_AddNumberToObject(divergence, "function", divergences[i].function);
+        cJSON_AddItemToArray(list, divergence);
+    }
+    cJSON_AddItemToObject(json, "events", events);
+
+    *total        = num_divergences;
+    *max_delta_us = (unsigned long)largest;
+    return json;
+}
+
+
+/*
+ * Virtual microseconds since the session started, at tick resolution; the tick counter may wrap
+ */
+static uint64_t now_us(void) {
+    TickType_t tick = xTaskGetTickCount();
+    elapsed_ticks += (TickType_t)(tick - last_tick);
+    last_tick = tick;
+    return elapsed_ticks * portTICK_PERIOD_MS * 1000ULL;
+}
+
+
+static void reset_clock(void) {
+    last_tick     = xTaskGetTickCount();
+    elapsed_ticks = 0;
+}
+
+
+static void write_frame(uint64_t ts, const char *kind, const uint8_t *data, size_t len) {
+    char hex[MAX_FRAME_SIZE * 4 + 1];
+    len = MIN(len, MAX_FRAME_SIZE * 2);
+    for (size_t i = 0; i < len; i++) {
+        snprintf(&hex[i * 2], 3, "%02x", data[i]);
+    }
+    hex[len * 2] = '\0';
+    fprintf(file, "%" PRIu64 " %s %s\n", ts, kind, hex);
+}
+
+
+static int parse_line(char *line) {
+    uint64_t ts       = 0;
+    char     kind[16] = {0};
+    char     rest[MAX_LINE];
+    rest[0] = '\0';
+
+    if (line[0] == '#' || line[0] == '\n' || line[0] == '\0') {
+        return 0;
+    } else if (sscanf(line, "%" SCNu64 " %15s %s", &ts, kind, rest) < 2) {
+        return -1;
+    }
+
+    transaction_t *last = num_transactions > 0 ? &transactions[num_transactions - 1] : NULL;
+
+    if (strcmp(kind, "tx") == 0) {
+        transactions = grow(transactions, &transactions_capacity, num_transactions, sizeof(transaction_t));
+        transaction_t *transaction = &transactions[num_transactions++];
+        *transaction               = (transaction_t){.ts = ts, .reply_ts = ts};
+        transaction->request_len   = parse_hex(rest, transaction->request, sizeof(transaction->request));
+    } else if (strcmp(kind, "rx") == 0 && last != NULL) {
+        // A reply read in pieces is put back together
+        last->reply_len += parse_hex(rest, &last->reply[last->reply_len], sizeof(last->reply) - last->reply_len);
+        last->reply_ts = ts;
+    } else if (strcmp(kind, "fault") == 0 && last != NULL) {
+        for (char *name = strtok(rest, ","); name != NULL; name = strtok(NULL, ",")) {
+            for (size_t i = 0; i < FAULT_NUM; i++) {
+                if (strcmp(name, fault_injection_kind_name(i)) == 0) {
+                    last->faults |= 1 << i;
+                }
+            }
+        }
+    } else if (strcmp(kind, "safety") == 0 || strcmp(kind, "button") == 0) {
+        input_event_t event = {.ts = ts};
+        if (strcmp(kind, "safety") == 0) {
+            event.input = SESSION_INPUT_SAFETY;
+            event.value = strcmp(rest, "0") != 0;
+        } else if (strcmp(rest, "long") == 0) {
+            event.input = SESSION_INPUT_LONG_PRESS;
+        } else {
+            return -1;
+        }
+
+        inputs               = grow(inputs, &inputs_capacity, num_inputs, sizeof(input_event_t));
+        inputs[num_inputs++] = event;
+    } else {
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static size_t parse_hex(const char *hex, uint8_t *data, size_t max) {
+    size_t len = 0;
+    while (len < max && sscanf(&hex[len * 2], "%2hhx", &data[len]) == 1) {
+        len++;
+    }
+    return len;
+}
+
+
+static void match(const uint8_t *request, size_t len, uint64_t ts) {
+    size_t end = MIN(cursor + LOOKAHEAD, num_transactions);
+
+    for (size_t i = cursor; i < end; i++) {
+        transaction_t *transaction = &transactions[i];
+        if (!same_registers(request, len, transaction->request, transaction->request_len)) {
+            continue;
+        }
+
+        for (; cursor < i; cursor++) {
+            diverge(DIVERGENCE_MISSING, transactions[cursor].ts, transactions[cursor].request,
+                    transactions[cursor].request_len);
+        }
+        if (len != transaction->request_len || memcmp(request, transaction->request, len) != 0) {
+            diverge(DIVERGENCE_CHANGED, ts, request, len);
+        }
+
+        if (!aligned) {
+            aligned   = 1;
+            offset_us = (int64_t)(ts - transaction->ts);
+        }
+        transaction->replayed    = 1;
+        transaction->replayed_ts = ts;
+        cursor                   = i + 1;
+        current                  = transaction;
+        return;
+    }
+
+    diverge(DIVERGENCE_UNEXPECTED, ts, request, len);
+    current = nearest(request, len);
+}
+
+
+/*
+ * Recorded request for the same registers closest to the cursor, NULL if there is none
+ */
+static transaction_t *nearest(const uint8_t *request, size_t len) {
+    for (size_t distance = 0; cursor + distance < num_transactions || distance <= cursor; distance++) {
+        if (cursor + distance < num_transactions) {
+            transaction_t *transaction = &transactions[cursor + distance];
+            if (same_registers(request, len, transaction->request, transaction->request_len)) {
+                return transaction;
+            }
+        }
+        if (distance > 0 && distance <= cursor) {
+            transaction_t *transaction = &transactions[cursor - distance];
+            if (same_registers(request, len, transaction->request, transaction->request_len)) {
+                return transaction;
+            }
+        }
+    }
+    return NULL;
+}
+
+
+/*
+ * Address and function; for the standard functions also the first register, and the count where there is one
+ */
+static uint8_t same_registers(const uint8_t *a, size_t a_len, const uint8_t *b, size_t b_len) {
+    size_t key = 2;
+    if (a_len >= 2) {
+        switch (a[1]) {
+            case 1:
+            case 2:
+            case 3:
+            case 4:
+            case 15:
+            case 16:
+                key = 6;
+                break;
+            case 5:
+            case 6:
+                key = 4;
+                break;
+            default:
+                break;
+        }
+    }
+
+    return a_len >= key && b_len >= key && memcmp(a, b, key) == 0;
+}
+
+
+static void diverge(divergence_kind_t kind, uint64_t ts, const uint8_t *request, size_t len) {
+    divergence_counts[kind]++;
+    divergences = grow(divergences, &divergences_capacity, num_divergences, sizeof(divergence_t));
+    divergences[num_divergences++] = (divergence_t){
+        .kind     = kind,
+        .ts       = ts,
+        .address  = len > 0 ? request[0] : 0,
+        .function = len > 1 ? request[1] : 0,
+    };
+}
+
+
+/*
+ * Makes room for one more element
+ */
+static void *grow(void *array, size_t *capacity, size_t count, size_t size) {
+    if (count < *capacity) {
+        return array;
+    }
+
+    *capacity = *capacity > 0 ? *capacity * 2 : 64;
+    array     = realloc(array, *capacity * size);
+    if (array == NULL) {
+        ESP_LOGE(TAG, "Out of memory");
+        exit(1);
+    }
+    return array;
+}
+
+
+static int compare_deltas(const void *a, const void *b) {
+    int64_t x = *(const int64_t *)a;
+    int64_t y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,35 @@
+#ifndef SESSION_H_INCLUDED
+#define SESSION_H_INCLUDED
+
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "cJSON.h"
+#include "fault_injection.h"
+
+
+typedef enum {
+    SESSION_INPUT_SAFETY = 0,     // Value: 1 closed, 0 open
+    SESSION_INPUT_LONG_PRESS,
+} session_input_t;
+
+
+// Recording
+int  session_record(const char *path);
+void session_record_reply(const uint8_t *reply, size_t len, unsigned long delay_us, const fault_plan_t *plan);
+void session_record_input(session_input_t input, uint8_t value);
+void session_close(void);
+
+// Replay
+int           session_load(const char *path);
+uint8_t       session_replaying(void);
+size_t        session_reply(uint8_t *reply, size_t max, unsigned long *delay_us);
+int           session_take_input(session_input_t *input, uint8_t *value, unsigned long *wait_ms);
+unsigned long session_duration_ms(void);
+cJSON        *session_report(size_t *divergences, unsigned long *max_delta_us);
+
+// Both
+void session_request(const uint8_t *request, size_t len);
+
+
+#endif
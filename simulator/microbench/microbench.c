@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+#include <time.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "esp_log.h"
+#include "cJSON.h"
+#include "config/app_config.h"
+#include "model/model.h"
+#include "model/updater.h"
+#include "controller/controller.h"
+#include "controller/observer.h"
+#include "bsp/interface.h"
+#include "bsp/safety.h"
+#include "bsp/storage.h"
+#include "services/wakeup.h"
+#include "services/system_time.h"
+#include "benchmark/samples.h"
+#include "stubs.h"
+#include "simulator_env.h"
+
+
+/*
+ * Times the functions that run on every pass of the main loop, linked against stub Modbus and interface back ends,
+ * for every device count the build allows and a few change rates. Each function has a budget on the 99th
+ * percentile of a single call, overridden with MICROBENCH_BUDGET_<FUNCTION>_NS; the run fails if any is exceeded.
+ *
+ * - controller_manage: every pass gets the state reading of one device, as if the poll just came back.
+ * - model_updater_manage, observer_manage: the model changes before a pass with the given rate.
+ * - Predicates: every ballast is queried in a row, the result is the cost of one call.
+ */
+
+
+#define DEFAULT_ITERATIONS 20000
+#define MAX_SAMPLES        65536
+#define SETTLE_PASSES      (MODBUS_MAX_DEVICES * 20)
+#define PREDICATE_REPEAT   16
+#define SAFETY_TOGGLE      10     // One change in this many restarts the sequence
+
+
+typedef struct {
+    const char   *name;
+    unsigned long budget_ns;
+    void (*prepare)(mut_model_t *pmodel);     // Untimed, before every sample
+    void (*run)(mut_model_t *pmodel);
+    // Predicates are run on every ballast instead
+    uint8_t (*ballast_predicate)(model_t *pmodel, size_t ballast);
+    uint8_t (*predicate)(model_t *pmodel);
+} bench_t;
+
+
+static void          settle(mut_model_t *pmodel);
+static uint8_t       run_bench(mut_model_t *pmodel, const bench_t *bench, cJSON *results);
+static size_t        run_once(mut_model_t *pmodel, const bench_t *bench);
+static void          poll_one(mut_model_t *pmodel);
+static void          change_model(mut_model_t *pmodel);
+static void          run_controller(mut_model_t *pmodel);
+static void          run_updater(mut_model_t *pmodel);
+static unsigned long budget(const bench_t *bench);
+static unsigned long timer_overhead(void);
+static unsigned long elapsed_ns(const struct timespec *begin, const struct timespec *end);
+
+
+static const size_t       device_counts[] = {1, 4, 8, 16, 32};
+static const unsigned int change_rates[]  = {0, 10, 100};
+
+static const bench_t benches[] = {
+    {.name = "controller_manage", .budget_ns = 50000, .prepare = poll_one, .run = run_controller},
+    {.name = "model_updater_manage", .budget_ns = 5000, .prepare = change_model, .run = run_updater},
+    {.name = "observer_manage", .budget_ns = 10000, .prepare = change_model, .run = observer_manage},
+    {.name = "model_ballast_should_be_on", .budget_ns = 200, .ballast_predicate = model_ballast_should_be_on},
+    {.name              = "model_is_ballast_configured_correctly",
+     .budget_ns         = 200,
+     .ballast_predicate = model_is_ballast_configured_correctly},
+    {.name = "model_ballast_present", .budget_ns = 200, .ballast_predicate = model_ballast_present},
+    {.name = "model_is_ballast_comm_ok", .budget_ns = 200, .ballast_predicate = model_is_ballast_comm_ok},
+    {.name = "model_are_all_ballast_working", .budget_ns = 200, .predicate = model_are_all_ballast_working},
+    {.name = "model_is_safety_ok", .budget_ns = 200, .predicate = model_is_safety_ok},
+    {.name = "model_get_working_hours_alarm", .budget_ns = 200, .predicate = model_get_working_hours_alarm},
+};
+
+#define NUM_DEVICE_COUNTS (sizeof(device_counts) / sizeof(device_counts[0]))
+#define NUM_CHANGE_RATES  (sizeof(change_rates) / sizeof(change_rates[0]))
+#define NUM_BENCHES       (sizeof(benches) / sizeof(benches[0]))
+
+
+SAMPLES_DEFINE(samples, MAX_SAMPLES);
+
+static const char   *TAG         = "Microbench";
+static size_t        devices     = 0;
+static unsigned int  change_rate = 0;
+static unsigned int  credit      = 0;
+static size_t        changes     = 0;
+static uint8_t       sink        = 0;
+static unsigned long overhead_ns = 0;
+static unsigned long iterations  = DEFAULT_ITERATIONS;
+
+
+void app_main(void *arg) {
+    mut_model_t model;
+    (void)arg;
+
+    simulator_blank_database(".microbench_db.json");
+
+    wakeup_init();
+    safety_init();
+    interface_init();
+    storage_init();
+
+    model_init(&model);
+    controller_init(&model);
+
+    iterations  = simulator_env_number("MICROBENCH_ITERATIONS", DEFAULT_ITERATIONS);
+    overhead_ns = timer_overhead();
+
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddStringToObject(json, "firmware", APP_CONFIG_FIRMWARE_VERSION);
+    cJSON_AddNumberToObject(json, "max_devices", MODBUS_MAX_DEVICES);
+    cJSON_AddNumberToObject(json, "iterations", iterations);
+    cJSON_AddNumberToObject(json, "timer_overhead_ns", overhead_ns);
+    cJSON *results = cJSON_AddArrayToObject(json, "results");
+
+    size_t failures = 0;
+    for (size_t i = 0; i < NUM_DEVICE_COUNTS && device_counts[i] <= MODBUS_MAX_DEVICES; i++) {
+        for (size_t j = 0; j < NUM_CHANGE_RATES; j++) {
+            stub_modbus_set_devices(device_counts[i]);
+            stub_modbus_set_change_rate(change_rates[j]);
+            devices     = device_counts[i];
+            change_rate = change_rates[j];
+            settle(&model);
+
+            for (size_t k = 0; k < NUM_BENCHES; k++) {
+                if (!run_bench(&model, &benches[k], results)) {
+                    failures++;
+                }
+            }
+        }
+    }
+
+    cJSON_AddNumberToObject(json, "failures", failures);
+    simulator_write_json(json, "MICROBENCH_OUTPUT", "microbench.json");
+    cJSON_Delete(json);
+
+    if (failures > 0) {
+        ESP_LOGE(TAG, "%zu measurements over budget", failures);
+        exit(1);
+    }
+    exit(0);
+}
+
+
+/*
+ * Lets the link estimator and the sequence catch up with the new device count
+ */
+static void settle(mut_model_t *pmodel) {
+    for (size_t i = 0; i < SETTLE_PASSES; i++) {
+        poll_one(pmodel);
+        controller_manage(pmodel);
+    }
+}
+
+
+/*
+ * Returns 0 if the budget was exceeded
+ */
+static uint8_t run_bench(mut_model_t *pmodel, const bench_t *bench, cJSON *results) {
+    samples_reset(&samples);
+
+    for (unsigned long i = 0; i < iterations; i++) {
+        if (bench->prepare != NULL) {
+            bench->prepare(pmodel);
+        }
+
+        struct timespec begin, end;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &begin);
+        size_t calls = run_once(pmodel, bench);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+
+        unsigned long ns = elapsed_ns(&begin, &end);
+        samples_add(&samples, (ns > overhead_ns ? ns - overhead_ns : 0) / calls);
+    }
+
+    unsigned long limit  = budget(bench);
+    unsigned long p99    = samples_percentile(&samples, 99);
+    uint8_t       passed = p99 <= limit;
+
+    cJSON *result = cJSON_CreateObject();
+    cJSON_AddStringToObject(result, "function", bench->name);
+    cJSON_AddNumberToObject(result, "devices", devices);
+    cJSON_AddNumberToObject(result, "change_rate", change_rate);
+    cJSON_AddItemToObject(result, "ns_per_call", samples_to_json(&samples));
+    cJSON_AddNumberToObject(result, "budget_ns", limit);
+    cJSON_AddBoolToObject(result, "passed", passed);
+    cJSON_AddItemToArray(results, result);
+
+    if (passed) {
+        ESP_LOGI(TAG, "%-40s %2zu devices %3u%% changes: p99 %6lu ns", bench->name, devices, change_rate, p99);
+    } else {
+        ESP_LOGE(TAG, "%-40s %2zu devices %3u%% changes: p99 %6lu ns, over the budget of %lu ns", bench->name,
+                 devices, change_rate, p99, limit);
+    }
+    return passed;
+}
+
+
+/*
+ * Returns how many calls were made
+ */
+static size_t run_once(mut_model_t *pmodel, const bench_t *bench) {
+    if (bench->run != NULL) {
+        bench->run(pmodel);
+        return 1;
+    }
+
+    for (size_t i = 0; i < PREDICATE_REPEAT; i++) {
+        for (size_t ballast = 0; ballast < MODBUS_MAX_DEVICES; ballast++) {
+            sink ^= bench->ballast_predicate != NULL ? bench->ballast_predicate(pmodel, ballast)
+                                                     : bench->predicate(pmodel);
+        }
+    }
+    return PREDICATE_REPEAT * MODBUS_MAX_DEVICES;
+}
+
+
+static void poll_one(mut_model_t *pmodel) {
+    (void)pmodel;
+    stub_modbus_poll();
+}
+
+
+/*
+ * Changes the model on `change_rate` percent of the calls: the alarms of a present ballast, sometimes the safety
+ * chain
+ */
+static void change_model(mut_model_t *pmodel) {
+    credit += change_rate;
+    if (credit < 100) {
+        return;
+    }
+    credit -= 100;
+
+    if (++changes % SAFETY_TOGGLE == 0) {
+        model_set_safety_ok(pmodel, !model_get_safety_input(pmodel));
+    } else {
+        size_t ballast = changes % devices;
+        model_set_ballast_state(pmodel, ballast + 1, model_get_ballast_state(pmodel, ballast),
+                                model_get_ballast_alarms(pmodel, ballast) ^ stub_modbus_change_bit());
+    }
+}
+
+
+static void run_controller(mut_model_t *pmodel) {
+    controller_manage(pmodel);
+}
+
+
+static void run_updater(mut_model_t *pmodel) {
+    model_updater_manage(pmodel);
+}
+
+
+static unsigned long budget(const bench_t *bench) {
+    char name[96];
+    int  len = snprintf(name, sizeof(name), "MICROBENCH_BUDGET_%s_NS", bench->name);
+    for (int i = 0; i < len && name[i] != '\0'; i++) {
+        name[i] = toupper((unsigned char)name[i]);
+    }
+    return simulator_env_number(name, bench->budget_ns);
+}
+
+
+/*
+ * Cost of reading the clock twice, taken out of every sample
+ */
+static unsigned long timer_overhead(void) {
+    samples_reset(&samples);
+    for (size_t i = 0; i < 1000; i++) {
+        struct timespec begin, end;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &begin);
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+        samples_add(&samples, elapsed_ns(&begin, &end));
+    }
+    return samples_percentile(&samples, 50);
+}
+
+
+static unsigned long elapsed_ns(const struct timespec *begin, const struct timespec *end) {
+    return (end->tv_sec - begin->tv_sec) * 1000000000UL + end->tv_nsec - begin->tv_nsec;
+}
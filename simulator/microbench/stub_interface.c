@@ -0,0 +1,55 @@
+#include "bsp/interface.h"
+#include "services/system_time.h"
+
+
+/*
+ * No LEDs and no button: the calls cost nothing, so the measurements only see the firmware
+ */
+
+
+void interface_init(void) {}
+
+
+uint8_t interface_manage(void) {
+    return 0;
+}
+
+
+uint8_t interface_needs_polling(void) {
+    return 0;
+}
+
+
+unsigned long interface_refresh_leds(void) {
+    return DEADLINE_NONE;
+}
+
+
+void interface_set_safety(uint8_t led) {
+    (void)led;
+}
+
+
+void interface_set_led_state_off(interface_led_t led) {
+    (void)led;
+}
+
+
+void interface_set_led_state_on(interface_led_t led) {
+    (void)led;
+}
+
+
+void interface_set_led_state_blink(interface_led_t led, unsigned long millis) {
+    (void)led;
+    (void)millis;
+}
+
+
+void interface_set_warning_alarm_off(void) {}
+
+
+void interface_set_warning(void) {}
+
+
+void interface_set_alarm(void) {}
@@ -0,0 +1,250 @@
+#include <string.h>
+#include "controller/modbus.h"
+#include "easyconnect_interface.h"
+#include "services/system_time.h"
+#include "stubs.h"
+
+
+/*
+ * Answers every request on the spot by queueing the response the controller would get from the Modbus task.
+ * Devices past the configured count never answer. On each state reading a device changes its alarms with the
+ * configured probability, so that the controller has something to propagate.
+ */
+
+
+#define QUEUE_SIZE 64
+
+
+typedef struct {
+    uint8_t  output;
+    uint16_t alarms;
+    uint16_t work_hours;
+} stub_device_t;
+
+
+static void     push(const modbus_response_t *response);
+static uint8_t  is_present(uint8_t address);
+static uint32_t random_next(void);
+
+
+static stub_device_t     devices[MODBUS_MAX_DEVICES] = {0};
+static modbus_response_t queue[QUEUE_SIZE]           = {0};
+static size_t            queue_head                  = 0;
+static size_t            queue_len                   = 0;
+static size_t            num_devices                 = MODBUS_MAX_DEVICES;
+static unsigned int      change_rate                 = 0;
+static uint8_t           poll_address                = 1;
+static uint16_t          device_class                = 0;
+static uint32_t          random_state                = 1;
+
+
+void stub_modbus_set_devices(size_t devices) {
+    num_devices = MIN(devices, MODBUS_MAX_DEVICES);
+}
+
+
+void stub_modbus_set_change_rate(unsigned int percent) {
+    change_rate = percent;
+}
+
+
+/*
+ * One state reading, round robin over the whole bus like the controller does
+ */
+void stub_modbus_poll(void) {
+    modbus_read_device_state(poll_address);
+    poll_address = poll_address >= MODBUS_MAX_DEVICES ? 1 : poll_address + 1;
+}
+
+
+/*
+ * Lowest alarm that does not count as a safety alarm, which would stop the sequence
+ */
+uint16_t stub_modbus_change_bit(void) {
+    uint16_t bit = 1;
+    while (bit & EASYCONNECT_SAFETY_ALARM) {
+        bit <<= 1;
+    }
+    return bit;
+}
+
+
+void modbus_init(void) {
+    for (uint32_t class = 0; class <= 0xFFFF; class++) {
+        if (CLASS_GET_MODE(class) == DEVICE_MODE_UVC) {
+            device_class = class;
+            break;
+        }
+    }
+    memset(devices, 0, sizeof(devices));
+    queue_len = 0;
+}
+
+
+int modbus_get_response(modbus_response_t *response) {
+    if (queue_len == 0) {
+        return 0;
+    }
+
+    *response  = queue[queue_head];
+    queue_head = (queue_head + 1) % QUEUE_SIZE;
+    queue_len--;
+    return 1;
+}
+
+
+void modbus_read_device_info(uint8_t address) {
+    if (!is_present(address)) {
+        push(&(modbus_response_t){.code = MODBUS_RESPONSE_CODE_ERROR, .address = address});
+        return;
+    }
+
+    modbus_response_t response = {.code = MODBUS_RESPONSE_CODE_INFO, .address = address};
+    response.firmware_version  = 0x0100;
+    response.class             = device_class;
+    response.serial_number     = 1000 + address;
+    push(&response);
+}
+
+
+void modbus_read_device_state(uint8_t address) {
+    if (!is_present(address)) {
+        push(&(modbus_response_t){.code = MODBUS_RESPONSE_CODE_ERROR, .address = address});
+        return;
+    }
+
+    stub_device_t *device = &devices[address - 1];
+    if (change_rate > 0 && random_next() % 100 < change_rate) {
+        device->alarms ^= stub_modbus_change_bit();
+    }
+
+    modbus_response_t response = {.code = MODBUS_RESPONSE_CODE_STATE, .address = address};
+    response.state             = device->output;
+    response.alarms            = device->alarms;
+    push(&response);
+}
+
+
+void modbus_read_device_work_hours(uint8_t address) {
+    if (!is_present(address)) {
+        push(&(modbus_response_t){.code = MODBUS_RESPONSE_CODE_ERROR, .address = address});
+        return;
+    }
+
+    modbus_response_t response = {.code = MODBUS_RESPONSE_CODE_WORK_HOURS, .address = address};
+    response.work_hours        = devices[address - 1].work_hours;
+    push(&response);
+}
+
+
+void modbus_reset_device_work_hours(uint8_t address) {
+    if (is_present(address)) {
+        devices[address - 1].work_hours = 0;
+    }
+}
+
+
+void modbus_set_device_output(uint8_t address, uint8_t value, uint8_t bypass) {
+    (void)bypass;
+    if (!is_present(address)) {
+        push(&(modbus_response_t){.code = MODBUS_RESPONSE_CODE_ERROR, .address = address});
+        return;
+    }
+
+    devices[address - 1].output = value;
+    push(&(modbus_response_t){.code = MODBUS_RESPONSE_CODE_DEVICE_OK, .address = address, .output = value});
+}
+
+
+void modbus_set_heartbeat(uint8_t sequence, uint8_t safety, uint32_t outputs) {
+    (void)sequence;
+    for (size_t i = 0; i < num_devices; i++) {
+        devices[i].output = safety && (outputs & (1UL << i)) > 0;
+    }
+}
+
+
+void modbus_set_class_output(uint16_t class, uint8_t value, uint8_t bypass) {
+    (void)bypass;
+    if (class == device_class) {
+        for (size_t i = 0; i < num_devices; i++) {
+            devices[i].output = value;
+        }
+    }
+}
+
+
+void modbus_safety_trip(uint8_t from_isr) {
+    (void)from_isr;
+    for (size_t i = 0; i < num_devices; i++) {
+        devices[i].output = 0;
+    }
+}
+
+
+uint32_t modbus_safety_generation(void) {
+    return 0;
+}
+
+
+void modbus_safety_clear(uint32_t generation) {
+    (void)generation;
+}
+
+
+void modbus_read_device_messages(uint8_t address, uint8_t device_model) {
+    (void)address;
+    (void)device_model;
+}
+
+
+void modbus_read_device_inputs(uint8_t address) {
+    (void)address;
+}
+
+
+void modbus_read_device_pressure(uint8_t address) {
+    (void)address;
+}
+
+
+void modbus_set_fan_percentage(uint8_t address, uint8_t percentage) {
+    (void)address;
+    (void)percentage;
+}
+
+
+void modbus_scan(void) {}
+
+
+void modbus_stop_current_operation(void) {}
+
+
+void modbus_update_time(void) {}
+
+
+static void push(const modbus_response_t *response) {
+    // The controller drains the queue on every pass; when it does not the oldest responses are dropped
+    if (queue_len == QUEUE_SIZE) {
+        queue_head = (queue_head + 1) % QUEUE_SIZE;
+        queue_len--;
+    }
+    queue[(queue_head + queue_len) % QUEUE_SIZE] = *response;
+    queue_len++;
+}
+
+
+static uint8_t is_present(uint8_t address) {
+    return address >= 1 && address <= num_devices;
+}
+
+
+/*
+ * xorshift32, so that every run sees the same changes
+ */
+static uint32_t random_next(void) {
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return random_state;
+}
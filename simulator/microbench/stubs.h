@@ -0,0 +1,18 @@
+#ifndef STUBS_H_INCLUDED
+#define STUBS_H_INCLUDED
+
+
+#include <stdint.h>
+#include <stdlib.h>
+
+
+/*
+ * Back ends that replace the Modbus task and the interface so that the controller runs without a bus or a board
+ */
+void     stub_modbus_set_devices(size_t devices);
+void     stub_modbus_set_change_rate(unsigned int percent);
+void     stub_modbus_poll(void);
+uint16_t stub_modbus_change_bit(void);
+
+
+#endif
@@ -4,6 +4,26 @@
 #include <stdio.h>
 
 #define ESP_LOGI(tag, format, ...) printf("%s: " format "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) printf("%s: " format "\n", tag, ##__VA_ARGS__)
 #define ESP_LOGE(tag, format, ...) printf("%s: " format "\n", tag, ##__VA_ARGS__)
 
-#endif
\ No newline at end of file
+#ifdef SIMULATOR_DEBUG
+#define ESP_LOGD(tag, format, ...) printf("%s: " format "\n", tag, ##__VA_ARGS__)
+#else
+#define ESP_LOGD(tag, format, ...)                                                                                     \
+    do {                                                                                                               \
+        if (0)                                                                                                         \
+            printf("%s: " format "\n", tag, ##__VA_ARGS__);                                                           \
+    } while (0)
+#endif
+
+#define ESP_LOG_BUFFER_HEX(tag, buffer, len)                                                                          \
+    do {                                                                                                               \
+        printf("%s:", tag);                                                                                            \
+        for (size_t _i = 0; _i < (size_t)(len); _i++) {                                                               \
+            printf(" %02X", ((const unsigned char *)(buffer))[_i]);                                                    \
+        }                                                                                                              \
+        printf("\n");                                                                                                  \
+    } while (0)
+
+#endif
@@ -0,0 +1,95 @@
+#include <stdatomic.h>
+#include "bsp/interface.h"
+#include "services/system_time.h"
+#include "services/wakeup.h"
+#include "esp_log.h"
+#include "emulator/session.h"
+#include "simulated.h"
+
+
+/*
+ * LEDs are only logged when they change; the button is pressed by the simulation
+ */
+
+
+#define LED_LIFETIME_LAMP (NUM_LED_BALLAST)
+#define LED_SAFETY        (NUM_LED_BALLAST + 1)
+#define NUM_LEDS          (NUM_LED_BALLAST + 2)
+
+
+static void set_led(size_t led, const char *state);
+
+
+static const char         *TAG            = "Interface";
+static const char         *leds[NUM_LEDS] = {0};
+static atomic_uint_fast8_t long_press     = 0;
+
+
+void interface_init(void) {
+    ESP_LOGI(TAG, "Initialized");
+}
+
+
+uint8_t interface_manage(void) {
+    return atomic_exchange(&long_press, 0) != 0;
+}
+
+
+uint8_t interface_needs_polling(void) {
+    return 0;
+}
+
+
+unsigned long interface_refresh_leds(void) {
+    return DEADLINE_NONE;
+}
+
+
+void interface_set_safety(uint8_t led) {
+    set_led(LED_SAFETY, led ? "on" : "off");
+}
+
+
+void interface_set_led_state_off(interface_led_t led) {
+    set_led(led, "off");
+}
+
+
+void interface_set_led_state_on(interface_led_t led) {
+    set_led(led, "on");
+}
+
+
+void interface_set_led_state_blink(interface_led_t led, unsigned long millis) {
+    set_led(led, millis > 100 ? "blinking" : "blinking fast");
+}
+
+
+void interface_set_warning_alarm_off(void) {
+    set_led(LED_LIFETIME_LAMP, "off");
+}
+
+
+void interface_set_warning(void) {
+    set_led(LED_LIFETIME_LAMP, "blinking");
+}
+
+
+void interface_set_alarm(void) {
+    set_led(LED_LIFETIME_LAMP, "on");
+}
+
+
+void interface_simulate_long_press(void) {
+    session_record_input(SESSION_INPUT_LONG_PRESS, 0);
+    atomic_store(&long_press, 1);
+    wakeup_signal(WAKEUP_EVENT_BUTTON);
+}
+
+
+static void set_led(size_t led, const char *state) {
+    if (leds[led] != state) {
+        leds[led] = state;
+        ESP_LOGI(TAG, "LED %zu %s", led, state);
+    }
+}
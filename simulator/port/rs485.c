@@ -0,0 +1,183 @@
+#include <string.h>
+#include <limits.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "bsp/rs485.h"
+#include "services/system_time.h"
+#include "services/capture.h"
+#include "emulator/easyconnect_bus.h"
+#include "emulator/fault_injection.h"
+#include "emulator/session.h"
+
+
+/*
+ * The line is connected to the in-process device emulator, through the fault injection layer. Every frame costs
+ * its wire time at the configured baud rate and a reply also costs the device turnaround; delays shorter than a
+ * tick are carried over so that the average timing stays accurate with a 1 ms tick.
+ *
+ * When a session is replayed the recording answers in place of the emulator, with the recorded delays.
+ *
+ * Reads behave like the UART driver: they return as soon as `len` bytes are in, otherwise after the whole timeout
+ * with whatever arrived. Bytes that come late or in excess stay in the receive buffer until flushed.
+ */
+
+
+#define MAX_FRAME_SIZE 256
+
+
+// Bus time: a tick count plus the microseconds already spent within that tick
+typedef struct {
+    TickType_t    tick;
+    unsigned long us;
+} bus_time_t;
+
+
+static void       wait_us(unsigned long us);
+static bus_time_t bus_after(unsigned long us);
+static long       bus_until(bus_time_t time);
+static size_t     receive(uint8_t *buffer, size_t len, unsigned long ms);
+static size_t     take(uint8_t *buffer, size_t len);
+
+
+static uint8_t       rx_buffer[MAX_FRAME_SIZE * 2] = {0};
+static size_t        rx_len                        = 0;     // Received or on the way
+static size_t        rx_arrived                    = 0;     // Received
+static bus_time_t    rx_ready                      = {0};   // When the bytes on the way will have arrived
+static unsigned long carry_us                      = 0;
+
+
+void rs485_init(void) {
+    rx_len     = 0;
+    rx_arrived = 0;
+    carry_us   = 0;
+}
+
+
+void rs485_write(const uint8_t *data, size_t len) {
+    uint8_t       reply[MAX_FRAME_SIZE * 2];
+    size_t        reply_len = 0;
+    unsigned long delay_us  = 0;     // From the end of the request to the start of the reply
+    fault_plan_t  plan      = {0};
+
+    capture_frame(CAPTURE_DIRECTION_TX, data, len);
+    session_request(data, len);
+    wait_us(easyconnect_bus_drive(len));
+
+    if (session_replaying()) {
+        reply_len = session_reply(reply, sizeof(reply), &delay_us);
+    } else {
+        if (len > 0) {
+            fault_injection_plan(data[0], &plan);
+        }
+
+        if (plan.silence) {
+            // The device never sees the request
+        } else if (plan.exception && len >= 2) {
+            reply_len = fault_injection_exception(data, reply);
+        } else {
+            reply_len = easyconnect_bus_transaction(data, len, reply, MAX_FRAME_SIZE);
+            reply_len = fault_injection_apply(&plan, reply, reply_len, sizeof(reply));
+        }
+
+        delay_us = easyconnect_bus_latency_us() + plan.delay_us;
+        session_record_reply(reply, reply_len, delay_us, &plan);
+    }
+
+    if (reply_len > 0) {
+        // Whatever was still on the way collides with the new reply and lands with it
+        reply_len = MIN(reply_len, sizeof(rx_buffer) - rx_len);
+        memcpy(&rx_buffer[rx_len], reply, reply_len);
+        rx_len += reply_len;
+
+        unsigned long wire_us = easyconnect_bus_drive(reply_len);
+        rx_ready              = bus_after(delay_us + wire_us);
+    }
+}
+
+
+int rs485_read(uint8_t *buffer, size_t len, unsigned long ms) {
+    size_t res = receive(buffer, len, ms);
+    if (res > 0) {
+        capture_frame(CAPTURE_DIRECTION_RX, buffer, res);
+    }
+    return (int)res;
+}
+
+
+/*
+ * Drops what was received; bytes still on the way arrive afterwards, as on the real line
+ */
+void rs485_flush(void) {
+    memmove(rx_buffer, &rx_buffer[rx_arrived], rx_len - rx_arrived);
+    rx_len -= rx_arrived;
+    rx_arrived = 0;
+}
+
+
+static size_t receive(uint8_t *buffer, size_t len, unsigned long ms) {
+    long timeout_us = (long)ms * 1000L;
+    long arrival_us = LONG_MAX;
+
+    if (rx_len > rx_arrived) {
+        arrival_us = bus_until(rx_ready);
+        if (arrival_us <= 0) {
+            rx_arrived = rx_len;
+            arrival_us = LONG_MAX;
+        }
+    }
+
+    if (rx_arrived >= len) {
+        return take(buffer, len);
+    } else if (arrival_us <= timeout_us && rx_len >= len) {
+        wait_us(arrival_us);
+        rx_arrived = rx_len;
+        return take(buffer, len);
+    }
+
+    wait_us(timeout_us);
+    if (arrival_us <= timeout_us) {
+        rx_arrived = rx_len;
+    }
+    return take(buffer, MIN(len, rx_arrived));
+}
+
+
+static void wait_us(unsigned long us) {
+    const unsigned long tick_us = portTICK_PERIOD_MS * 1000UL;
+
+    carry_us += us;
+    TickType_t ticks = carry_us / tick_us;
+    carry_us %= tick_us;
+
+    if (ticks > 0) {
+        vTaskDelay(ticks);
+    }
+}
+
+
+static bus_time_t bus_after(unsigned long us) {
+    const unsigned long tick_us = portTICK_PERIOD_MS * 1000UL;
+
+    unsigned long total = carry_us + us;
+    return (bus_time_t){.tick = xTaskGetTickCount() + total / tick_us, .us = total % tick_us};
+}
+
+
+/*
+ * Microseconds until `time`, negative if it is past; safe across tick overflows
+ */
+static long bus_until(bus_time_t time) {
+    const long tick_us = portTICK_PERIOD_MS * 1000L;
+
+    int32_t ticks = (int32_t)(time.tick - xTaskGetTickCount());
+    return (long)ticks * tick_us + (long)time.us - (long)carry_us;
+}
+
+
+static size_t take(uint8_t *buffer, size_t len) {
+    memcpy(buffer, rx_buffer, len);
+    memmove(rx_buffer, &rx_buffer[len], rx_len - len);
+    rx_len -= len;
+    rx_arrived -= len;
+    return len;
+}
@@ -0,0 +1,61 @@
+#include <stdatomic.h>
+#include "bsp/safety.h"
+#include "services/wakeup.h"
+#include "services/trace.h"
+#include "esp_log.h"
+#include "emulator/session.h"
+#include "simulated.h"
+
+
+/*
+ * The safety chain starts closed; the simulation opens and closes it through safety_simulate_input
+ */
+
+
+static atomic_uint_fast8_t  safe    = 0;
+static atomic_uint_fast32_t trips   = 0;
+static safety_trip_cb_t     trip_cb = NULL;
+static const char          *TAG     = "Safety";
+
+
+void safety_init(void) {
+    atomic_store(&safe, 1);
+}
+
+
+uint8_t safety_ok(void) {
+    return atomic_load(&safe) != 0;
+}
+
+
+void safety_set_trip_callback(safety_trip_cb_t cb) {
+    trip_cb = cb;
+}
+
+
+uint32_t safety_get_trip_count(void) {
+    return atomic_load(&trips);
+}
+
+
+void safety_simulate_input(uint8_t closed) {
+    uint8_t was_safe = atomic_exchange(&safe, closed ? 1 : 0);
+    session_record_input(SESSION_INPUT_SAFETY, closed ? 1 : 0);
+
+    if (was_safe && !closed) {
+        ESP_LOGI(TAG, "Trip");
+        trace_record(TRACE_EVENT_SAFETY_TRIP, 0);
+        atomic_fetch_add(&trips, 1);
+        if (trip_cb != NULL) {
+            trip_cb(0);
+        }
+    }
+
+    if (!was_safe && closed) {
+        trace_record(TRACE_EVENT_SAFETY_RESTORE, 0);
+    }
+
+    if (was_safe != (closed ? 1 : 0)) {
+        wakeup_signal(WAKEUP_EVENT_SAFETY);
+    }
+}
@@ -0,0 +1,15 @@
+#ifndef SIMULATED_H_INCLUDED
+#define SIMULATED_H_INCLUDED
+
+
+#include <stdint.h>
+
+
+/*
+ * Inputs that the hardware would provide, driven by the simulation
+ */
+void safety_simulate_input(uint8_t closed);
+void interface_simulate_long_press(void);
+
+
+#endif
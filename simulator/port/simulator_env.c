@@ -0,0 +1,48 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "esp_log.h"
+#include "cJSON.h"
+#include "simulator_env.h"
+
+
+static const char *TAG = "SimulatorEnv";
+
+
+/*
+ * Numeric setting from the environment, in any base strtoul understands
+ */
+unsigned long simulator_env_number(const char *name, unsigned long fallback) {
+    const char *value = getenv(name);
+    return value != NULL ? strtoul(value, NULL, 0) : fallback;
+}
+
+
+/*
+ * Runs start from a blank database, `fallback` unless SIMULATOR_DATABASE says otherwise
+ */
+void simulator_blank_database(const char *fallback) {
+    setenv("SIMULATOR_DATABASE", fallback, 0);
+    remove(getenv("SIMULATOR_DATABASE"));
+}
+
+
+/*
+ * Writes `json` to the file named by the `variable` environment variable, `fallback` if it is not set
+ */
+void simulator_write_json(cJSON *json, const char *variable, const char *fallback) {
+    const char *output = getenv(variable);
+    if (output == NULL) {
+        output = fallback;
+    }
+
+    char *string = cJSON_Print(json);
+    FILE *f      = fopen(output, "w");
+    if (f == NULL) {
+        ESP_LOGE(TAG, "Could not write %s", output);
+    } else {
+        fputs(string, f);
+        fclose(f);
+        ESP_LOGI(TAG, "Results written to %s", output);
+    }
+    cJSON_free(string);
+}
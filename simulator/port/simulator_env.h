@@ -0,0 +1,17 @@
+#ifndef SIMULATOR_ENV_H_INCLUDED
+#define SIMULATOR_ENV_H_INCLUDED
+
+
+#include "cJSON.h"
+
+
+/*
+ * What every simulator program needs from its environment: numeric settings, a blank database and a place for the
+ * JSON results
+ */
+unsigned long simulator_env_number(const char *name, unsigned long fallback);
+void          simulator_blank_database(const char *fallback);
+void          simulator_write_json(cJSON *json, const char *variable, const char *fallback);
+
+
+#endif
@@ -3,34 +3,68 @@
 #include <string.h>
 #include <stdint.h>
 #include <stdio.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "services/system_time.h"
 #include "cJSON.h"
 #include "b64.h"
 #include "simulator/cJSON/cJSON.h"
 
 
-#define DATABASE_FILE ".simulator_db.json"
+/*
+ * The database is parsed once at startup and kept in memory; changes are written back by a task WRITE_BEHIND_MS
+ * after the first save of a burst (or on storage_flush), going through a temporary file and a rename so that an
+ * interrupted run never leaves a truncated database behind.
+ */
 
 
-static char database_read[10000] = {0};
+#define DATABASE_FILE   ".simulator_db.json"
+#define WRITE_BEHIND_MS 1000
 
 
-static cJSON *read_database();
-static void   write_database(cJSON *json);
+static cJSON *read_database(void);
+static void   write_database(void);
 static int    load_number(double *value, char *key);
-static int    save_number(double value, char *key);
+static void   save_number(double value, char *key);
+static void   save_item(cJSON *item, char *key);
+static void   storage_task(void *args);
+
+
+static cJSON            *database       = NULL;
+static SemaphoreHandle_t sem            = NULL;
+static SemaphoreHandle_t file_sem       = NULL;
+static TaskHandle_t      task           = NULL;
+static uint8_t           dirty          = 0;
+static char              path[256]      = DATABASE_FILE;
+static char              temp_path[260] = DATABASE_FILE ".tmp";
+
+
+void storage_init(void) {
+    static StaticSemaphore_t sem_buffer;
+    sem = xSemaphoreCreateMutexStatic(&sem_buffer);
+    static StaticSemaphore_t file_sem_buffer;
+    file_sem = xSemaphoreCreateMutexStatic(&file_sem_buffer);
+
+    // Separate runs (e.g. the benchmarks) can use their own database
+    const char *name = getenv("SIMULATOR_DATABASE");
+    if (name != NULL) {
+        snprintf(path, sizeof(path), "%s", name);
+        snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    }
+
+    database = read_database();
+    xTaskCreate(storage_task, "Storage", configMINIMAL_STACK_SIZE * 4, NULL, 1, &task);
+}
 
 
-void storage_init(void) {}
+void storage_flush(void) {
+    write_database();
+}
 
 
 int storage_load_double(double *value, char *key) {
-    double number = 0;
-    if (load_number(&number, key)) {
-        return -1;
-    } else {
-        *value = (double)number;
-        return 0;
-    }
+    return load_number(value, key);
 }
 
 
@@ -92,106 +126,168 @@ int storage_load_uint64(uint64_t *value, char *key) {
     if (load_number(&number, key)) {
         return -1;
     } else {
-        *value = (uint8_t)number;
+        *value = (uint64_t)number;
         return 0;
     }
 }
 
 
 void storage_save_uint64(uint64_t *value, char *key) {
-    save_number(*value, key);
+    save_number((double)*value, key);
 }
 
 
 int storage_load_blob(void *value, size_t len, char *key) {
-    cJSON *json    = read_database();
-    cJSON *encoded = cJSON_GetObjectItemCaseSensitive(json, key);
+    int res = 0;
+
+    xSemaphoreTake(sem, portMAX_DELAY);
+    cJSON *encoded = cJSON_GetObjectItemCaseSensitive(database, key);
     if (!cJSON_IsString(encoded)) {
         printf("Mi aspettavo una stringa (b64) per %s\n", key);
-        cJSON_free(encoded);
-        cJSON_free(json);
-        return -1;
+        res = -1;
     } else {
-        unsigned char *decoded = b64_decode_ex((const char *)encoded->valuestring, strlen(encoded->valuestring), NULL);
-        memcpy(value, decoded, len);
-        cJSON_free(encoded);
-        cJSON_free(json);
+        size_t         decoded_len = 0;
+        unsigned char *decoded =
+            b64_decode_ex((const char *)encoded->valuestring, strlen(encoded->valuestring), &decoded_len);
+        memcpy(value, decoded, decoded_len < len ? decoded_len : len);
         free(decoded);
-        return 0;
     }
+    xSemaphoreGive(sem);
+
+    return res;
 }
 
 
 void storage_save_blob(void *value, size_t len, char *key) {
-    char * encoded = b64_encode((unsigned char *)value, len);
-    cJSON *json    = read_database();
-    cJSON_DeleteItemFromObjectCaseSensitive(json, key);
-    if (cJSON_AddStringToObject(json, key, encoded) == NULL) {
-        printf("Non sono riuscito ad aggiungere %s", key);
-    } else {
-        write_database(json);
-    }
-    cJSON_free(json);
+    char *encoded = b64_encode((unsigned char *)value, len);
+    save_item(cJSON_CreateString(encoded), key);
     free(encoded);
 }
 
 
-static cJSON *read_database() {
-    FILE *f = fopen(DATABASE_FILE, "r");
+static cJSON *read_database(void) {
+    FILE *f = fopen(path, "r");
     if (f == NULL) {
         printf("Database file non trovato\n");
-        return cJSON_Parse("{}");
+        return cJSON_CreateObject();
     }
 
     fseek(f, 0, SEEK_END);
     long fsize = ftell(f);
     fseek(f, 0, SEEK_SET); /* same as rewind(f); */
 
-    fread(database_read, 1, fsize, f);
+    char *content = malloc(fsize + 1);
+    assert(content != NULL);
+    size_t read   = fread(content, 1, fsize, f);
+    content[read] = '\0';
     fclose(f);
-    return cJSON_Parse(database_read);
+
+    cJSON *json = cJSON_Parse(content);
+    free(content);
+
+    if (json == NULL) {
+        printf("Database non valido, riparto da zero\n");
+        return cJSON_CreateObject();
+    }
+    return json;
 }
 
 
-static void write_database(cJSON *json) {
-    FILE *f = fopen(DATABASE_FILE, "w");
+static void write_database(void) {
+    // The write-behind task and storage_flush share the temporary file
+    xSemaphoreTake(file_sem, portMAX_DELAY);
+    xSemaphoreTake(sem, portMAX_DELAY);
+    if (!dirty) {
+        xSemaphoreGive(sem);
+        xSemaphoreGive(file_sem);
+        return;
+    }
+    char *string = cJSON_Print(database);
+    if (string == NULL) {
+        // Still dirty, the next write tries again
+        xSemaphoreGive(sem);
+        xSemaphoreGive(file_sem);
+        printf("Non sono riuscito a serializzare il database\n");
+        return;
+    }
+    dirty = 0;
+    xSemaphoreGive(sem);
+
+    FILE *f = fopen(temp_path, "w");
     if (f == NULL) {
         printf("Non sono riuscito a scrivere il database\n");
-        return;
+    } else {
+        size_t len     = strlen(string);
+        int    written = fwrite(string, 1, len, f) == len;
+        // Closed in any case, a failed write must not leave the handle open
+        written = fclose(f) == 0 && written;
+
+        if (!written) {
+            printf("Non sono riuscito a scrivere il database\n");
+            remove(temp_path);
+        } else if (rename(temp_path, path)) {
+            printf("Non sono riuscito a sostituire il database\n");
+            remove(temp_path);
+        }
     }
 
-    char *string = cJSON_Print(json);
-    fwrite(string, 1, strlen(string), f);
-    free(string);
-    fclose(f);
+    cJSON_free(string);
+    xSemaphoreGive(file_sem);
 }
 
 
 static int load_number(double *value, char *key) {
-    cJSON *json   = read_database();
-    cJSON *number = cJSON_GetObjectItemCaseSensitive(json, key);
+    int res = 0;
+
+    xSemaphoreTake(sem, portMAX_DELAY);
+    cJSON *number = cJSON_GetObjectItemCaseSensitive(database, key);
     if (!cJSON_IsNumber(number)) {
         printf("Mi aspettavo un numero per %s\n", key);
-        cJSON_free(number);
-        cJSON_free(json);
-        return -1;
+        res = -1;
     } else {
-        cJSON_free(json);
         *value = number->valuedouble;
-        return 0;
     }
+    xSemaphoreGive(sem);
+
+    return res;
+}
+
+
+static void save_number(double value, char *key) {
+    save_item(cJSON_CreateNumber(value), key);
 }
 
-static int save_number(double value, char *key) {
-    cJSON *json = read_database();
-    cJSON_DeleteItemFromObjectCaseSensitive(json, key);
-    if (cJSON_AddNumberToObject(json, key, value) == NULL) {
+
+static void save_item(cJSON *item, char *key) {
+    if (item == NULL) {
         printf("Non sono riuscito ad aggiungere %s\n", key);
-        cJSON_free(json);
-        return -1;
+        return;
+    }
+
+    xSemaphoreTake(sem, portMAX_DELAY);
+    if (cJSON_GetObjectItemCaseSensitive(database, key) != NULL) {
+        cJSON_ReplaceItemInObjectCaseSensitive(database, key, item);
     } else {
-        write_database(json);
-        cJSON_free(json);
-        return 0;
+        cJSON_AddItemToObject(database, key, item);
+    }
+    dirty = 1;
+    xSemaphoreGive(sem);
+
+    xTaskNotifyGive(task);
+}
+
+
+/*
+ * Write-behind: a burst of saves results in a single write, WRITE_BEHIND_MS after the first one
+ */
+static void storage_task(void *args) {
+    (void)args;
+
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        vTaskDelay(pdMS_TO_TICKS(WRITE_BEHIND_MS));
+        write_database();
     }
+
+    vTaskDelete(NULL);
 }
@@ -0,0 +1,84 @@
+#include <time.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "esp_log.h"
+#include "services/system_time.h"
+#include "virtual_time.h"
+
+#ifndef __MINGW32__
+#include <sys/time.h>
+#endif
+
+
+/*
+ * The kernel calls virtual_time_sleep from the idle task, with the scheduler suspended, when no task can run for
+ * `idle_ticks`. Instead of waiting those ticks are pended right away and the kernel processes them one by one as
+ * soon as it resumes, so timeouts, delays and the tick overflow behave exactly as in real time.
+ * With the tick timer stopped the only source of time is the firmware itself: runs with the same seed and inputs
+ * are repeatable.
+ */
+
+
+#define MAX_JUMP_TICKS 1000     // Bounds the jump when every task waits forever
+
+
+static unsigned long wall_ms(void);
+
+
+static const char   *TAG                 = "VirtualTime";
+static uint64_t      virtual_ticks       = 0;     // Every tick comes from a jump
+static unsigned long start_wall_ms       = 0;
+int                  virtual_time_active = 0;
+
+
+void virtual_time_init(void) {
+#ifdef __MINGW32__
+    ESP_LOGW(TAG, "Not supported on this platform, running in real time");
+#else
+    // The POSIX port drives the tick with a real time interval timer
+    struct itimerval stop = {0};
+    setitimer(ITIMER_REAL, &stop, NULL);
+
+    start_wall_ms       = wall_ms();
+    virtual_time_active = 1;
+    ESP_LOGI(TAG, "Running in virtual time");
+#endif
+}
+
+
+void virtual_time_sleep(unsigned long idle_ticks) {
+    if (!virtual_time_active) {
+        return;
+    }
+
+    idle_ticks = MIN(idle_ticks, MAX_JUMP_TICKS);
+    for (unsigned long i = 0; i < idle_ticks; i++) {
+        // The scheduler is suspended: the tick is only pended
+        xTaskIncrementTick();
+    }
+    virtual_ticks += idle_ticks;
+}
+
+
+/*
+ * How many times faster than real time the simulation went since virtual_time_init
+ */
+double virtual_time_speedup(void) {
+    if (!virtual_time_active) {
+        return 1.;
+    }
+
+    unsigned long real_ms = wall_ms() - start_wall_ms;
+    return real_ms > 0 ? (double)(virtual_ticks * portTICK_PERIOD_MS) / real_ms : 1.;
+}
+
+
+static unsigned long wall_ms(void) {
+#ifdef __MINGW32__
+    return 0;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000UL;
+#endif
+}
@@ -0,0 +1,17 @@
+#ifndef VIRTUAL_TIME_H_INCLUDED
+#define VIRTUAL_TIME_H_INCLUDED
+
+
+/*
+ * Virtual time: the tick stops following the wall clock and only moves forward when every task is blocked,
+ * straight to the next wake up. Hooked into the kernel through the tickless idle macros in FreeRTOSConfig.h
+ */
+void   virtual_time_init(void);
+void   virtual_time_sleep(unsigned long idle_ticks);
+double virtual_time_speedup(void);
+
+
+extern int virtual_time_active;
+
+
+#endif
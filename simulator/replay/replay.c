@@ -0,0 +1,120 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include "FreeRTOS.h"
+#include "task.h"
+#include "esp_log.h"
+#include "cJSON.h"
+#include "model/model.h"
+#include "controller/controller.h"
+#include "bsp/interface.h"
+#include "bsp/safety.h"
+#include "bsp/rs485.h"
+#include "bsp/storage.h"
+#include "services/wakeup.h"
+#include "services/system_time.h"
+#include "emulator/easyconnect_bus.h"
+#include "emulator/session.h"
+#include "simulated.h"
+#include "virtual_time.h"
+#include "simulator_env.h"
+
+
+/*
+ * Runs the firmware against a recorded session (REPLAY_SESSION) instead of the device emulator, in virtual time and
+ * from a blank database, and writes how it diverged from the recording to REPLAY_OUTPUT. The run fails if there are
+ * more than REPLAY_MAX_DIVERGENCES divergences or, when REPLAY_MAX_DELTA_US is set, if a request went out further
+ * than that from its recorded time. The baud rate must be the one of the recording (SIMULATOR_BAUDRATE).
+ */
+
+
+#define TAIL_MS 2000     // Kept running after the end of the session, for the last replies to be handled
+
+
+static unsigned long apply_inputs(void);
+
+
+static const char *TAG = "Replay";
+
+
+void app_main(void *arg) {
+    mut_model_t model;
+    (void)arg;
+
+    virtual_time_init();
+
+    simulator_blank_database(".replay_db.json");
+
+    // Only the timing of the line is needed, the devices are never asked
+    easyconnect_bus_config_t bus_config = {
+        .baudrate   = simulator_env_number("SIMULATOR_BAUDRATE", 0),
+        .latency_us = 0,
+    };
+    easyconnect_bus_init(0, &bus_config);
+
+    const char *path = getenv("REPLAY_SESSION");
+    if (path == NULL) {
+        ESP_LOGE(TAG, "Set REPLAY_SESSION to the session to replay");
+        exit(1);
+    } else if (session_load(path)) {
+        exit(1);
+    }
+
+    wakeup_init();
+    safety_init();
+    interface_init();
+    rs485_init();
+    storage_init();
+
+    model_init(&model);
+    controller_init(&model);
+
+    unsigned long duration = session_duration_ms() + TAIL_MS;
+    unsigned long start_ts = get_millis();
+
+    ESP_LOGI(TAG, "Replaying %s, %lu ms", path, duration);
+    while (!is_expired(start_ts, get_millis(), duration)) {
+        unsigned long next = apply_inputs();
+        next               = MIN(next, controller_manage(&model));
+        next               = MIN(next, time_remaining(start_ts, get_millis(), duration));
+        wakeup_wait(next);
+    }
+
+    size_t        divergences  = 0;
+    unsigned long max_delta_us = 0;
+    cJSON        *json         = session_report(&divergences, &max_delta_us);
+    cJSON_AddStringToObject(json, "session", path);
+    simulator_write_json(json, "REPLAY_OUTPUT", "replay.json");
+    cJSON_Delete(json);
+
+    unsigned long max_divergences = simulator_env_number("REPLAY_MAX_DIVERGENCES", 0);
+    unsigned long max_delta       = simulator_env_number("REPLAY_MAX_DELTA_US", 0);
+    ESP_LOGI(TAG, "%zu divergences, timing off by %lu us at most", divergences, max_delta_us);
+
+    if (divergences > max_divergences || (max_delta > 0 && max_delta_us > max_delta)) {
+        ESP_LOGE(TAG, "The firmware does not behave as in %s", path);
+        exit(1);
+    }
+    exit(0);
+}
+
+
+/*
+ * Applies the inputs that are due; returns the time until the next one
+ */
+static unsigned long apply_inputs(void) {
+    session_input_t input;
+    uint8_t         value;
+    unsigned long   wait_ms;
+
+    while (session_take_input(&input, &value, &wait_ms)) {
+        switch (input) {
+            case SESSION_INPUT_SAFETY:
+                safety_simulate_input(value);
+                break;
+            case SESSION_INPUT_LONG_PRESS:
+                interface_simulate_long_press();
+                break;
+        }
+    }
+    return wait_ms;
+}
@@ -1,27 +1,63 @@
+#include <stdlib.h>
 #include "FreeRTOS.h"
 #include "task.h"
 #include "esp_log.h"
 
 #include "model/model.h"
 #include "controller/controller.h"
+#include "bsp/interface.h"
+#include "bsp/safety.h"
+#include "bsp/rs485.h"
+#include "bsp/storage.h"
+#include "services/wakeup.h"
+#include "emulator/easyconnect_bus.h"
+#include "emulator/fault_injection.h"
+#include "emulator/session.h"
+#include "virtual_time.h"
+#include "simulator_env.h"
+
+
 
 
 static const char *TAG = "Main";
 
 
 void app_main(void *arg) {
-    model_t model;
+    mut_model_t model;
     (void)arg;
 
+    if (simulator_env_number("SIMULATOR_VIRTUAL_TIME", 0)) {
+        virtual_time_init();
+    }
+    // Everything the firmware gets from the bus and the inputs, to replay it later
+    if (session_record(getenv("SIMULATOR_SESSION"))) {
+        exit(1);
+    }
+
+    // The emulated line can be tuned from the environment
+    easyconnect_bus_config_t bus_config = {
+        .baudrate   = simulator_env_number("SIMULATOR_BAUDRATE", 0),
+        .latency_us = simulator_env_number("SIMULATOR_LATENCY_US", 1000),
+    };
+    easyconnect_bus_init(simulator_env_number("SIMULATOR_DEVICES", MODBUS_MAX_DEVICES), &bus_config);
+    fault_injection_init(simulator_env_number("SIMULATOR_SEED", 1));
+    if (fault_injection_parse(getenv("SIMULATOR_FAULTS"))) {
+        exit(1);
+    }
+
+    wakeup_init();
+    safety_init();
+    interface_init();
+    rs485_init();
+    storage_init();
+
     model_init(&model);
-    // view_init(&model);
     controller_init(&model);
 
     ESP_LOGI(TAG, "Begin main loop");
     for (;;) {
-        ESP_LOGI(TAG, "Hello simulated world!");
-        vTaskDelay(pdMS_TO_TICKS(1000));
+        wakeup_wait(controller_manage(&model));
     }
 
     vTaskDelete(NULL);
-}
\ No newline at end of file
+}
@@ -0,0 +1,210 @@
+#!/usr/bin/env python
+import re
+import struct
+import argparse
+
+
+"""
+Converts a dump of the RS485 frame capture (services/capture.c) found in a device log to a pcap file that protocol
+analysers can open. Frames are written with the LINKTYPE_USER0 link type: in Wireshark, map it to the "mbrtu"
+protocol under Preferences > Protocols > DLT_USER.
+
+The classic pcap format has no room for the direction of a frame; with --ng the output is pcapng and every frame is
+marked as inbound (from a device) or outbound (from the controller).
+
+The dump lists the chunks spilled to flash, then the bytes still in RAM, as a single stream of frames. Each chunk
+and the RAM part tell where their first frame starts, so that the stream can be picked up again after a missing
+chunk or a reboot; frames cut in the middle are left out and counted.
+
+With --session the frames are written instead as a session that the simulator can replay
+(simulator/emulator/session.c): a field capture becomes a regression case.
+"""
+
+LINKTYPE_USER0 = 147
+HEADER = struct.Struct("<IHBB")
+MAX_FRAME = 256
+NO_FRAME = 0xFF
+
+DIRECTION_TX = 0
+FLAG_BOOT = 0x01
+
+# Gap left between the frames of two runs, whose timestamps are unrelated
+BOOT_GAP_US = 1000000
+
+
+def read_log(path):
+    """
+    Returns the segments of the last dump as (contiguous, first, data) and the frames dropped by the firmware
+    """
+    segments = None
+    dropped = 0
+    contiguous = False
+
+    with open(path, 'r', errors='replace') as f:
+        for line in f:
+            match = re.search(r"Capture: ([0-9a-z ]+)", re.sub(r"\x1b\[[0-9;]*m", "", line))
+            if not match:
+                continue
+            fields = match.group(1).split()
+
+            if fields[0] == "begin":
+                segments = []
+                dropped = int(fields[1])
+                contiguous = False
+            elif segments is None:
+                continue
+            elif fields[0] in ("chunk", "ram"):
+                segments.append((contiguous, int(fields[1]), bytearray.fromhex("".join(fields[2:]))))
+                contiguous = True
+            elif fields[0] == "gap":
+                contiguous = False
+            elif fields[0] == "end":
+                break
+            elif segments:
+                segments[-1][2].extend(bytes.fromhex(fields[0]))
+
+    if segments is None:
+        raise ValueError(f"{path}: no capture dump found")
+    return segments, dropped
+
+
+def parse(buffer):
+    """
+    Takes the complete frames at the start of the buffer; returns them and what is left
+    """
+    frames = []
+    offset = 0
+
+    while len(buffer) - offset >= HEADER.size:
+        timestamp, length, direction, flags = HEADER.unpack_from(buffer, offset)
+        if length > MAX_FRAME:
+            raise ValueError("out of sync")
+        if len(buffer) - offset < HEADER.size + length:
+            break
+        data = bytes(buffer[offset + HEADER.size:offset + HEADER.size + length])
+        frames.append((timestamp, direction, flags, data))
+        offset += HEADER.size + length
+
+    return frames, buffer[offset:]
+
+
+def rebuild(segments):
+    frames = []
+    broken = 0
+    pending = None     # Bytes after the last frame boundary, None when the position of the next one is unknown
+
+    for contiguous, first, data in segments:
+        if not contiguous:
+            pending = None
+
+        if first == NO_FRAME or first > len(data):
+            if pending is not None:
+                pending += data
+        else:
+            if pending is not None:
+                pending += data[:first]
+                complete, pending = parse(pending)
+                frames += complete
+                broken += 1 if pending else 0
+            elif first > 0:
+                broken += 1
+            pending = bytearray(data[first:])
+
+        if pending is not None:
+            try:
+                complete, pending = parse(pending)
+                frames += complete
+            except ValueError:
+                pending = None
+                broken += 1
+
+    return frames, broken
+
+
+def unwrap(frames):
+    """
+    Timestamps are 32 bit microseconds, restarting at every boot
+    """
+    result = []
+    base = 0
+    previous = None
+
+    for timestamp, direction, flags, data in frames:
+        if previous is None:
+            pass
+        elif flags & FLAG_BOOT:
+            base += BOOT_GAP_US
+        else:
+            base += (timestamp - previous) & 0xFFFFFFFF
+        previous = timestamp
+        result.append((base, direction, data))
+
+    return result
+
+
+def write_pcap(f, frames):
+    f.write(struct.pack("<IHHiIII", 0xA1B2C3D4, 2, 4, 0, 0, 65535, LINKTYPE_USER0))
+    for ts, _, data in frames:
+        f.write(struct.pack("<IIII", ts // 1000000, ts % 1000000, len(data), len(data)))
+        f.write(data)
+
+
+def write_pcapng(f, frames):
+    def block(kind, body):
+        body += b"\0" * (-len(body) % 4)
+        f.write(struct.pack("<II", kind, len(body) + 12) + body + struct.pack("<I", len(body) + 12))
+
+    block(0x0A0D0D0A, struct.pack("<IHHq", 0x1A2B3C4D, 1, 0, -1))
+    block(0x00000001, struct.pack("<HHI", LINKTYPE_USER0, 0, 0))
+    for ts, direction, data in frames:
+        # epb_flags: 1 inbound, 2 outbound
+        flags = struct.pack("<HHI", 2, 4, 2 if direction == DIRECTION_TX else 1) + struct.pack("<HH", 0, 0)
+        packet = data + b"\0" * (-len(data) % 4)
+        block(0x00000006, struct.pack("<IIIII", 0, ts >> 32, ts & 0xFFFFFFFF, len(data), len(data)) + packet + flags)
+
+
+def first_run(frames):
+    """
+    A replay starts from boot: only the frames up to the next reboot are kept
+    """
+    for index, (_, _, flags, _) in enumerate(frames):
+        if index > 0 and flags & FLAG_BOOT:
+            return frames[:index]
+    return frames
+
+
+def write_session(f, frames):
+    """
+    The timestamp of a received frame is when the read returned, which is when the reply was complete
+    """
+    f.write(b"# easyconnect session 1\n")
+    for ts, direction, data in frames:
+        kind = "tx" if direction == DIRECTION_TX else "rx"
+        f.write(f"{ts - frames[0][0]} {kind} {data.hex()}\n".encode())
+
+
+def main(source, output, ng, session):
+    segments, dropped = read_log(source)
+    frames, broken = rebuild(segments)
+    frames = unwrap(first_run(frames) if session else frames)
+
+    with open(output, 'wb') as f:
+        if session:
+            write_session(f, frames)
+        else:
+            (write_pcapng if ng else write_pcap)(f, frames)
+
+    print(f"{len(frames)} frames written to {output}; {dropped} dropped by the device, {broken} cut by the dump")
+    if not session:
+        print("In Wireshark, map DLT_USER 0 (147) to mbrtu under Preferences > Protocols > DLT_USER")
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description="Conversion of the RS485 frame capture to pcap")
+    parser.add_argument('log', type=str, help='Device log with a capture dump')
+    parser.add_argument('-o', '--output', type=str, nargs='?', default='capture.pcap', help='Capture file')
+    parser.add_argument('--ng', action='store_true', help='Write pcapng, with the direction of every frame')
+    parser.add_argument('--session', action='store_true', help='Write a session for the simulator replay')
+    args = parser.parse_args()
+
+    main(args.log, args.output, args.ng, args.session)
@@ -0,0 +1,161 @@
+#!/usr/bin/env python
+import os
+import re
+import csv
+import argparse
+
+
+"""
+Generates the device register map from a CSV table.
+
+Every row is a field; consecutive rows with the same block are read with a single request. The first row of a block
+also carries the starting register, the cache class and the model setter, written as `name(field, field, ...)` with
+the fields in the order the setter takes them. Blocks that are not polled into the model leave the cache class and
+the setter empty, and get neither macro. A field called `reserved` only takes up its registers: it is read with the
+block but neither stored nor decoded.
+
+Everything is emitted as macros so that the reads and decoders are specialised at compile time.
+"""
+
+RESERVED = "reserved"
+
+TYPES = {
+    "uint16": ("uint16_t", 1),
+    "int16": ("int16_t", 1),
+    "uint32": ("uint32_t", 2),
+}
+
+
+def create_scons_target(env, csvfile, outdir):
+    def operation(csvfile, outdir):
+        return lambda target, source, env: main(csvfile, outdir)
+
+    return env.Command(os.path.join(outdir, "AUTOGEN_FILE_registers.h"), csvfile, operation(csvfile, outdir))
+
+
+def parse(csvfile):
+    blocks = []
+
+    with open(csvfile, 'r') as f:
+        csvreader = csv.reader(f, delimiter=',', skipinitialspace=True)
+        csvreader.__next__()  # Drop the first line
+
+        for number, line in enumerate(csvreader, start=2):
+            line = [x.strip() for x in line]
+            if len(line) == 0 or not line[0]:
+                continue
+            if len(line) < 3:
+                raise ValueError(f"{csvfile}:{number}: block, field and type are required")
+
+            name, field, kind = line[:3]
+            if kind not in TYPES:
+                raise ValueError(f"{csvfile}:{number}: unknown type {kind}")
+
+            if not blocks or blocks[-1]["name"] != name:
+                if any(block["name"] == name for block in blocks):
+                    raise ValueError(f"{csvfile}:{number}: the fields of block {name} must be consecutive")
+                line += [""] * (6 - len(line))
+                if not line[3]:
+                    raise ValueError(f"{csvfile}:{number}: the first row of block {name} needs the start")
+                if bool(line[4]) != bool(line[5]):
+                    raise ValueError(f"{csvfile}:{number}: block {name} needs both cache and setter, or neither")
+
+                setter, arguments = None, []
+                if line[5]:
+                    match = re.fullmatch(r"(\w+)\((.*)\)", line[5])
+                    if not match:
+                        raise ValueError(f"{csvfile}:{number}: setter must be written as name(field, ...)")
+                    setter = match.group(1)
+                    arguments = [x.strip() for x in match.group(2).split(",") if x.strip()]
+
+                blocks.append({
+                    "name": name,
+                    "start": line[3],
+                    "cache": line[4],
+                    "setter": setter,
+                    "arguments": arguments,
+                    "fields": [],
+                })
+
+            blocks[-1]["fields"].append((field, kind))
+
+    for block in blocks:
+        names = [field for field, _ in block["fields"]]
+        for argument in block["arguments"]:
+            if argument not in names:
+                raise ValueError(f"{csvfile}: setter argument {argument} is not a field of block {block['name']}")
+
+    return blocks
+
+
+def decode(field, kind, offset):
+    ctype, words = TYPES[kind]
+    if words == 1:
+        return f"(dst).{field} = ({ctype})(registers)[{offset}];"
+    else:
+        return f"(dst).{field} = ((uint32_t)(registers)[{offset}] << 16) | (registers)[{offset + 1}];"
+
+
+def macro(name, lines):
+    width = max(len(x) for x in [name] + lines) + 1
+    content = f"#define {name}".ljust(width + 8) + "\\\n"
+    for i, line in enumerate(lines):
+        if i == len(lines) - 1:
+            content += f"    {line}\n"
+        else:
+            content += f"    {line}".ljust(width + 8) + "\\\n"
+    return content
+
+
+def main(csvfile, outdir):
+    print(f"Generating the register map from {csvfile} to {outdir}...")
+    blocks = parse(csvfile)
+
+    with open(os.path.join(outdir, "AUTOGEN_FILE_registers.h"), "w") as h:
+        h.write("#ifndef AUTOGEN_FILE_REGISTERS_H_INCLUDED\n")
+        h.write("#define AUTOGEN_FILE_REGISTERS_H_INCLUDED\n")
+        h.write(f"// Automatically generated from {os.path.basename(csvfile)}. Do not edit.\n\n")
+        h.write("#include <stdint.h>\n\n")
+
+        for block in blocks:
+            prefix = f"REGISTERS_{block['name'].upper()}"
+            count = sum(TYPES[kind][1] for _, kind in block["fields"])
+
+            h.write(f"\n// {block['name']}\n")
+            h.write(f"#define {prefix}_START ({block['start']})\n")
+            h.write(f"#define {prefix}_COUNT {count}\n")
+            if block["cache"]:
+                h.write(f"#define {prefix}_CACHE REGISTER_CLASS_{block['cache'].upper()}\n")
+            h.write("\n")
+
+            fields = [(field, kind) for field, kind in block["fields"] if field != RESERVED]
+            h.write(macro(f"{prefix}_FIELDS", [f"{TYPES[kind][0]} {field};" for field, kind in fields]))
+            h.write("\n")
+            h.write(f"typedef struct {{\n    {prefix}_FIELDS\n}} registers_{block['name']}_t;\n\n")
+
+            lines = []
+            offset = 0
+            for field, kind in block["fields"]:
+                if field != RESERVED:
+                    lines.append(decode(field, kind, offset))
+                offset += TYPES[kind][1]
+            h.write(macro(f"{prefix}_DECODE(dst, registers)", ["do {"] +
+                    ["    " + x for x in lines] + ["} while (0)"]))
+            h.write("\n")
+
+            if block["setter"]:
+                arguments = ", ".join(f"(src).{x}" for x in block["arguments"])
+                h.write(f"#define {prefix}_APPLY(pmodel, address, src) "
+                        f"{block['setter']}(pmodel, address, {arguments})\n")
+
+        h.write("\n#endif\n")
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description="Generation of the device register map")
+    parser.add_argument('csv', type=str, help='Register table')
+    parser.add_argument('-o', '--output', type=str, nargs='?', default='.',
+                        help='Folder where the generated header is saved')
+    args = parser.parse_args()
+
+    main(args.csv, args.output)
@@ -0,0 +1,157 @@
+#!/usr/bin/env python
+import os
+import re
+import json
+import struct
+import argparse
+
+
+"""
+Converts a dump of the firmware event trace (services/trace.c) to the Chrome trace format, to be opened with
+chrome://tracing or https://ui.perfetto.dev.
+
+The input is either a binary file of records (as written by the benchmark with BENCHMARK_TRACE) or a device log
+with the hex lines of trace_dump(); in the latter case the last dump is used. Event, message and response names are
+read from the firmware sources.
+
+Transactions (from the request to its outcome) and main loop passes become slices, the length of the Modbus queue a
+counter, everything else instant events.
+"""
+
+ROOT = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+RECORD = struct.Struct("<IHH")
+
+TRACKS = {
+    "MODBUS": (1, "Modbus task"),
+    "WAKEUP": (2, "Main loop"),
+    "CONTROLLER": (2, "Main loop"),
+    "OBSERVER": (3, "Observer"),
+    "SAFETY": (4, "Safety"),
+}
+
+OUTCOMES = ("MODBUS_ANSWER", "MODBUS_BAD_ANSWER", "MODBUS_TIMEOUT")
+
+
+def enum_names(path, prefix):
+    names = {}
+    value = 0
+
+    with open(path, 'r') as f:
+        for match in re.finditer(rf"^\s*{prefix}(\w+)\s*(?:=\s*(\w+))?\s*,", f.read(), re.MULTILINE):
+            if match.group(2) is not None:
+                value = int(match.group(2), 0)
+            names[value] = match.group(1)
+            value += 1
+
+    return names
+
+
+def read_binary(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+    return [RECORD.unpack_from(data, offset) for offset in range(0, len(data) - RECORD.size + 1, RECORD.size)]
+
+
+def read_log(path):
+    data = None
+
+    with open(path, 'r', errors='replace') as f:
+        for line in f:
+            if re.search(r"Trace: begin", line):
+                data = bytearray()
+            elif data is not None:
+                match = re.search(r"Trace: ([0-9a-f]{16,})", line)
+                if match:
+                    data += bytes.fromhex(match.group(1))
+
+    if data is None:
+        raise ValueError(f"{path}: no trace dump found")
+    return [RECORD.unpack_from(data, offset) for offset in range(0, len(data) - RECORD.size + 1, RECORD.size)]
+
+
+def unwrap(records):
+    """
+    Timestamps are 32 bit microseconds; a record written while the dump was taken can be slightly out of order
+    """
+    result = []
+    base = 0
+    previous = None
+
+    for timestamp, event, arg in records:
+        if previous is not None:
+            delta = (timestamp - previous) & 0xFFFFFFFF
+            if delta >= 0x80000000:
+                delta -= 0x100000000
+            base += delta
+        previous = timestamp
+        result.append((base, event, arg))
+
+    return result
+
+
+def convert(records, events, messages, responses):
+    output = []
+    pending = {}
+    passes = None
+    queue = 0
+
+    for tid, name in sorted(set(TRACKS.values())):
+        output.append({"name": "thread_name", "ph": "M", "pid": 1, "tid": tid, "args": {"name": name}})
+
+    for ts, event, arg in records:
+        name = events.get(event, f"EVENT_{event}")
+        tid = next((track[0] for prefix, track in TRACKS.items() if name.startswith(prefix)), 0)
+        high, low = arg >> 8, arg & 0xFF
+
+        if name == "MODBUS_SEND":
+            pending[low] = (ts, high)
+        elif name in OUTCOMES and low in pending:
+            begin, function = pending.pop(low)
+            output.append({"name": f"0x{function:02X} to {low}", "cat": name.lower(), "ph": "X", "ts": begin,
+                           "dur": ts - begin, "pid": 1, "tid": tid,
+                           "args": {"address": low, "function": function, "outcome": name}})
+        elif name == "CONTROLLER_BEGIN":
+            passes = ts
+        elif name == "CONTROLLER_END" and passes is not None:
+            output.append({"name": "controller_manage", "ph": "X", "ts": passes, "dur": ts - passes, "pid": 1,
+                           "tid": tid, "args": {"next_ms": arg}})
+            passes = None
+        else:
+            args = {"arg": arg}
+            if name in ("MODBUS_ENQUEUE", "MODBUS_DROP", "MODBUS_DEQUEUE"):
+                args = {"message": messages.get(high, high), "address": low}
+            elif name in ("MODBUS_RESPONSE", "CONTROLLER_RESPONSE"):
+                args = {"response": responses.get(high, high), "address": low}
+            output.append({"name": name, "ph": "i", "s": "t", "ts": ts, "pid": 1, "tid": tid, "args": args})
+
+        if name in ("MODBUS_ENQUEUE", "MODBUS_DEQUEUE"):
+            # The trace may start with messages already queued
+            queue = max(0, queue + (1 if name == "MODBUS_ENQUEUE" else -1))
+            output.append({"name": "Modbus queue", "ph": "C", "ts": ts, "pid": 1, "args": {"messages": queue}})
+
+    # Broadcasts and transactions cut by the end of the trace have no outcome
+    for address, (ts, function) in pending.items():
+        output.append({"name": f"0x{function:02X} to {address}", "ph": "i", "s": "t", "ts": ts, "pid": 1,
+                       "tid": TRACKS["MODBUS"][0]})
+
+    return {"traceEvents": output, "displayTimeUnit": "ms"}
+
+
+def main(source, output, is_log):
+    events = enum_names(os.path.join(ROOT, "main", "services", "trace.h"), "TRACE_EVENT_")
+    messages = enum_names(os.path.join(ROOT, "main", "controller", "modbus.c"), "TASK_MESSAGE_CODE_")
+    responses = enum_names(os.path.join(ROOT, "main", "controller", "modbus.h"), "MODBUS_RESPONSE_CODE_")
+
+    records = unwrap(read_log(source) if is_log else read_binary(source))
+    with open(output, 'w') as f:
+        json.dump(convert(records, events, messages, responses), f)
+
+
+if __name__ == '__main__':
+    parser = argparse.ArgumentParser(description="Conversion of the event trace to the Chrome trace format")
+    parser.add_argument('trace', type=str, help='Binary trace or device log')
+    parser.add_argument('-o', '--output', type=str, nargs='?', default='trace.json', help='Chrome trace file')
+    parser.add_argument('-l', '--log', action='store_true', help='The input is a device log with a trace dump')
+    args = parser.parse_args()
+
+    main(args.trace, args.output, args.log)